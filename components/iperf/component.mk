@@ -9,3 +9,21 @@
 
 #include $(IDF_PATH)/make/component_common.mk
 COMPONENT_ADD_INCLUDEDIRS := .
+
+ifdef CONFIG_IPERF_TLS
+COMPONENT_EMBED_TXTFILES := certs/iperf_test_cert.pem certs/iperf_test_key.pem
+endif
+
+# make IPERF_IRAM=none|servers|clients|engines|all overrides CONFIG_IPERF_IRAM_*,
+# so every variant can be built for comparison without going through menuconfig
+IPERF_IRAM_none := 0
+IPERF_IRAM_servers := 1
+IPERF_IRAM_clients := 2
+IPERF_IRAM_engines := 3
+IPERF_IRAM_all := 7
+ifdef IPERF_IRAM
+ifeq ($(IPERF_IRAM_$(IPERF_IRAM)),)
+$(error IPERF_IRAM must be one of: none servers clients engines all)
+endif
+CFLAGS += -DIPERF_IRAM_VARIANT=$(IPERF_IRAM_$(IPERF_IRAM))
+endif
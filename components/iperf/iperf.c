@@ -9,19 +9,210 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <math.h>
 #include <sys/socket.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/queue.h"
 #include "esp_log.h"
+#include "esp_partition.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "rom/ets_sys.h"
+#include "lwip/tcp.h"
+#include "lwip/udp.h"
+#include "lwip/priv/tcpip_priv.h"
+#include "lwip/priv/sockets_priv.h"
 #include "iperf.h"
+#include "iperf_capture.h"
+#include "iperf_trace.h"
+#if CONFIG_IPERF_TLS
+#include "mbedtls/ssl.h"
+#include "mbedtls/net_sockets.h"
+#include "mbedtls/ctr_drbg.h"
+#include "mbedtls/entropy.h"
+#include "mbedtls/x509_crt.h"
+#include "mbedtls/pk.h"
+#include "mbedtls/error.h"
+#endif
+
+/* engine code placed in IRAM, CONFIG_IPERF_IRAM_*; a build can override it with IPERF_IRAM=<variant> to
+   compare them (see component.mk/CMakeLists.txt) */
+#define IPERF_IRAM_SERVERS 1
+#define IPERF_IRAM_CLIENTS 2
+#define IPERF_IRAM_REPORT 4
+
+#ifndef IPERF_IRAM_VARIANT
+#if CONFIG_IPERF_IRAM_NONE
+#define IPERF_IRAM_VARIANT 0
+#elif CONFIG_IPERF_IRAM_CLIENTS
+#define IPERF_IRAM_VARIANT IPERF_IRAM_CLIENTS
+#elif CONFIG_IPERF_IRAM_ENGINES
+#define IPERF_IRAM_VARIANT (IPERF_IRAM_SERVERS | IPERF_IRAM_CLIENTS)
+#elif CONFIG_IPERF_IRAM_ALL
+#define IPERF_IRAM_VARIANT (IPERF_IRAM_SERVERS | IPERF_IRAM_CLIENTS | IPERF_IRAM_REPORT)
+#else
+#define IPERF_IRAM_VARIANT IPERF_IRAM_SERVERS
+#endif
+#endif
+
+#if IPERF_IRAM_VARIANT & IPERF_IRAM_SERVERS
+#define IPERF_SERVER_ATTR IRAM_ATTR
+#else
+#define IPERF_SERVER_ATTR
+#endif
+#if IPERF_IRAM_VARIANT & IPERF_IRAM_CLIENTS
+#define IPERF_CLIENT_ATTR IRAM_ATTR
+#else
+#define IPERF_CLIENT_ATTR
+#endif
+#if IPERF_IRAM_VARIANT & IPERF_IRAM_REPORT
+#define IPERF_REPORT_ATTR IRAM_ATTR
+#else
+#define IPERF_REPORT_ATTR
+#endif
+
+#if CONFIG_IPERF_CALL_HISTOGRAM
+#define IPERF_HIST_BUCKETS 16       /* bucket n counts calls of [2^(n-1), 2^n) us, the last one everything longer */
+#define IPERF_HIST_BLOCKED_US 1000  /* calls at least this long are counted as blocked */
 
 typedef struct {
+    uint32_t calls;
+    uint32_t blocked;
+    uint32_t max_us;
+    uint64_t total_us;
+    uint32_t enomem;
+    uint64_t backoff_us;
+    uint32_t bucket[IPERF_HIST_BUCKETS];
+} iperf_hist_t;
+
+#define IPERF_HIST_BEGIN() int64_t hist_start_us = esp_timer_get_time()
+#define IPERF_HIST_END() iperf_hist_add(&ctrl->hist, (uint32_t)(esp_timer_get_time() - hist_start_us))
+#define IPERF_HIST_ENOMEM() (ctrl->hist.enomem++)
+#define IPERF_HIST_BACKOFF(us) (ctrl->hist.backoff_us += (us))
+#else
+#define IPERF_HIST_BEGIN()
+#define IPERF_HIST_END()
+#define IPERF_HIST_ENOMEM()
+#define IPERF_HIST_BACKOFF(us)
+#endif
+
+/* --verify state; see iperf_pattern() for how payloads are generated */
+typedef struct {
+    uint32_t offset;    /* TCP: stream offset of the next byte sent/received */
+    uint32_t checked;   /* bytes checked */
+    uint32_t corrupted; /* bytes that didn't match the pattern */
+    uint64_t cost_us;   /* time spent generating/checking the pattern */
+} iperf_verify_t;
+
+/* UDP server datagram accounting, from the ids in iperf_udp_pkt_t */
+typedef struct {
+    int32_t last_id;    /* highest datagram id seen so far */
+    uint32_t packets;   /* datagrams received */
+    uint32_t lost;      /* datagrams skipped over and not (yet) seen */
+    uint32_t reordered; /* datagrams that arrived after a later one */
+} iperf_udp_stats_t;
+
+/* --isochronous frame accounting on the server; counters are cumulative, reports take differences */
+typedef struct {
+    uint32_t frames;        /* frames received complete */
+    uint32_t lost;          /* frames skipped over, or with datagrams missing */
+    uint32_t late;          /* complete frames delayed by more than a frame period */
+    uint64_t delay_us;      /* sum of the complete frames' delays */
+    uint32_t max_delay_us;  /* largest delay since the last report, reset by the report */
+} iperf_frame_stats_t;
+
+typedef struct {
+    iperf_frame_stats_t stats;
+    bool synced;            /* min_delay_us is valid */
+    int64_t min_delay_us;   /* smallest one-way delay seen, the clocks' offset plus the base delay */
+    uint32_t cur_id;        /* frame being received, 0 for none */
+    uint32_t got;           /* UDP: datagrams of it so far */
+    bool complete;          /* UDP: it has been received complete, so further datagrams of it are duplicates */
+    uint32_t remain;        /* TCP: bytes of it still to come */
+    uint32_t hdr_len;       /* TCP: bytes of the next frame header received so far */
+    uint8_t hdr[20];        /* TCP: the frame header being received, sizeof(iperf_frame_hdr_t) */
+} iperf_isoch_t;
+
+#define IPERF_EXP_TABLE_BITS 8
+
+/* client traffic shaping (--burst, --poisson) and send sizes (-l) */
+typedef struct {
+    bool active;        /* any shaping configured */
+    bool off;           /* --burst: in the pause */
+    uint32_t rng;       /* xorshift32 state */
+    int64_t phase_us;   /* --burst: when the current burst (or pause) ends */
+    int64_t next_us;    /* --poisson: when the next send is due */
+} iperf_shape_t;
+
+/* --from-partition/--to-partition: a flash task and the traffic task pass two buffers back and forth, so
+   one is being read from (or written to) flash while the other is on the socket */
+typedef struct {
+    uint8_t *buf;
+    uint32_t len;
+} iperf_flash_chunk_t;
+
+typedef struct {
+    const esp_partition_t *part;
+    QueueHandle_t free_q;   /* chunks for the side that fills them: flash task on TX, traffic task on RX */
+    QueueHandle_t full_q;   /* chunks for the side that drains them */
+    uint32_t offset;        /* partition offset of the flash task's next read/write */
+    uint64_t flash_bytes;
+    int64_t flash_us;       /* time in esp_partition_* calls */
+    int64_t net_us;         /* time in send/recv */
+    int64_t wait_us;        /* traffic task waiting on the flash task */
+    uint32_t errors;
+    bool running;           /* the flash task hasn't exited yet */
+} iperf_flash_t;
+
+/* running mean/variance of the per-interval rates (Welford), used by --auto */
+typedef struct {
+    uint32_t n;
+    double mean;
+    double m2;
+} iperf_ci_t;
+
+/* interval reporting state, kept by the report task or, with --single-task, by the traffic task itself */
+typedef struct {
+    uint32_t cur;       /* seconds reported so far */
+    uint32_t start;     /* start of the summary, after the omitted warm-up */
+    uint32_t last_len;
+    uint32_t omit_len;
+    iperf_udp_stats_t last_udp;
+    iperf_udp_stats_t omit_udp;
+    iperf_frame_stats_t last_frames;
+    iperf_frame_stats_t omit_frames;
+    iperf_ci_t ci;
+    double half_width;
+    int64_t next_us;    /* --single-task: when the next interval is due, 0 until reporting starts */
+} iperf_report_t;
+
+typedef struct iperf_ctrl {
     iperf_cfg_t cfg;
     bool finish;
     uint32_t total_len;
     uint32_t buffer_len;
     uint8_t *buffer;
-    uint32_t sockfd;
+    int sockfd; /* connected TCP data socket, or -1; sampled by the report task in --enhanced mode */
+    bool running;
+    bool no_report; /* self-test client: its server peer does the reporting */
+    bool reporting; /* the report task is still running */
+    bool has_result;
+    iperf_result_t result;
+    iperf_report_t report;
+    uint32_t heap_free;     /* free heap before the run was set up */
+    uint32_t heap_low;      /* lowest free heap seen at the interval reports */
+    TaskHandle_t traffic_task;
+    TaskHandle_t report_task;
+    iperf_verify_t verify;
+    iperf_udp_stats_t udp;
+    iperf_isoch_t isoch;
+    iperf_shape_t shape;
+    iperf_flash_t flash;
+    struct iperf_tls *tls; /* --tls: set while the TCP data goes through mbedTLS */
+#if CONFIG_IPERF_CALL_HISTOGRAM
+    iperf_hist_t hist;
+#endif
 } iperf_ctrl_t;
 
 typedef struct {
@@ -30,28 +221,145 @@ typedef struct {
     uint32_t usec;
 } iperf_udp_pkt_t;
 
-static bool s_iperf_is_running = false;
-static iperf_ctrl_t s_iperf_ctrl;
+/* --isochronous: starts every frame on TCP, follows iperf_udp_pkt_t in every datagram on UDP */
+typedef struct {
+    uint32_t frame_id;      /* from 1 */
+    uint32_t frame_len;     /* UDP: datagrams in the frame; TCP: bytes in the frame, this header included */
+    uint32_t period_us;     /* 1 / fps */
+    uint32_t tx_sec;        /* when the sender started the frame, by its own clock */
+    uint32_t tx_usec;
+} iperf_frame_hdr_t;
+
+typedef struct {
+    uint32_t cwnd;
+    uint32_t ssthresh;
+    uint32_t srtt_ms;
+    uint32_t rto_ms;
+    uint32_t nrtx;
+    uint32_t snd_buf;
+    uint32_t snd_queuelen;
+    uint32_t rcv_wnd;
+} iperf_tcp_info_t;
+
+typedef struct {
+    struct tcpip_api_call_data call;
+    int sockfd;
+    iperf_tcp_info_t *info;
+} iperf_tcp_info_call_t;
+
+static iperf_handle_t s_iperf_handle; /* used by iperf_start()/iperf_stop() */
+static iperf_totals_t s_iperf_totals;
+static uint16_t s_iperf_exp[1 << IPERF_EXP_TABLE_BITS]; /* -ln(u) in 1/4096ths, filled on first use */
 static const char *TAG = "iperf";
 
-inline static bool iperf_is_udp_client(void)
+inline static bool iperf_is_udp_client(const iperf_ctrl_t *ctrl)
+{
+    return ((ctrl->cfg.flag & IPERF_FLAG_CLIENT) && (ctrl->cfg.flag & IPERF_FLAG_UDP));
+}
+
+inline static bool iperf_is_udp_server(const iperf_ctrl_t *ctrl)
+{
+    return ((ctrl->cfg.flag & IPERF_FLAG_SERVER) && (ctrl->cfg.flag & IPERF_FLAG_UDP));
+}
+
+inline static bool iperf_is_tcp_client(const iperf_ctrl_t *ctrl)
+{
+    return ((ctrl->cfg.flag & IPERF_FLAG_CLIENT) && (ctrl->cfg.flag & IPERF_FLAG_TCP));
+}
+
+inline static bool iperf_is_tcp_server(const iperf_ctrl_t *ctrl)
+{
+    return ((ctrl->cfg.flag & IPERF_FLAG_SERVER) && (ctrl->cfg.flag & IPERF_FLAG_TCP));
+}
+
+static inline bool iperf_addr_is_ipv6(const iperf_addr_t *addr)
+{
+#if LWIP_IPV6
+    return addr->sa.sa_family == AF_INET6;
+#else
+    return false;
+#endif
+}
+
+static inline int iperf_addr_family(const iperf_addr_t *addr)
+{
+    return iperf_addr_is_ipv6(addr) ? AF_INET6 : AF_INET;
+}
+
+static bool iperf_addr_is_multicast(const iperf_addr_t *addr)
+{
+#if LWIP_IPV6
+    if (iperf_addr_is_ipv6(addr)) {
+        return addr->sin6.sin6_addr.s6_addr[0] == 0xFF;
+    }
+#endif
+    return IN_MULTICAST(ntohl(addr->sin.sin_addr.s_addr));
+}
+
+/* make a socket address out of addr and port, returning its length for bind/connect/sendto */
+socklen_t iperf_sockaddr(iperf_addr_t *out, const iperf_addr_t *addr, uint16_t port)
+{
+    *out = *addr;
+#if LWIP_IPV6
+    if (iperf_addr_is_ipv6(addr)) {
+        out->sin6.sin6_port = htons(port);
+        return sizeof(out->sin6);
+    }
+#endif
+    out->sin.sin_family = AF_INET;
+    out->sin.sin_port = htons(port);
+    return sizeof(out->sin);
+}
+
+static uint16_t iperf_addr_port(const iperf_addr_t *addr)
+{
+#if LWIP_IPV6
+    if (iperf_addr_is_ipv6(addr)) {
+        return ntohs(addr->sin6.sin6_port);
+    }
+#endif
+    return ntohs(addr->sin.sin_port);
+}
+
+/* the wildcard address of the same family as addr */
+static void iperf_addr_any(iperf_addr_t *out, const iperf_addr_t *addr)
 {
-    return ((s_iperf_ctrl.cfg.flag & IPERF_FLAG_CLIENT) && (s_iperf_ctrl.cfg.flag & IPERF_FLAG_UDP));
+    memset(out, 0, sizeof(*out));
+    out->sa.sa_family = iperf_addr_family(addr);
 }
 
-inline static bool iperf_is_udp_server(void)
+esp_err_t iperf_addr_from_str(const char *str, iperf_addr_t *addr)
 {
-    return ((s_iperf_ctrl.cfg.flag & IPERF_FLAG_SERVER) && (s_iperf_ctrl.cfg.flag & IPERF_FLAG_UDP));
+    memset(addr, 0, sizeof(*addr));
+#if LWIP_IPV6
+    if (strchr(str, ':')) {
+        addr->sin6.sin6_family = AF_INET6;
+        return (inet_pton(AF_INET6, str, &addr->sin6.sin6_addr) == 1) ? ESP_OK : ESP_ERR_INVALID_ARG;
+    }
+#endif
+    addr->sin.sin_family = AF_INET;
+    return (inet_pton(AF_INET, str, &addr->sin.sin_addr) == 1) ? ESP_OK : ESP_ERR_INVALID_ARG;
 }
 
-inline static bool iperf_is_tcp_client(void)
+const char *iperf_addr_to_str(const iperf_addr_t *addr, char *buf, size_t len)
 {
-    return ((s_iperf_ctrl.cfg.flag & IPERF_FLAG_CLIENT) && (s_iperf_ctrl.cfg.flag & IPERF_FLAG_TCP));
+#if LWIP_IPV6
+    if (iperf_addr_is_ipv6(addr)) {
+        return inet_ntop(AF_INET6, &addr->sin6.sin6_addr, buf, len);
+    }
+#endif
+    return inet_ntop(AF_INET, &addr->sin.sin_addr, buf, len);
 }
 
-inline static bool iperf_is_tcp_server(void)
+bool iperf_addr_is_set(const iperf_addr_t *addr)
 {
-    return ((s_iperf_ctrl.cfg.flag & IPERF_FLAG_SERVER) && (s_iperf_ctrl.cfg.flag & IPERF_FLAG_TCP));
+#if LWIP_IPV6
+    /* an IPv6 address is only ever set explicitly, even if it's the any address */
+    if (iperf_addr_is_ipv6(addr)) {
+        return true;
+    }
+#endif
+    return addr->sin.sin_addr.s_addr != 0;
 }
 
 static int iperf_get_socket_error_code(int sockfd)
@@ -81,373 +389,2412 @@ static int iperf_show_socket_error_reason(const char *str, int sockfd)
     return err;
 }
 
-static void iperf_report_task(void *arg)
+#if CONFIG_IPERF_CALL_HISTOGRAM
+static inline void iperf_hist_add(iperf_hist_t *hist, uint32_t us)
 {
-    uint32_t interval = s_iperf_ctrl.cfg.interval;
-    uint32_t time = s_iperf_ctrl.cfg.time;
-    TickType_t delay_interval = (interval * 1000) / portTICK_PERIOD_MS;
-    uint32_t last_len = 0;
-    uint32_t cur = 0;
+    uint32_t n = us ? 32 - __builtin_clz(us) : 0;
 
-    printf("\n%16s %s\n", "Interval", "Bandwidth");
-    while (!s_iperf_ctrl.finish) {
-        vTaskDelay(delay_interval);
-        printf("%4d-%4d sec       %.2f Mbits/sec\n", cur, cur + interval,
-               (double)((s_iperf_ctrl.total_len - last_len) * 8) / interval / 1e6);
-        cur += interval;
-        last_len = s_iperf_ctrl.total_len;
-        if (cur >= time) {
-            break;
-        }
+    hist->bucket[(n < IPERF_HIST_BUCKETS) ? n : IPERF_HIST_BUCKETS - 1]++;
+    hist->calls++;
+    hist->total_us += us;
+    if (us >= IPERF_HIST_BLOCKED_US) {
+        hist->blocked++;
     }
-
-    if (cur != 0) {
-        printf("%4d-%4d sec       %.2f Mbits/sec\n", 0, time,
-               (double)(s_iperf_ctrl.total_len * 8) / cur / 1e6);
+    if (us > hist->max_us) {
+        hist->max_us = us;
     }
-
-    s_iperf_ctrl.finish = true;
-    vTaskDelete(NULL);
 }
 
-static esp_err_t iperf_start_report(void)
+static void iperf_hist_show(const iperf_hist_t *hist, const char *call, uint32_t elapsed_ms)
 {
-    int ret;
+    uint32_t lo;
+    int i;
 
-    ret = xTaskCreatePinnedToCore(iperf_report_task, IPERF_REPORT_TASK_NAME, IPERF_REPORT_TASK_STACK, NULL, IPERF_REPORT_TASK_PRIORITY, NULL, portNUM_PROCESSORS - 1);
-
-    if (ret != pdPASS) {
-        ESP_LOGE(TAG, "create task %s failed", IPERF_REPORT_TASK_NAME);
-        return ESP_FAIL;
+    if (hist->calls == 0) {
+        return;
     }
 
-    return ESP_OK;
+    printf("\n%s() latency: %u calls, %u blocked >= %dus, avg %uus, max %uus\n", call, hist->calls,
+           hist->blocked, IPERF_HIST_BLOCKED_US, (uint32_t)(hist->total_us / hist->calls), hist->max_us);
+    for (i = 0; i < IPERF_HIST_BUCKETS; i++) {
+        if (hist->bucket[i] == 0) {
+            continue;
+        }
+        lo = i ? 1 << (i - 1) : 0;
+        if (i == IPERF_HIST_BUCKETS - 1) {
+            printf("  %6u+      us: %8u\n", lo, hist->bucket[i]);
+        } else {
+            printf("  %6u-%-6u us: %8u\n", lo, 1 << i, hist->bucket[i]);
+        }
+    }
+    if (hist->enomem) {
+        printf("ENOMEM: %u retries (%.1f/sec), %u ms backing off\n", hist->enomem,
+               elapsed_ms ? hist->enomem * 1000.0 / elapsed_ms : 0.0, (uint32_t)(hist->backoff_us / 1000));
+    }
 }
+#endif
 
-static esp_err_t IRAM_ATTR iperf_run_tcp_server(void)
+/* --verify payload: 32-bit word n of a TCP stream, or word n of datagram id's payload with n = id << IPERF_VERIFY_ID_SHIFT,
+   is iperf_pattern(n); it can be generated or checked from any offset, so neither side has to keep history */
+static inline uint32_t iperf_pattern(uint32_t n)
 {
-    socklen_t addr_len = sizeof(struct sockaddr);
-    struct sockaddr_in remote_addr;
-    struct sockaddr_in addr;
-    int actual_recv = 0;
-    int want_recv = 0;
-    uint8_t *buffer;
-    int listen_socket;
-    struct timeval t;
-    int sockfd;
-    int opt;
+    n *= 0x9E3779B1;
+    return n ^ (n >> 16);
+}
 
-    listen_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    if (listen_socket < 0) {
-        iperf_show_socket_error_reason("tcp server create", listen_socket);
-        return ESP_FAIL;
+static void iperf_verify_fill(uint32_t *word, uint32_t n, uint32_t count)
+{
+    while (count--) {
+        *word++ = iperf_pattern(n++);
     }
+}
 
-    setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+static inline uint32_t iperf_diff_bytes(uint32_t a, uint32_t b)
+{
+    uint32_t x = a ^ b;
 
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(s_iperf_ctrl.cfg.sport);
-    addr.sin_addr.s_addr = s_iperf_ctrl.cfg.sip;
-    if (bind(listen_socket, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
-        iperf_show_socket_error_reason("tcp server bind", listen_socket);
-        close(listen_socket);
-        return ESP_FAIL;
+    return ((x & 0xFF) != 0) + ((x & 0xFF00) != 0) + ((x & 0xFF0000) != 0) + ((x & 0xFF000000) != 0);
+}
+
+/* check the bytes at buf against the pattern from byte head (0-3) of word n on, returning how many are wrong;
+   buf must be head bytes past a word boundary, so whole words can be compared at a time */
+static uint32_t iperf_verify_check(const uint8_t *buf, uint32_t n, uint32_t head, uint32_t len)
+{
+    const uint32_t *word = (const uint32_t *)(buf - head);
+    uint32_t bad = 0;
+    uint32_t expect;
+    uint32_t i;
+
+    if (head) {
+        expect = iperf_pattern(n++);
+        for (i = head; i < 4 && len; i++, len--) {
+            bad += ((const uint8_t *)word)[i] != ((const uint8_t *)&expect)[i];
+        }
+        word++;
     }
 
-    if (listen(listen_socket, 5) < 0) {
-        iperf_show_socket_error_reason("tcp server listen", listen_socket);
-        close(listen_socket);
-        return ESP_FAIL;
+    for (; len >= 4; len -= 4) {
+        expect = iperf_pattern(n++);
+        if (*word != expect) {
+            bad += iperf_diff_bytes(*word, expect);
+        }
+        word++;
     }
 
-    buffer = s_iperf_ctrl.buffer;
-    want_recv = s_iperf_ctrl.buffer_len;
+    if (len) {
+        expect = iperf_pattern(n);
+        for (i = 0; i < len; i++) {
+            bad += ((const uint8_t *)word)[i] != ((const uint8_t *)&expect)[i];
+        }
+    }
 
-    int rc = ESP_OK; // return code for this function, either ESP_OK or ESP_FAIL
+    return bad;
+}
 
-    /*TODO need to change to non-block mode */
-    sockfd = accept(listen_socket, (struct sockaddr *)&remote_addr, &addr_len);
-    if (sockfd < 0) {
-        iperf_show_socket_error_reason("tcp server listen", listen_socket);
-        close(listen_socket);
-        rc = ESP_FAIL;
-    } else {
-        printf("accept: %s,%d\n", inet_ntoa(remote_addr.sin_addr), htons(remote_addr.sin_port));
-        iperf_start_report();
+static void iperf_verify_show(const iperf_ctrl_t *ctrl, uint32_t elapsed_ms)
+{
+    const iperf_verify_t *verify = &ctrl->verify;
 
-        t.tv_sec = IPERF_SOCKET_RX_TIMEOUT;
-        setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &t, sizeof(t));
+    if (ctrl->cfg.flag & IPERF_FLAG_CLIENT) {
+        printf("verify: sent pattern, %u ms of %u ms (%.1f%%) spent generating it\n", (uint32_t)(verify->cost_us / 1000),
+               elapsed_ms, elapsed_ms ? verify->cost_us / 10.0 / elapsed_ms : 0.0);
+        return;
+    }
 
-        while (!s_iperf_ctrl.finish) {
-            actual_recv = recv(sockfd, buffer, want_recv, 0);
-            if (actual_recv <= 0) {
-                if (actual_recv < 0) {
-                    iperf_show_socket_error_reason("tcp server recv", listen_socket);
-                    rc = ESP_FAIL;
-                } 
-                // if actual_recv == 0 then it's not an error, the client just finished and closed the connection, so we do the same
-                break;
-            } else {
-                // just a normal read, account for it and continue
-                s_iperf_ctrl.total_len += actual_recv;
-            }
-        }
+    printf("verify: %u bytes checked, %u corrupted, %u datagrams reordered\n",
+           verify->checked, verify->corrupted, ctrl->udp.reordered);
+    printf("verify: %u ms of %u ms (%.1f%%) spent checking\n", (uint32_t)(verify->cost_us / 1000),
+           elapsed_ms, elapsed_ms ? verify->cost_us / 10.0 / elapsed_ms : 0.0);
+}
 
-        s_iperf_ctrl.finish = true; // signals it's finished so iperf_report_task() can finish itself
-                                    // XXX wouldn't it be better to use a semaphore or some such?
+/* runs in the tcpip thread, so the pcb can't change or go away under us */
+static err_t iperf_tcp_info_fn(struct tcpip_api_call_data *call)
+{
+    iperf_tcp_info_call_t *msg = (iperf_tcp_info_call_t *)call;
+    struct lwip_sock *sock = lwip_socket_dbg_get_socket(msg->sockfd);
+    struct tcp_pcb *pcb;
 
-        close(sockfd);
+    if (!sock || !sock->conn || NETCONNTYPE_GROUP(sock->conn->type) != NETCONN_TCP) {
+        return ERR_VAL;
     }
 
-    close(listen_socket);
+    pcb = sock->conn->pcb.tcp;
+    if (!pcb || pcb->state == CLOSED || pcb->state == LISTEN) {
+        return ERR_CONN;
+    }
 
-    return rc;
+    msg->info->cwnd = pcb->cwnd;
+    msg->info->ssthresh = pcb->ssthresh;
+    /* sa and sv are kept scaled by 8 and 4, in units of the slow timer */
+    msg->info->srtt_ms = (pcb->sa >> 3) * TCP_SLOW_INTERVAL;
+    msg->info->rto_ms = pcb->rto * TCP_SLOW_INTERVAL;
+    msg->info->nrtx = pcb->nrtx;
+    msg->info->snd_buf = pcb->snd_buf;
+    msg->info->snd_queuelen = pcb->snd_queuelen;
+    msg->info->rcv_wnd = pcb->rcv_wnd;
+    return ERR_OK;
 }
 
-static esp_err_t IRAM_ATTR iperf_run_udp_server(void)
+static bool iperf_get_tcp_info(int sockfd, iperf_tcp_info_t *info)
 {
-    socklen_t addr_len = sizeof(struct sockaddr_in);
-    struct sockaddr_in addr;
-    int actual_recv = 0;
-    struct timeval t;
-    int want_recv = 0;
-    uint8_t *buffer;
-    int sockfd;
-    int opt;
-    bool udp_recv_start = true ;
-    
-    sockfd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    iperf_tcp_info_call_t msg;
+
     if (sockfd < 0) {
-        iperf_show_socket_error_reason("udp server create", sockfd);
-        return ESP_FAIL;
+        return false;
     }
 
-    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    msg.sockfd = sockfd;
+    msg.info = info;
+    return tcpip_api_call(iperf_tcp_info_fn, &msg.call) == ERR_OK;
+}
 
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(s_iperf_ctrl.cfg.sport);
-    addr.sin_addr.s_addr = s_iperf_ctrl.cfg.sip;
-    if (bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
-        iperf_show_socket_error_reason("udp server bind", sockfd);
-        return ESP_FAIL;
+static void iperf_report_tcp_info(iperf_ctrl_t *ctrl)
+{
+    iperf_tcp_info_t info;
+
+    if (iperf_get_tcp_info(ctrl->sockfd, &info)) {
+        printf("  cwnd=%u ssthresh=%u srtt=%ums rto=%ums rtx=%u snd_buf=%u snd_qlen=%u rcv_wnd=%u",
+               info.cwnd, info.ssthresh, info.srtt_ms, info.rto_ms, info.nrtx,
+               info.snd_buf, info.snd_queuelen, info.rcv_wnd);
     }
+}
 
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(s_iperf_ctrl.cfg.sport);
-    addr.sin_addr.s_addr = s_iperf_ctrl.cfg.sip;
+/* print the datagrams lost since the previous snapshot, iperf2 style */
+static void iperf_report_udp_loss(const iperf_udp_stats_t *now, const iperf_udp_stats_t *prev)
+{
+    /* lost can go down when late datagrams turn up, so don't let the difference wrap */
+    uint32_t lost = (now->lost > prev->lost) ? now->lost - prev->lost : 0;
+    uint32_t total = now->packets - prev->packets + lost;
 
-    buffer = s_iperf_ctrl.buffer;
-    want_recv = s_iperf_ctrl.buffer_len;
-    ESP_LOGI(TAG, "want recv=%d", want_recv);
+    printf("  %u/%u (%.2f%%) lost", lost, total, total ? lost * 100.0 / total : 0.0);
+}
 
-    t.tv_sec = IPERF_SOCKET_RX_TIMEOUT;
-    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &t, sizeof(t));
+static inline bool iperf_is_isoch_server(const iperf_ctrl_t *ctrl)
+{
+    return (ctrl->cfg.flag & (IPERF_FLAG_ISOCHRONOUS | IPERF_FLAG_SERVER)) == (IPERF_FLAG_ISOCHRONOUS | IPERF_FLAG_SERVER);
+}
 
-    while (!s_iperf_ctrl.finish) {
-        actual_recv = recvfrom(sockfd, buffer, want_recv, 0, (struct sockaddr *)&addr, &addr_len);
-        if (actual_recv < 0) {
-            iperf_show_socket_error_reason("udp server recv", sockfd);
-        } else {
-            if(udp_recv_start){
-                iperf_start_report();
-                udp_recv_start = false;
-            }
-            s_iperf_ctrl.total_len += actual_recv;
-        }
-    }
+/* print the frames completed since the previous snapshot, with their delay */
+static void iperf_report_frames(const iperf_frame_stats_t *now, const iperf_frame_stats_t *prev, uint32_t max_delay_us)
+{
+    uint32_t frames = now->frames - prev->frames;
 
-    s_iperf_ctrl.finish = true;
-    close(sockfd);
-    return ESP_OK;
+    printf("  frames %u lost %u late %u delay avg %.1f max %.1f ms", frames, now->lost - prev->lost, now->late - prev->late,
+           frames ? (now->delay_us - prev->delay_us) / 1000.0 / frames : 0.0, max_delay_us / 1000.0);
 }
 
-static esp_err_t iperf_run_udp_client(void)
+/* two-sided 95% Student t quantiles for 1..30 degrees of freedom; above that the normal 1.96 is close enough */
+static const float s_iperf_t95[] = {
+    12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+    2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+    2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042
+};
+
+static void iperf_ci_add(iperf_ci_t *ci, double sample)
 {
-    struct sockaddr_in addr;
-    iperf_udp_pkt_t *udp;
-    int actual_send = 0;
-    bool retry = false;
-    uint32_t delay = 1;
-    int want_send = 0;
-    uint8_t *buffer;
-    int sockfd;
-    int opt;
-    int err;
-    int id;
+    double delta = sample - ci->mean;
 
-    sockfd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-    if (sockfd < 0) {
-        iperf_show_socket_error_reason("udp client create", sockfd);
-        return ESP_FAIL;
-    }
+    ci->n++;
+    ci->mean += delta / ci->n;
+    ci->m2 += delta * (sample - ci->mean);
+}
 
-    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+/* half-width of the 95% confidence interval of the mean, or -1 if there are too few samples */
+static double iperf_ci_half_width(const iperf_ci_t *ci)
+{
+    uint32_t df;
+    double t;
 
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(s_iperf_ctrl.cfg.dport);
-    addr.sin_addr.s_addr = s_iperf_ctrl.cfg.dip;
+    if (ci->n < 2) {
+        return -1;
+    }
 
-    iperf_start_report();
-    buffer = s_iperf_ctrl.buffer;
-    udp = (iperf_udp_pkt_t *)buffer;
-    want_send = s_iperf_ctrl.buffer_len;
-    id = 0;
+    df = ci->n - 1;
+    t = (df <= sizeof(s_iperf_t95) / sizeof(s_iperf_t95[0])) ? s_iperf_t95[df - 1] : 1.96;
+    return t * sqrt(ci->m2 / df / ci->n);
+}
 
-    while (!s_iperf_ctrl.finish) {
-        if (false == retry) {
-            id++;
-            udp->id = htonl(id);
-            delay = 1;
-        }
+static void iperf_report_begin(iperf_ctrl_t *ctrl)
+{
+    memset(&ctrl->report, 0, sizeof(ctrl->report));
+    ctrl->report.half_width = -1;
+    printf("\n%16s %s\n", "Interval", "Bandwidth");
+}
 
-        retry = false;
-        actual_send = sendto(sockfd, buffer, want_send, 0, (struct sockaddr *)&addr, sizeof(addr));
+/* print the interval that just ended; returns true once the test is over (time is up, or --auto converged) */
+static bool IPERF_REPORT_ATTR iperf_report_interval(iperf_ctrl_t *ctrl)
+{
+    iperf_report_t *rep = &ctrl->report;
+    uint32_t interval = ctrl->cfg.interval;
+    uint32_t omit = ctrl->cfg.omit;
+    bool is_enhanced = (ctrl->cfg.flag & (IPERF_FLAG_ENHANCED | IPERF_FLAG_TCP)) == (IPERF_FLAG_ENHANCED | IPERF_FLAG_TCP);
+    uint32_t total_len = ctrl->total_len;
+    uint32_t heap = esp_get_free_heap_size();
+    /* an interval that starts inside the omit period is left out of the summary whole */
+    bool omitted = (rep->cur < omit);
+    iperf_udp_stats_t udp;
+    iperf_frame_stats_t frames;
+    iperf_interval_t report;
+    double rate;
+
+    IPERF_TRACE(IPERF_TRACE_REPORT, rep->cur + interval);
+    if (heap < ctrl->heap_low || ctrl->heap_low == 0) {
+        ctrl->heap_low = heap;
+    }
 
-        if (actual_send != want_send) {
-            err = iperf_get_socket_error_code(sockfd);
-            if (err == ENOMEM) {
-                vTaskDelay(delay);
-                if (delay < IPERF_MAX_DELAY) {
-                    delay <<= 1;
-                }
-                retry = true;
-                continue;
-            } else {
-                ESP_LOGE(TAG, "udp client send abort: err=%d", err);
-                break;
-            }
-        } else {
-            s_iperf_ctrl.total_len += actual_send;
+    rate = (double)((total_len - rep->last_len) * 8) / interval / 1e6;
+    printf("%4d-%4d sec       %.2f Mbits/sec%s", rep->cur, rep->cur + interval, rate, omitted ? " (omitted)" : "");
+    memset(&report, 0, sizeof(report));
+    report.start_sec = rep->cur;
+    report.end_sec = rep->cur + interval;
+    report.bytes = total_len - rep->last_len;
+    report.bandwidth_kbps = (uint32_t)(rate * 1000);
+    report.omitted = omitted;
+    if (is_enhanced) {
+        iperf_report_tcp_info(ctrl);
+    }
+    if (iperf_is_udp_server(ctrl)) {
+        udp = ctrl->udp;
+        iperf_report_udp_loss(&udp, &rep->last_udp);
+        report.packets = udp.packets - rep->last_udp.packets;
+        report.lost = (udp.lost > rep->last_udp.lost) ? udp.lost - rep->last_udp.lost : 0;
+        rep->last_udp = udp;
+    }
+    if (iperf_is_isoch_server(ctrl)) {
+        frames = ctrl->isoch.stats;
+        ctrl->isoch.stats.max_delay_us = 0;
+        iperf_report_frames(&frames, &rep->last_frames, frames.max_delay_us);
+        report.frames = frames.frames - rep->last_frames.frames;
+        report.frames_lost = frames.lost - rep->last_frames.lost;
+        report.frames_late = frames.late - rep->last_frames.late;
+        report.frame_delay_avg_us = report.frames ? (uint32_t)((frames.delay_us - rep->last_frames.delay_us) / report.frames) : 0;
+        report.frame_delay_max_us = frames.max_delay_us;
+        rep->last_frames = frames;
+    }
+    printf("\n");
+    if (ctrl->cfg.interval_cb) {
+        ctrl->cfg.interval_cb(ctrl, &report, ctrl->cfg.cb_arg);
+    }
+    rep->cur += interval;
+    rep->last_len = total_len;
+    if (omitted) {
+        /* still warming up: restart the summary from here */
+        rep->start = rep->cur;
+        rep->omit_len = rep->last_len;
+        rep->omit_udp = rep->last_udp;
+        rep->omit_frames = rep->last_frames;
+    } else if (ctrl->cfg.flag & IPERF_FLAG_AUTO) {
+        iperf_ci_add(&rep->ci, rate);
+        rep->half_width = iperf_ci_half_width(&rep->ci);
+        if (rep->ci.n >= IPERF_AUTO_MIN_SAMPLES && rep->ci.mean > 0 &&
+            rep->half_width * 100 <= rep->ci.mean * ctrl->cfg.tolerance) {
+            printf("auto: throughput converged after %d sec\n", rep->cur);
+            return true;
         }
     }
 
-    s_iperf_ctrl.finish = true;
-    close(sockfd);
-    return ESP_OK;
+    return rep->cur >= ctrl->cfg.time;
 }
 
-static esp_err_t iperf_run_tcp_client(void)
+/* print the summary line and record the result */
+static void iperf_report_end(iperf_ctrl_t *ctrl)
 {
-    struct sockaddr_in remote_addr;
-    int actual_send = 0;
-    int want_send = 0;
-    uint8_t *buffer;
-    int sockfd;
-
-    sockfd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    if (sockfd < 0) {
-        iperf_show_socket_error_reason("tcp client create", sockfd);
-        return ESP_FAIL;
-    }
-
-    memset(&remote_addr, 0, sizeof(remote_addr));
-    remote_addr.sin_family = AF_INET;
-    remote_addr.sin_port = htons(s_iperf_ctrl.cfg.dport);
-    remote_addr.sin_addr.s_addr = s_iperf_ctrl.cfg.dip;
-    if (connect(sockfd, (struct sockaddr *)&remote_addr, sizeof(remote_addr)) < 0) {
-        iperf_show_socket_error_reason("tcp client connect", sockfd);
-        return ESP_FAIL;
+    iperf_report_t *rep = &ctrl->report;
+    bool is_auto = (ctrl->cfg.flag & IPERF_FLAG_AUTO) != 0;
+    iperf_udp_stats_t udp;
+    iperf_frame_stats_t frames;
+
+    ctrl->result.flag = ctrl->cfg.flag;
+    if (rep->cur > rep->start) {
+        printf("%4d-%4d sec       %.2f Mbits/sec", rep->start, (is_auto || ctrl->cfg.omit) ? rep->cur : ctrl->cfg.time,
+               (double)((ctrl->total_len - rep->omit_len) * 8) / (rep->cur - rep->start) / 1e6);
+        ctrl->result.duration_ms = (rep->cur - rep->start) * 1000;
+        ctrl->result.bytes = ctrl->total_len - rep->omit_len;
+        ctrl->result.bandwidth_kbps = (uint32_t)(ctrl->result.bytes * 8 / (rep->cur - rep->start) / 1000);
+        if (iperf_is_udp_server(ctrl)) {
+            udp = ctrl->udp;
+            ctrl->result.packets = udp.packets - rep->omit_udp.packets;
+            ctrl->result.lost = (udp.lost > rep->omit_udp.lost) ? udp.lost - rep->omit_udp.lost : 0;
+            ctrl->result.reordered = udp.reordered - rep->omit_udp.reordered;
+            iperf_report_udp_loss(&udp, &rep->omit_udp);
+            if (udp.reordered != rep->omit_udp.reordered) {
+                printf("  %u datagrams out of order", udp.reordered - rep->omit_udp.reordered);
+            }
+        }
+        if (iperf_is_isoch_server(ctrl)) {
+            frames = ctrl->isoch.stats;
+            printf("  frames %u lost %u late %u delay avg %.1f ms", frames.frames - rep->omit_frames.frames,
+                   frames.lost - rep->omit_frames.lost, frames.late - rep->omit_frames.late,
+                   (frames.frames != rep->omit_frames.frames) ?
+                   (frames.delay_us - rep->omit_frames.delay_us) / 1000.0 / (frames.frames - rep->omit_frames.frames) : 0.0);
+        }
+        printf("\n");
     }
 
-    iperf_start_report();
-    buffer = s_iperf_ctrl.buffer;
-    want_send = s_iperf_ctrl.buffer_len;
-    while (!s_iperf_ctrl.finish) {
-        actual_send = send(sockfd, buffer, want_send, 0);
-        if (actual_send <= 0) {
-            iperf_show_socket_error_reason("tcp client send", sockfd);
-            break;
+    if (is_auto) {
+        if (rep->half_width >= 0) {
+            printf("auto: mean %.2f Mbits/sec, 95%% CI +/- %.2f Mbits/sec (%.1f%%), %d samples\n", rep->ci.mean, rep->half_width,
+                   (rep->ci.mean > 0) ? rep->half_width * 100 / rep->ci.mean : 0.0, rep->ci.n);
         } else {
-            s_iperf_ctrl.total_len += actual_send;
+            printf("auto: not enough samples for a confidence interval\n");
         }
     }
-
-    s_iperf_ctrl.finish = true;
-    close(sockfd);
-    return ESP_OK;
 }
 
-static void iperf_task_traffic(void *arg)
+static void IPERF_REPORT_ATTR iperf_report_task(void *arg)
 {
-    if (iperf_is_udp_client()) {
-        iperf_run_udp_client();
-    } else if (iperf_is_udp_server()) {
-        iperf_run_udp_server();
-    } else if (iperf_is_tcp_client()) {
-        iperf_run_tcp_client();
-    } else {
-        iperf_run_tcp_server();
-    }
+    iperf_ctrl_t *ctrl = (iperf_ctrl_t *)arg;
+    TickType_t delay_interval = (ctrl->cfg.interval * 1000) / portTICK_PERIOD_MS;
 
-    if (s_iperf_ctrl.buffer) {
-        free(s_iperf_ctrl.buffer);
-        s_iperf_ctrl.buffer = NULL;
+    iperf_report_begin(ctrl);
+    while (!ctrl->finish) {
+        IPERF_TRACE(IPERF_TRACE_TASK_SLEEP, IPERF_TRACE_TASK_REPORT);
+        vTaskDelay(delay_interval);
+        IPERF_TRACE(IPERF_TRACE_TASK_WAKE, IPERF_TRACE_TASK_REPORT);
+        if (iperf_report_interval(ctrl)) {
+            break;
+        }
     }
-    ESP_LOGI(TAG, "iperf exit");
-    s_iperf_is_running = false;
+    iperf_report_end(ctrl);
+
+    ctrl->finish = true;
+    ctrl->reporting = false;
     vTaskDelete(NULL);
 }
 
-static uint32_t iperf_get_buffer_len(void)
+static inline bool iperf_is_single_task(const iperf_ctrl_t *ctrl)
 {
-    if (iperf_is_udp_client()) {
-        return IPERF_UDP_TX_LEN;
-    } else if (iperf_is_udp_server()) {
-        return IPERF_UDP_RX_LEN;
-    } else if (iperf_is_tcp_client()) {
-        return IPERF_TCP_TX_LEN;
-    } else {
-        return IPERF_TCP_RX_LEN;
-    }
-    return 0;
+    return (ctrl->cfg.flag & IPERF_FLAG_SINGLE_TASK) != 0;
 }
 
-esp_err_t iperf_start(iperf_cfg_t *cfg)
+/* --single-task: called by the engines on every pass through their loops, reports any interval that is due */
+static inline void iperf_report_poll(iperf_ctrl_t *ctrl)
 {
-    BaseType_t ret;
+    int64_t now;
 
-    if (!cfg) {
-        return ESP_FAIL;
+    if (!iperf_is_single_task(ctrl) || ctrl->report.next_us == 0) {
+        return;
     }
 
-    if (s_iperf_is_running) {
-        ESP_LOGW(TAG, "iperf is running");
+    now = esp_timer_get_time();
+    if (now >= ctrl->report.next_us) {
+        ctrl->report.next_us += (int64_t)ctrl->cfg.interval * 1000000;
+        if (iperf_report_interval(ctrl)) {
+            ctrl->finish = true;
+        }
+    }
+}
+
+/* --single-task: receive timeout to use, so intervals are still reported while no data arrives */
+static void iperf_set_rx_timeout(iperf_ctrl_t *ctrl, int sockfd)
+{
+    struct timeval t;
+
+    if (iperf_is_single_task(ctrl)) {
+        t.tv_sec = 0;
+        t.tv_usec = IPERF_SINGLE_TASK_POLL_MS * 1000;
+    } else {
+        t.tv_sec = IPERF_SOCKET_RX_TIMEOUT;
+        t.tv_usec = 0;
+    }
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &t, sizeof(t));
+}
+
+/* --single-task: whether a failed receive only timed out early, and the loop should go on;
+   the engines still give up after IPERF_SOCKET_RX_TIMEOUT seconds without data */
+static bool iperf_rx_idle(const iperf_ctrl_t *ctrl, int64_t last_rx_us)
+{
+    return iperf_is_single_task(ctrl) && (errno == EAGAIN || errno == EWOULDBLOCK) &&
+           esp_timer_get_time() - last_rx_us < IPERF_SOCKET_RX_TIMEOUT * 1000000LL;
+}
+
+static esp_err_t iperf_start_report(iperf_ctrl_t *ctrl)
+{
+    int ret;
+
+    ctrl->result.start_us = esp_timer_get_time();
+    if (ctrl->no_report) {
+        return ESP_OK;
+    }
+
+    if (iperf_is_single_task(ctrl)) {
+        iperf_report_begin(ctrl);
+        ctrl->report.next_us = esp_timer_get_time() + (int64_t)ctrl->cfg.interval * 1000000;
+        return ESP_OK;
+    }
+
+    ctrl->reporting = true;
+    ret = xTaskCreatePinnedToCore(iperf_report_task, IPERF_REPORT_TASK_NAME, IPERF_REPORT_TASK_STACK, ctrl, IPERF_REPORT_TASK_PRIORITY, &ctrl->report_task, portNUM_PROCESSORS - 1);
+
+    if (ret != pdPASS) {
+        ESP_LOGE(TAG, "create task %s failed", IPERF_REPORT_TASK_NAME);
+        ctrl->reporting = false;
+        return ESP_FAIL;
+    }
+
+    return ESP_OK;
+}
+
+/* a frame has been received complete at rx_us; its delay is reported relative to the fastest frame so far,
+   so the two ends' clocks don't have to be synchronised */
+static void iperf_isoch_complete(iperf_isoch_t *isoch, const iperf_frame_hdr_t *hdr, int64_t rx_us)
+{
+    int64_t delay_us = rx_us - ((int64_t)ntohl(hdr->tx_sec) * 1000000 + ntohl(hdr->tx_usec));
+    uint32_t rel_us;
+
+    if (!isoch->synced || delay_us < isoch->min_delay_us) {
+        isoch->min_delay_us = delay_us;
+        isoch->synced = true;
+    }
+    rel_us = (uint32_t)(delay_us - isoch->min_delay_us);
+
+    isoch->stats.frames++;
+    isoch->stats.delay_us += rel_us;
+    if (rel_us > isoch->stats.max_delay_us) {
+        isoch->stats.max_delay_us = rel_us;
+    }
+    if (rel_us > ntohl(hdr->period_us)) {
+        isoch->stats.late++;
+    }
+}
+
+/* moving on to next_id: the current frame is lost unless it completed, as are any frames between them */
+static void iperf_isoch_skip(iperf_isoch_t *isoch, uint32_t next_id)
+{
+    if (isoch->cur_id) {
+        isoch->stats.lost += next_id - isoch->cur_id - (isoch->complete ? 1 : 0);
+    } else if (next_id > 1) {
+        isoch->stats.lost += next_id - 1;
+    }
+}
+
+static void iperf_isoch_udp_account(iperf_isoch_t *isoch, const iperf_frame_hdr_t *hdr, int64_t rx_us)
+{
+    uint32_t id = ntohl(hdr->frame_id);
+
+    if (id < isoch->cur_id || (id == isoch->cur_id && isoch->complete)) {
+        /* late datagram of a frame already given up on, or a duplicate of one already complete */
+        return;
+    }
+    if (id > isoch->cur_id) {
+        iperf_isoch_skip(isoch, id);
+        isoch->cur_id = id;
+        isoch->got = 0;
+        isoch->complete = false;
+    }
+    if (++isoch->got == ntohl(hdr->frame_len)) {
+        iperf_isoch_complete(isoch, hdr, rx_us);
+        isoch->complete = true;
+    }
+}
+
+/* walk the TCP stream, frame header to frame header */
+static void iperf_isoch_tcp_account(iperf_isoch_t *isoch, const uint8_t *buf, uint32_t len, int64_t rx_us)
+{
+    iperf_frame_hdr_t *hdr = (iperf_frame_hdr_t *)isoch->hdr;
+    uint32_t n;
+
+    while (len) {
+        if (isoch->remain == 0) {
+            n = sizeof(*hdr) - isoch->hdr_len;
+            n = (n < len) ? n : len;
+            memcpy(isoch->hdr + isoch->hdr_len, buf, n);
+            isoch->hdr_len += n;
+            buf += n;
+            len -= n;
+            if (isoch->hdr_len < sizeof(*hdr)) {
+                break;
+            }
+            isoch->hdr_len = 0;
+            isoch->cur_id = ntohl(hdr->frame_id);
+            isoch->remain = ntohl(hdr->frame_len) - sizeof(*hdr);
+            if (isoch->remain == 0) {
+                iperf_isoch_complete(isoch, hdr, rx_us);
+            }
+            continue;
+        }
+        n = (isoch->remain < len) ? isoch->remain : len;
+        isoch->remain -= n;
+        buf += n;
+        len -= n;
+        if (isoch->remain == 0) {
+            iperf_isoch_complete(isoch, hdr, rx_us);
+        }
+    }
+}
+
+#if CONFIG_FREERTOS_USE_TRACE_FACILITY && CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+#define IPERF_SELF_TASKS 3 /* server traffic, client traffic, server report */
+
+typedef struct {
+    TaskHandle_t task[IPERF_SELF_TASKS];
+    uint32_t base[IPERF_SELF_TASKS];
+    uint32_t last[IPERF_SELF_TASKS];
+    uint32_t total_base;
+    uint32_t total_last;
+} iperf_cpu_t;
+
+/* remember the latest run time counter of each task while it exists; tasks that appear later start from zero */
+static void iperf_cpu_sample(iperf_cpu_t *cpu, bool first)
+{
+    UBaseType_t count = uxTaskGetNumberOfTasks();
+    TaskStatus_t *status = malloc(count * sizeof(TaskStatus_t));
+    uint32_t total;
+    UBaseType_t i;
+    int j;
+
+    if (!status) {
+        return;
+    }
+
+    count = uxTaskGetSystemState(status, count, &total);
+    for (i = 0; i < count; i++) {
+        for (j = 0; j < IPERF_SELF_TASKS; j++) {
+            if (cpu->task[j] && status[i].xHandle == cpu->task[j]) {
+                if (first) {
+                    cpu->base[j] = status[i].ulRunTimeCounter;
+                }
+                cpu->last[j] = status[i].ulRunTimeCounter;
+            }
+        }
+    }
+    if (first) {
+        cpu->total_base = total;
+    }
+    cpu->total_last = total;
+    free(status);
+}
+
+static float iperf_cpu_percent(const iperf_cpu_t *cpu, int j)
+{
+    uint32_t total = cpu->total_last - cpu->total_base;
+
+    return total ? (float)(cpu->last[j] - cpu->base[j]) * 100 / total : 0;
+}
+#endif
+
+#if CONFIG_IPERF_TLS
+/* --tls: mbedTLS state of one connection, allocated for the run (the contexts are large) */
+typedef struct iperf_tls {
+    mbedtls_ssl_context ssl;
+    mbedtls_ssl_config conf;
+    mbedtls_x509_crt cert;
+    mbedtls_pk_context key;
+    mbedtls_entropy_context entropy;
+    mbedtls_ctr_drbg_context drbg;
+    int ciphersuites[2];
+    int sockfd;
+    uint32_t record;        /* plaintext bytes per mbedtls_ssl_write() */
+    int64_t handshake_us;
+#if CONFIG_FREERTOS_USE_TRACE_FACILITY && CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+    iperf_cpu_t cpu;
+#endif
+} iperf_tls_t;
+
+/* the test certificate and key, embedded from certs/; for measuring, not for protecting anything */
+extern const unsigned char iperf_test_cert_start[] asm("_binary_iperf_test_cert_pem_start");
+extern const unsigned char iperf_test_cert_end[] asm("_binary_iperf_test_cert_pem_end");
+extern const unsigned char iperf_test_key_start[] asm("_binary_iperf_test_key_pem_start");
+extern const unsigned char iperf_test_key_end[] asm("_binary_iperf_test_key_pem_end");
+
+static int iperf_tls_bio_send(void *ctx, const unsigned char *buf, size_t len)
+{
+    int ret = send(*(int *)ctx, buf, len, 0);
+
+    if (ret < 0) {
+        return (errno == EAGAIN || errno == EWOULDBLOCK) ? MBEDTLS_ERR_SSL_WANT_WRITE : MBEDTLS_ERR_NET_SEND_FAILED;
+    }
+    return ret;
+}
+
+/* a receive timeout (SO_RCVTIMEO) comes back as WANT_READ, so --single-task keeps polling */
+static int iperf_tls_bio_recv(void *ctx, unsigned char *buf, size_t len)
+{
+    int ret = recv(*(int *)ctx, buf, len, 0);
+
+    if (ret < 0) {
+        return (errno == EAGAIN || errno == EWOULDBLOCK) ? MBEDTLS_ERR_SSL_WANT_READ : MBEDTLS_ERR_NET_RECV_FAILED;
+    }
+    return ret;
+}
+
+static void iperf_tls_error(const char *what, int ret)
+{
+    char buf[64];
+
+    mbedtls_strerror(ret, buf, sizeof(buf));
+    ESP_LOGE(TAG, "tls: %s failed: -0x%x %s", what, -ret, buf);
+}
+
+static void iperf_tls_free(iperf_ctrl_t *ctrl)
+{
+    iperf_tls_t *tls = ctrl->tls;
+
+    mbedtls_ssl_free(&tls->ssl);
+    mbedtls_ssl_config_free(&tls->conf);
+    mbedtls_x509_crt_free(&tls->cert);
+    mbedtls_pk_free(&tls->key);
+    mbedtls_ctr_drbg_free(&tls->drbg);
+    mbedtls_entropy_free(&tls->entropy);
+    free(tls);
+    ctrl->tls = NULL;
+}
+
+/* set up TLS on a connected socket and run the handshake; the engines then send/recv through it */
+static esp_err_t iperf_tls_start(iperf_ctrl_t *ctrl, int sockfd)
+{
+    bool server = (ctrl->cfg.flag & IPERF_FLAG_SERVER) != 0;
+    iperf_tls_t *tls = calloc(1, sizeof(iperf_tls_t));
+    int64_t start_us;
+    int ret;
+
+    if (!tls) {
+        ESP_LOGE(TAG, "tls: not enough memory");
+        return ESP_ERR_NO_MEM;
+    }
+    ctrl->tls = tls;
+    tls->sockfd = sockfd;
+    mbedtls_ssl_init(&tls->ssl);
+    mbedtls_ssl_config_init(&tls->conf);
+    mbedtls_x509_crt_init(&tls->cert);
+    mbedtls_pk_init(&tls->key);
+    mbedtls_ctr_drbg_init(&tls->drbg);
+    mbedtls_entropy_init(&tls->entropy);
+
+    if ((ret = mbedtls_ctr_drbg_seed(&tls->drbg, mbedtls_entropy_func, &tls->entropy, NULL, 0)) != 0) {
+        iperf_tls_error("seeding", ret);
+        goto fail;
+    }
+    ret = mbedtls_ssl_config_defaults(&tls->conf, server ? MBEDTLS_SSL_IS_SERVER : MBEDTLS_SSL_IS_CLIENT,
+                                      MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT);
+    if (ret != 0) {
+        iperf_tls_error("config", ret);
+        goto fail;
+    }
+    mbedtls_ssl_conf_rng(&tls->conf, mbedtls_ctr_drbg_random, &tls->drbg);
+    if (server) {
+        if ((ret = mbedtls_x509_crt_parse(&tls->cert, iperf_test_cert_start, iperf_test_cert_end - iperf_test_cert_start)) != 0 ||
+            (ret = mbedtls_pk_parse_key(&tls->key, iperf_test_key_start, iperf_test_key_end - iperf_test_key_start, NULL, 0)) != 0 ||
+            (ret = mbedtls_ssl_conf_own_cert(&tls->conf, &tls->cert, &tls->key)) != 0) {
+            iperf_tls_error("test certificate", ret);
+            goto fail;
+        }
+    } else {
+        /* the peer is a test endpoint; what's measured is the cost of the session, not its security */
+        mbedtls_ssl_conf_authmode(&tls->conf, MBEDTLS_SSL_VERIFY_NONE);
+    }
+    if (ctrl->cfg.tls_ciphersuite) {
+        tls->ciphersuites[0] = ctrl->cfg.tls_ciphersuite;
+        mbedtls_ssl_conf_ciphersuites(&tls->conf, tls->ciphersuites);
+    }
+    if ((ret = mbedtls_ssl_setup(&tls->ssl, &tls->conf)) != 0) {
+        iperf_tls_error("setup", ret);
+        goto fail;
+    }
+    mbedtls_ssl_set_bio(&tls->ssl, &tls->sockfd, iperf_tls_bio_send, iperf_tls_bio_recv, NULL);
+
+    start_us = esp_timer_get_time();
+    do {
+        ret = mbedtls_ssl_handshake(&tls->ssl);
+    } while ((ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE) && !ctrl->finish &&
+             esp_timer_get_time() - start_us < IPERF_SOCKET_RX_TIMEOUT * 1000000LL);
+    if (ret != 0) {
+        iperf_tls_error("handshake", ret);
+        goto fail;
+    }
+    tls->handshake_us = esp_timer_get_time() - start_us;
+    tls->record = (ctrl->cfg.tls_record && ctrl->cfg.tls_record < MBEDTLS_SSL_OUT_CONTENT_LEN) ?
+                  ctrl->cfg.tls_record : MBEDTLS_SSL_OUT_CONTENT_LEN;
+    printf("tls: %s, handshake %u ms\n", mbedtls_ssl_get_ciphersuite(&tls->ssl), (uint32_t)(tls->handshake_us / 1000));
+#if CONFIG_FREERTOS_USE_TRACE_FACILITY && CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+    tls->cpu.task[0] = ctrl->traffic_task;
+    iperf_cpu_sample(&tls->cpu, true);
+#endif
+    return ESP_OK;
+
+fail:
+    iperf_tls_free(ctrl);
+    return ESP_FAIL;
+}
+
+/* end the session, report its cost and free it */
+static void iperf_tls_stop(iperf_ctrl_t *ctrl)
+{
+    iperf_tls_t *tls = ctrl->tls;
+
+    if (!tls) {
+        return;
+    }
+    mbedtls_ssl_close_notify(&tls->ssl);
+#if CONFIG_FREERTOS_USE_TRACE_FACILITY && CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+    iperf_cpu_sample(&tls->cpu, false);
+    printf("tls: %s, handshake %u ms, %u byte records, traffic task cpu %.1f%%\n", mbedtls_ssl_get_ciphersuite(&tls->ssl),
+           (uint32_t)(tls->handshake_us / 1000), tls->record, iperf_cpu_percent(&tls->cpu, 0));
+#else
+    printf("tls: %s, handshake %u ms, %u byte records\n", mbedtls_ssl_get_ciphersuite(&tls->ssl),
+           (uint32_t)(tls->handshake_us / 1000), tls->record);
+#endif
+    iperf_tls_free(ctrl);
+}
+#else
+#define iperf_tls_start(ctrl, sockfd) ESP_ERR_NOT_SUPPORTED
+#define iperf_tls_stop(ctrl)
+#endif
+
+/* send()/recv() for the TCP engines, through TLS with --tls; failures look like a socket's (-1, errno) */
+static inline int iperf_tcp_send(iperf_ctrl_t *ctrl, int sockfd, const uint8_t *buf, int len)
+{
+#if CONFIG_IPERF_TLS
+    int ret;
+
+    if (ctrl->tls) {
+        ret = mbedtls_ssl_write(&ctrl->tls->ssl, buf, (len > ctrl->tls->record) ? ctrl->tls->record : len);
+        if (ret < 0) {
+            iperf_tls_error("write", ret);
+            return -1;
+        }
+        return ret;
+    }
+#endif
+    return send(sockfd, buf, len, 0);
+}
+
+static inline int iperf_tcp_recv(iperf_ctrl_t *ctrl, int sockfd, uint8_t *buf, int len)
+{
+#if CONFIG_IPERF_TLS
+    int ret;
+
+    if (ctrl->tls) {
+        ret = mbedtls_ssl_read(&ctrl->tls->ssl, buf, len);
+        if (ret == MBEDTLS_ERR_SSL_WANT_READ) {
+            errno = EAGAIN;
+            return -1;
+        }
+        if (ret == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY || ret == MBEDTLS_ERR_SSL_CONN_EOF) {
+            return 0;
+        }
+        if (ret < 0) {
+            iperf_tls_error("read", ret);
+            return -1;
+        }
+        return ret;
+    }
+#endif
+    return recv(sockfd, buf, len, 0);
+}
+
+static inline bool iperf_is_flash_writer(const iperf_ctrl_t *ctrl)
+{
+    return (ctrl->cfg.flag & IPERF_FLAG_SERVER) != 0;
+}
+
+static void iperf_flash_task(void *arg)
+{
+    iperf_ctrl_t *ctrl = (iperf_ctrl_t *)arg;
+    iperf_flash_t *flash = &ctrl->flash;
+    bool writer = iperf_is_flash_writer(ctrl);
+    iperf_flash_chunk_t chunk;
+    uint32_t len;
+    int64_t start_us;
+    esp_err_t err;
+
+    while (true) {
+        if (xQueueReceive(writer ? flash->full_q : flash->free_q, &chunk, IPERF_FLASH_POLL_MS / portTICK_PERIOD_MS) != pdTRUE) {
+            /* a writer still has to drain what the traffic task queued before finishing */
+            if (ctrl->finish && (!writer || uxQueueMessagesWaiting(flash->full_q) == 0)) {
+                break;
+            }
+            continue;
+        }
+
+        len = writer ? chunk.len : IPERF_FLASH_CHUNK;
+        if (flash->offset + len > flash->part->size) {
+            /* wrap around rather than split a chunk */
+            flash->offset = 0;
+        }
+        start_us = esp_timer_get_time();
+        if (writer) {
+            err = esp_partition_erase_range(flash->part, flash->offset, (len + IPERF_FLASH_SECTOR - 1) & ~(IPERF_FLASH_SECTOR - 1));
+            if (err == ESP_OK) {
+                /* writes go in words; a short last chunk is padded with what's left in the buffer */
+                err = esp_partition_write(flash->part, flash->offset, chunk.buf, (len + 3) & ~3);
+            }
+        } else {
+            err = esp_partition_read(flash->part, flash->offset, chunk.buf, len);
+        }
+        flash->flash_us += esp_timer_get_time() - start_us;
+        if (err != ESP_OK) {
+            flash->errors++;
+        }
+        flash->flash_bytes += len;
+        flash->offset += writer ? (len + IPERF_FLASH_SECTOR - 1) & ~(IPERF_FLASH_SECTOR - 1) : len;
+
+        chunk.len = len;
+        xQueueSend(writer ? flash->free_q : flash->full_q, &chunk, portMAX_DELAY);
+    }
+
+    flash->running = false;
+    vTaskDelete(NULL);
+}
+
+static esp_err_t iperf_flash_start(iperf_ctrl_t *ctrl)
+{
+    iperf_flash_t *flash = &ctrl->flash;
+    iperf_flash_chunk_t chunk;
+    int i;
+
+    memset(flash, 0, sizeof(*flash));
+    flash->part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, ctrl->cfg.partition);
+    if (!flash->part) {
+        flash->part = esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_ANY, ctrl->cfg.partition);
+    }
+    if (!flash->part || flash->part->size < IPERF_FLASH_CHUNK) {
+        ESP_LOGE(TAG, "no partition '%s' of at least %d bytes", ctrl->cfg.partition, IPERF_FLASH_CHUNK);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    flash->free_q = xQueueCreate(2, sizeof(iperf_flash_chunk_t));
+    flash->full_q = xQueueCreate(2, sizeof(iperf_flash_chunk_t));
+    if (!flash->free_q || !flash->full_q) {
+        goto fail;
+    }
+    for (i = 0; i < 2; i++) {
+        chunk.buf = ctrl->buffer + i * IPERF_FLASH_CHUNK;
+        chunk.len = 0;
+        xQueueSend(flash->free_q, &chunk, 0);
+    }
+
+    flash->running = true;
+    if (xTaskCreate(iperf_flash_task, IPERF_FLASH_TASK_NAME, IPERF_FLASH_TASK_STACK, ctrl, IPERF_FLASH_TASK_PRIORITY, NULL) != pdPASS) {
+        ESP_LOGE(TAG, "create task %s failed", IPERF_FLASH_TASK_NAME);
+        flash->running = false;
+        goto fail;
+    }
+    printf("flash: %s partition '%s' (%u KB at 0x%x)\n", iperf_is_flash_writer(ctrl) ? "writing to" : "sending from",
+           flash->part->label, flash->part->size >> 10, flash->part->address);
+    return ESP_OK;
+
+fail:
+    if (flash->free_q) {
+        vQueueDelete(flash->free_q);
+    }
+    if (flash->full_q) {
+        vQueueDelete(flash->full_q);
+    }
+    flash->part = NULL;
+    return ESP_ERR_NO_MEM;
+}
+
+/* wait for the flash task to finish with the buffers, then print the flash-only and network-only rates;
+   the usual summary line is the combined one */
+static void iperf_flash_stop(iperf_ctrl_t *ctrl)
+{
+    iperf_flash_t *flash = &ctrl->flash;
+
+    if (!flash->part) {
+        return;
+    }
+    while (flash->running) {
+        vTaskDelay(IPERF_REPORT_WAIT_MS / portTICK_PERIOD_MS);
+    }
+    vQueueDelete(flash->free_q);
+    vQueueDelete(flash->full_q);
+
+    printf("flash: %s %llu bytes in %u ms, %.2f Mbits/sec flash only%s\n", iperf_is_flash_writer(ctrl) ? "wrote" : "read",
+           (unsigned long long)flash->flash_bytes, (uint32_t)(flash->flash_us / 1000),
+           flash->flash_us ? flash->flash_bytes * 8.0 / flash->flash_us : 0.0, flash->errors ? " (with errors)" : "");
+    printf("flash: network only %.2f Mbits/sec (%u ms in %s), %u ms waiting for flash\n",
+           flash->net_us ? ctrl->total_len * 8.0 / flash->net_us : 0.0, (uint32_t)(flash->net_us / 1000),
+           iperf_is_flash_writer(ctrl) ? "recv" : "send", (uint32_t)(flash->wait_us / 1000));
+    flash->part = NULL;
+}
+
+/* TCP client loop for --from-partition: send each chunk the flash task has read */
+static esp_err_t IPERF_CLIENT_ATTR iperf_flash_send(iperf_ctrl_t *ctrl, int sockfd)
+{
+    iperf_flash_t *flash = &ctrl->flash;
+    iperf_flash_chunk_t chunk;
+    esp_err_t rc = ESP_OK;
+    uint32_t off;
+    int64_t start_us;
+    int ret;
+
+    while (!ctrl->finish && rc == ESP_OK) {
+        iperf_report_poll(ctrl);
+        start_us = esp_timer_get_time();
+        if (xQueueReceive(flash->full_q, &chunk, IPERF_FLASH_POLL_MS / portTICK_PERIOD_MS) != pdTRUE) {
+            flash->wait_us += esp_timer_get_time() - start_us;
+            continue;
+        }
+        flash->wait_us += esp_timer_get_time() - start_us;
+
+        for (off = 0; off < chunk.len && !ctrl->finish; off += ret) {
+            start_us = esp_timer_get_time();
+            IPERF_TRACE(IPERF_TRACE_SEND_BEGIN, chunk.len - off);
+            IPERF_HIST_BEGIN();
+            ret = send(sockfd, chunk.buf + off, chunk.len - off, 0);
+            IPERF_HIST_END();
+            IPERF_TRACE(IPERF_TRACE_SEND_END, ret);
+            flash->net_us += esp_timer_get_time() - start_us;
+            if (ret <= 0) {
+                iperf_show_socket_error_reason("tcp client send", sockfd);
+                rc = ESP_FAIL;
+                break;
+            }
+            ctrl->total_len += ret;
+        }
+        xQueueSend(flash->free_q, &chunk, portMAX_DELAY);
+    }
+
+    ctrl->finish = true;
+    return rc;
+}
+
+/* TCP server loop for --to-partition: fill a chunk, hand it to the flash task and carry on with the other one */
+static esp_err_t IPERF_SERVER_ATTR iperf_flash_recv(iperf_ctrl_t *ctrl, int sockfd)
+{
+    iperf_flash_t *flash = &ctrl->flash;
+    iperf_flash_chunk_t chunk;
+    bool have = false;
+    esp_err_t rc = ESP_OK;
+    int64_t last_rx_us = esp_timer_get_time();
+    int64_t start_us;
+    int ret;
+
+    while (!ctrl->finish) {
+        iperf_report_poll(ctrl);
+        if (!have) {
+            start_us = esp_timer_get_time();
+            have = xQueueReceive(flash->free_q, &chunk, IPERF_FLASH_POLL_MS / portTICK_PERIOD_MS) == pdTRUE;
+            flash->wait_us += esp_timer_get_time() - start_us;
+            chunk.len = 0;
+            continue;
+        }
+
+        start_us = esp_timer_get_time();
+        IPERF_TRACE(IPERF_TRACE_RECV_BEGIN, IPERF_FLASH_CHUNK - chunk.len);
+        IPERF_HIST_BEGIN();
+        ret = recv(sockfd, chunk.buf + chunk.len, IPERF_FLASH_CHUNK - chunk.len, 0);
+        IPERF_HIST_END();
+        IPERF_TRACE(IPERF_TRACE_RECV_END, ret);
+        flash->net_us += esp_timer_get_time() - start_us;
+        if (ret < 0 && iperf_rx_idle(ctrl, last_rx_us)) {
+            continue;
+        }
+        if (ret <= 0) {
+            if (ret < 0) {
+                iperf_show_socket_error_reason("tcp server recv", sockfd);
+                rc = ESP_FAIL;
+            }
+            break;
+        }
+        last_rx_us = esp_timer_get_time();
+        ctrl->total_len += ret;
+        chunk.len += ret;
+        if (chunk.len == IPERF_FLASH_CHUNK) {
+            xQueueSend(flash->full_q, &chunk, portMAX_DELAY);
+            have = false;
+        }
+    }
+
+    /* the last, partial chunk still goes to flash; queued before finish is set, so the flash task drains it */
+    if (have) {
+        xQueueSend(chunk.len ? flash->full_q : flash->free_q, &chunk, portMAX_DELAY);
+    }
+    ctrl->finish = true;
+    return rc;
+}
+
+static esp_err_t IPERF_SERVER_ATTR iperf_run_tcp_server(iperf_ctrl_t *ctrl)
+{
+    socklen_t addr_len;
+    iperf_addr_t remote_addr;
+    iperf_addr_t addr;
+    char addr_str[IPERF_ADDR_STR_LEN];
+    int actual_recv = 0;
+    int want_recv = 0;
+    uint8_t *buffer;
+    int listen_socket;
+    struct timeval t;
+    int sockfd;
+    int opt;
+    bool verify = (ctrl->cfg.flag & IPERF_FLAG_VERIFY) != 0;
+    bool isoch = (ctrl->cfg.flag & IPERF_FLAG_ISOCHRONOUS) != 0;
+    int64_t verify_us;
+    int64_t last_rx_us;
+
+    listen_socket = socket(iperf_addr_family(&ctrl->cfg.sip), SOCK_STREAM, IPPROTO_TCP);
+    if (listen_socket < 0) {
+        iperf_show_socket_error_reason("tcp server create", listen_socket);
+        return ESP_FAIL;
+    }
+
+    setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    addr_len = iperf_sockaddr(&addr, &ctrl->cfg.sip, ctrl->cfg.sport);
+    if (bind(listen_socket, &addr.sa, addr_len) != 0) {
+        iperf_show_socket_error_reason("tcp server bind", listen_socket);
+        close(listen_socket);
+        return ESP_FAIL;
+    }
+
+    if (listen(listen_socket, 5) < 0) {
+        iperf_show_socket_error_reason("tcp server listen", listen_socket);
+        close(listen_socket);
+        return ESP_FAIL;
+    }
+
+    buffer = ctrl->buffer;
+    want_recv = ctrl->buffer_len;
+
+    int rc = ESP_OK; // return code for this function, either ESP_OK or ESP_FAIL
+
+    /* accept with a timeout, so a server still waiting for its client can be stopped */
+    t.tv_sec = IPERF_SOCKET_ACCEPT_TIMEOUT;
+    t.tv_usec = 0;
+    setsockopt(listen_socket, SOL_SOCKET, SO_RCVTIMEO, &t, sizeof(t));
+    do {
+        addr_len = sizeof(remote_addr);
+        sockfd = accept(listen_socket, &remote_addr.sa, &addr_len);
+    } while (sockfd < 0 && errno == EAGAIN && !ctrl->finish);
+
+    if (sockfd < 0 && ctrl->finish) {
+        /* stopped before a client turned up, not an error */
+        ESP_LOGI(TAG, "tcp server stopped while waiting for a client");
+    } else if (sockfd < 0) {
+        iperf_show_socket_error_reason("tcp server listen", listen_socket);
+        rc = ESP_FAIL;
+    } else {
+        IPERF_TRACE(IPERF_TRACE_ACCEPT, sockfd);
+        printf("accept: %s,%d\n", iperf_addr_to_str(&remote_addr, addr_str, sizeof(addr_str)),
+               iperf_addr_port(&remote_addr));
+        iperf_set_rx_timeout(ctrl, sockfd);
+        if ((ctrl->cfg.flag & IPERF_FLAG_TLS) && iperf_tls_start(ctrl, sockfd) != ESP_OK) {
+            /* nothing was measured, so no report */
+            close(sockfd);
+            close(listen_socket);
+            return ESP_FAIL;
+        }
+        /* after the handshake, which isn't part of the throughput */
+        iperf_start_report(ctrl);
+        ctrl->sockfd = sockfd;
+        last_rx_us = esp_timer_get_time();
+
+        if ((ctrl->cfg.flag & IPERF_FLAG_FLASH) && iperf_flash_recv(ctrl, sockfd) != ESP_OK) {
+            rc = ESP_FAIL;
+        }
+
+        while (!ctrl->finish) {
+            iperf_report_poll(ctrl);
+            if (verify) {
+                /* keep the buffer aligned like the stream offset */
+                buffer = ctrl->buffer + (ctrl->verify.offset & 3);
+            }
+            IPERF_TRACE(IPERF_TRACE_RECV_BEGIN, want_recv);
+            IPERF_HIST_BEGIN();
+            actual_recv = iperf_tcp_recv(ctrl, sockfd, buffer, want_recv);
+            IPERF_HIST_END();
+            IPERF_TRACE(IPERF_TRACE_RECV_END, actual_recv);
+            if (actual_recv < 0 && iperf_rx_idle(ctrl, last_rx_us)) {
+                continue;
+            }
+            if (actual_recv <= 0) {
+                if (actual_recv < 0) {
+                    iperf_show_socket_error_reason("tcp server recv", listen_socket);
+                    rc = ESP_FAIL;
+                } 
+                // if actual_recv == 0 then it's not an error, the client just finished and closed the connection, so we do the same
+                break;
+            } else {
+                // just a normal read, account for it and continue
+                ctrl->total_len += actual_recv;
+                last_rx_us = esp_timer_get_time();
+                IPERF_CAPTURE(IPPROTO_TCP, &remote_addr, buffer, actual_recv, last_rx_us);
+                if (isoch) {
+                    iperf_isoch_tcp_account(&ctrl->isoch, buffer, actual_recv, last_rx_us);
+                }
+                if (verify) {
+                    verify_us = esp_timer_get_time();
+                    ctrl->verify.corrupted += iperf_verify_check(buffer, ctrl->verify.offset >> 2, ctrl->verify.offset & 3,
+                                                                 actual_recv);
+                    ctrl->verify.checked += actual_recv;
+                    ctrl->verify.offset += actual_recv;
+                    ctrl->verify.cost_us += esp_timer_get_time() - verify_us;
+                }
+            }
+        }
+
+        ctrl->finish = true; // signals it's finished so iperf_report_task() can finish itself
+                                    // XXX wouldn't it be better to use a semaphore or some such?
+
+        ctrl->sockfd = -1;
+        iperf_tls_stop(ctrl);
+        close(sockfd);
+    }
+
+    close(listen_socket);
+
+    return rc;
+}
+
+static inline void iperf_udp_account(iperf_udp_stats_t *stats, int32_t id)
+{
+    if (stats->packets++ == 0) {
+        stats->last_id = id;
+    } else if (id > stats->last_id) {
+        stats->lost += id - stats->last_id - 1;
+        stats->last_id = id;
+    } else {
+        /* late arrival of a datagram already counted as lost (or a duplicate) */
+        stats->reordered++;
+        if (stats->lost) {
+            stats->lost--;
+        }
+    }
+}
+
+static int iperf_join_group(int sockfd, const iperf_ctrl_t *ctrl)
+{
+#if LWIP_IPV6 && LWIP_IPV6_MLD
+    struct ipv6_mreq mreq6;
+
+    if (iperf_addr_is_ipv6(&ctrl->cfg.group)) {
+        memcpy(&mreq6.ipv6mr_multiaddr, &ctrl->cfg.group.sin6.sin6_addr, sizeof(mreq6.ipv6mr_multiaddr));
+        mreq6.ipv6mr_interface = 0;
+        return setsockopt(sockfd, IPPROTO_IPV6, IPV6_JOIN_GROUP, &mreq6, sizeof(mreq6));
+    }
+#else
+    if (iperf_addr_is_ipv6(&ctrl->cfg.group)) {
+        ESP_LOGE(TAG, "IPv6 multicast needs LWIP_IPV6_MLD");
+        return -1;
+    }
+#endif
+    struct ip_mreq mreq;
+
+    mreq.imr_multiaddr = ctrl->cfg.group.sin.sin_addr;
+    mreq.imr_interface = ctrl->cfg.sip.sin.sin_addr;
+    return setsockopt(sockfd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq));
+}
+
+static esp_err_t IPERF_SERVER_ATTR iperf_run_udp_server(iperf_ctrl_t *ctrl)
+{
+    socklen_t addr_len;
+    iperf_addr_t addr;
+    char addr_str[IPERF_ADDR_STR_LEN];
+    int actual_recv = 0;
+    int want_recv = 0;
+    uint8_t *buffer;
+    int sockfd;
+    int opt;
+    bool udp_recv_start = true ;
+    bool verify = (ctrl->cfg.flag & IPERF_FLAG_VERIFY) != 0;
+    bool isoch = (ctrl->cfg.flag & IPERF_FLAG_ISOCHRONOUS) != 0;
+    iperf_udp_pkt_t *udp;
+    int64_t verify_us;
+    int64_t last_rx_us;
+    int32_t id;
+
+    sockfd = socket(iperf_addr_family(&ctrl->cfg.sip), SOCK_DGRAM, IPPROTO_UDP);
+    if (sockfd < 0) {
+        iperf_show_socket_error_reason("udp server create", sockfd);
+        return ESP_FAIL;
+    }
+
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    /* group (multicast) and broadcast traffic isn't addressed to our own address, so bind to any */
+    if (iperf_addr_is_set(&ctrl->cfg.group)) {
+        iperf_addr_any(&addr, &ctrl->cfg.group);
+        addr_len = iperf_sockaddr(&addr, &addr, ctrl->cfg.sport);
+    } else {
+        addr_len = iperf_sockaddr(&addr, &ctrl->cfg.sip, ctrl->cfg.sport);
+    }
+    if (bind(sockfd, &addr.sa, addr_len) != 0) {
+        iperf_show_socket_error_reason("udp server bind", sockfd);
+        return ESP_FAIL;
+    }
+
+    if (iperf_addr_is_set(&ctrl->cfg.group) && iperf_addr_is_multicast(&ctrl->cfg.group)) {
+        if (iperf_join_group(sockfd, ctrl) < 0) {
+            iperf_show_socket_error_reason("udp server join group", sockfd);
+            close(sockfd);
+            return ESP_FAIL;
+        }
+        printf("joined multicast group %s\n", iperf_addr_to_str(&ctrl->cfg.group, addr_str, sizeof(addr_str)));
+    }
+
+    buffer = ctrl->buffer;
+    want_recv = ctrl->buffer_len;
+    ESP_LOGI(TAG, "want recv=%d", want_recv);
+
+    iperf_set_rx_timeout(ctrl, sockfd);
+    last_rx_us = esp_timer_get_time();
+
+    while (!ctrl->finish) {
+        iperf_report_poll(ctrl);
+        IPERF_TRACE(IPERF_TRACE_RECV_BEGIN, want_recv);
+        IPERF_HIST_BEGIN();
+        addr_len = sizeof(addr);
+        actual_recv = recvfrom(sockfd, buffer, want_recv, 0, &addr.sa, &addr_len);
+        IPERF_HIST_END();
+        IPERF_TRACE(IPERF_TRACE_RECV_END, actual_recv);
+        if (actual_recv < 0) {
+            if (!iperf_rx_idle(ctrl, last_rx_us)) {
+                iperf_show_socket_error_reason("udp server recv", sockfd);
+                last_rx_us = esp_timer_get_time();
+            }
+        } else {
+            last_rx_us = esp_timer_get_time();
+            IPERF_CAPTURE(IPPROTO_UDP, &addr, buffer, actual_recv, last_rx_us);
+            if(udp_recv_start){
+                iperf_start_report(ctrl);
+                udp_recv_start = false;
+            }
+            ctrl->total_len += actual_recv;
+            if (actual_recv < sizeof(iperf_udp_pkt_t)) {
+                continue;
+            }
+            udp = (iperf_udp_pkt_t *)buffer;
+            id = ntohl(udp->id);
+            if (id >= 0) {
+                /* negative ids are iperf2's end of test marker */
+                iperf_udp_account(&ctrl->udp, id);
+            }
+            if (isoch && actual_recv >= sizeof(iperf_udp_pkt_t) + sizeof(iperf_frame_hdr_t)) {
+                iperf_isoch_udp_account(&ctrl->isoch, (iperf_frame_hdr_t *)(udp + 1), last_rx_us);
+            }
+            if (verify && id >= 0) {
+                /* the same word index the client filled from; the end marker carries no pattern */
+                verify_us = esp_timer_get_time();
+                ctrl->verify.corrupted += iperf_verify_check(buffer + sizeof(iperf_udp_pkt_t), (uint32_t)id << IPERF_VERIFY_ID_SHIFT, 0,
+                                                             actual_recv - sizeof(iperf_udp_pkt_t));
+                ctrl->verify.checked += actual_recv - sizeof(iperf_udp_pkt_t);
+                ctrl->verify.cost_us += esp_timer_get_time() - verify_us;
+            }
+        }
+    }
+
+    ctrl->finish = true;
+    close(sockfd);
+    return ESP_OK;
+}
+
+/* fast enough to call per send, unlike the libc rand() with its lock */
+static inline uint32_t iperf_rand(iperf_shape_t *shape)
+{
+    uint32_t x = shape->rng;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    shape->rng = x;
+    return x;
+}
+
+/* an exponentially distributed value with the given mean, from a table so there's no log() per send;
+   the tail is cut at about 6.2 times the mean */
+static inline uint32_t iperf_rand_exp(iperf_shape_t *shape, uint32_t mean)
+{
+    return (uint32_t)(((uint64_t)mean * s_iperf_exp[iperf_rand(shape) >> (32 - IPERF_EXP_TABLE_BITS)]) >> 12);
+}
+
+static void iperf_shape_init(iperf_ctrl_t *ctrl)
+{
+    iperf_shape_t *shape = &ctrl->shape;
+    const iperf_cfg_t *cfg = &ctrl->cfg;
+    int i;
+
+    memset(shape, 0, sizeof(*shape));
+    shape->active = cfg->burst_on_ms || cfg->pps;
+    if (!shape->active && cfg->len_dist == IPERF_LEN_FIXED) {
+        return;
+    }
+
+    if (!s_iperf_exp[0]) {
+        for (i = 0; i < (1 << IPERF_EXP_TABLE_BITS); i++) {
+            s_iperf_exp[i] = (uint16_t)(-log((i + 0.5) / (1 << IPERF_EXP_TABLE_BITS)) * 4096);
+        }
+    }
+    shape->rng = cfg->seed;
+    while (!shape->rng) {
+        shape->rng = esp_random();
+    }
+    printf("traffic shape: burst %u/%u ms, poisson %u/sec, len %s %u-%u, seed %u\n", cfg->burst_on_ms, cfg->burst_off_ms, cfg->pps,
+           (cfg->len_dist == IPERF_LEN_UNIFORM) ? "uniform" : (cfg->len_dist == IPERF_LEN_EXP) ? "exp" : "fixed",
+           cfg->len_min, cfg->len_max, shape->rng);
+
+    shape->phase_us = esp_timer_get_time() + cfg->burst_on_ms * 1000;
+    shape->next_us = esp_timer_get_time();
+}
+
+/* whether the next send is due; if not, waits a little (a tick at most) so the caller can poll and come back */
+static bool iperf_shape_ready(iperf_ctrl_t *ctrl)
+{
+    iperf_shape_t *shape = &ctrl->shape;
+    const iperf_cfg_t *cfg = &ctrl->cfg;
+    int64_t now_us;
+    int64_t wait_us = 0;
+    TickType_t ticks;
+
+    if (!shape->active) {
+        return true;
+    }
+
+    now_us = esp_timer_get_time();
+    if (cfg->burst_on_ms) {
+        while (now_us >= shape->phase_us) {
+            shape->off = !shape->off && cfg->burst_off_ms;
+            if (!shape->off) {
+                /* arrivals restart with the burst rather than catching up on the pause */
+                shape->next_us = shape->phase_us;
+            }
+            shape->phase_us += (shape->off ? cfg->burst_off_ms : cfg->burst_on_ms) * 1000;
+        }
+        if (shape->off) {
+            wait_us = shape->phase_us - now_us;
+        }
+    }
+    if (!wait_us && cfg->pps && now_us < shape->next_us) {
+        wait_us = shape->next_us - now_us;
+    }
+
+    if (wait_us) {
+        /* gaps shorter than a tick are spun through, or the mean rate couldn't be kept */
+        ticks = wait_us / (portTICK_PERIOD_MS * 1000);
+        if (ticks) {
+            vTaskDelay(ticks);
+        }
+        return false;
+    }
+
+    if (cfg->pps) {
+        shape->next_us += iperf_rand_exp(shape, 1000000 / cfg->pps);
+        if (now_us - shape->next_us > 1000000) {
+            /* a stall (eg a blocked TCP send) left us far behind; don't burst to catch up */
+            shape->next_us = now_us;
+        }
+    }
+    return true;
+}
+
+/* bytes for the next send, between min_len and max_len */
+static uint32_t iperf_shape_len(iperf_ctrl_t *ctrl, uint32_t min_len, uint32_t max_len)
+{
+    const iperf_cfg_t *cfg = &ctrl->cfg;
+    uint32_t len;
+
+    switch (cfg->len_dist) {
+    case IPERF_LEN_UNIFORM:
+        len = cfg->len_min;
+        if (cfg->len_max > cfg->len_min) {
+            len += iperf_rand(&ctrl->shape) % (cfg->len_max - cfg->len_min + 1);
+        }
+        break;
+    case IPERF_LEN_EXP:
+        len = iperf_rand_exp(&ctrl->shape, cfg->len_min);
+        break;
+    default:
+        len = cfg->len_min ? cfg->len_min : max_len;
+        break;
+    }
+    return (len < min_len) ? min_len : (len > max_len) ? max_len : len;
+}
+
+static esp_err_t IPERF_CLIENT_ATTR iperf_run_udp_client(iperf_ctrl_t *ctrl)
+{
+    iperf_addr_t addr;
+    socklen_t addr_len;
+    iperf_udp_pkt_t *udp;
+    int actual_send = 0;
+    bool retry = false;
+    uint32_t delay = 1;
+    int want_send = 0;
+    uint8_t *buffer;
+    int sockfd;
+    int opt;
+    int err;
+    int id;
+    uint8_t ttl;
+    bool verify = (ctrl->cfg.flag & IPERF_FLAG_VERIFY) != 0;
+    int64_t verify_us;
+
+    sockfd = socket(iperf_addr_family(&ctrl->cfg.dip), SOCK_DGRAM, IPPROTO_UDP);
+    if (sockfd < 0) {
+        iperf_show_socket_error_reason("udp client create", sockfd);
+        return ESP_FAIL;
+    }
+
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    if (iperf_addr_is_ipv6(&ctrl->cfg.dip)) {
+        /* lwIP has no IPV6_MULTICAST_HOPS, multicast goes out with the default hop limit */
+    } else if (iperf_addr_is_multicast(&ctrl->cfg.dip)) {
+        ttl = ctrl->cfg.ttl ? ctrl->cfg.ttl : IPERF_DEFAULT_MCAST_TTL;
+        setsockopt(sockfd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+    } else {
+        /* needed if dip is a (subnet) broadcast address, harmless otherwise */
+        opt = 1;
+        setsockopt(sockfd, SOL_SOCKET, SO_BROADCAST, &opt, sizeof(opt));
+    }
+
+    addr_len = iperf_sockaddr(&addr, &ctrl->cfg.dip, ctrl->cfg.dport);
+
+    iperf_shape_init(ctrl);
+    iperf_start_report(ctrl);
+    buffer = ctrl->buffer;
+    udp = (iperf_udp_pkt_t *)buffer;
+    want_send = ctrl->buffer_len;
+    id = 0;
+
+    while (!ctrl->finish) {
+        iperf_report_poll(ctrl);
+        if (false == retry) {
+            if (!iperf_shape_ready(ctrl)) {
+                continue;
+            }
+            id++;
+            udp->id = htonl(id);
+            delay = 1;
+            want_send = iperf_shape_len(ctrl, sizeof(*udp), ctrl->buffer_len);
+            if (verify) {
+                verify_us = esp_timer_get_time();
+                /* rounded up, sizes needn't be a multiple of 4 (the buffer has slack for it) */
+                iperf_verify_fill((uint32_t *)(udp + 1), (uint32_t)id << IPERF_VERIFY_ID_SHIFT,
+                                  (want_send - sizeof(*udp) + sizeof(uint32_t) - 1) / sizeof(uint32_t));
+                ctrl->verify.cost_us += esp_timer_get_time() - verify_us;
+            }
+        }
+
+        retry = false;
+        IPERF_TRACE(IPERF_TRACE_SEND_BEGIN, want_send);
+        IPERF_HIST_BEGIN();
+        actual_send = sendto(sockfd, buffer, want_send, 0, &addr.sa, addr_len);
+        IPERF_HIST_END();
+        IPERF_TRACE(IPERF_TRACE_SEND_END, actual_send);
+
+        if (actual_send != want_send) {
+            err = iperf_get_socket_error_code(sockfd);
+            if (err == ENOMEM) {
+                IPERF_HIST_ENOMEM();
+                IPERF_HIST_BACKOFF(delay * portTICK_PERIOD_MS * 1000);
+                IPERF_TRACE(IPERF_TRACE_ENOMEM, delay * portTICK_PERIOD_MS);
+                vTaskDelay(delay);
+                if (delay < IPERF_MAX_DELAY) {
+                    delay <<= 1;
+                }
+                retry = true;
+                continue;
+            } else {
+                ESP_LOGE(TAG, "udp client send abort: err=%d", err);
+                break;
+            }
+        } else {
+            ctrl->total_len += actual_send;
+        }
+    }
+
+    ctrl->finish = true;
+    close(sockfd);
+    return ESP_OK;
+}
+
+/* --batch: the UDP client's raw pcb, and the batch being handed to the tcpip thread */
+typedef struct {
+    struct tcpip_api_call_data call;
+    iperf_ctrl_t *ctrl;
+    struct udp_pcb *pcb;
+    ip_addr_t dip;
+    uint16_t dport;
+    uint8_t ttl;
+    uint32_t count;     /* datagrams to send in this call */
+    uint32_t sent;      /* datagrams of it sent */
+    uint32_t bytes;     /* and their payload bytes */
+    int32_t id;         /* id of the last datagram sent */
+} iperf_batch_t;
+
+/* the iperf_batch_*_fn run in the tcpip thread, the only place the raw API may be used */
+static err_t iperf_batch_open_fn(struct tcpip_api_call_data *call)
+{
+    iperf_batch_t *batch = (iperf_batch_t *)call;
+
+    batch->pcb = udp_new();
+    if (!batch->pcb) {
+        return ERR_MEM;
+    }
+#if LWIP_MULTICAST_TX_OPTIONS
+    udp_set_multicast_ttl(batch->pcb, batch->ttl);
+#endif
+    /* needed if dip is a (subnet) broadcast address, harmless otherwise */
+    ip_set_option(batch->pcb, SOF_BROADCAST);
+    return udp_connect(batch->pcb, &batch->dip, batch->dport);
+}
+
+static err_t iperf_batch_close_fn(struct tcpip_api_call_data *call)
+{
+    iperf_batch_t *batch = (iperf_batch_t *)call;
+
+    udp_remove(batch->pcb);
+    batch->pcb = NULL;
+    return ERR_OK;
+}
+
+/* send up to batch->count datagrams; stops at the first one lwIP can't take, which the next call resends */
+static err_t IPERF_CLIENT_ATTR iperf_batch_send_fn(struct tcpip_api_call_data *call)
+{
+    iperf_batch_t *batch = (iperf_batch_t *)call;
+    iperf_ctrl_t *ctrl = batch->ctrl;
+    iperf_udp_pkt_t *udp;
+    struct pbuf *p;
+    uint32_t len;
+    err_t err = ERR_OK;
+
+    batch->sent = 0;
+    batch->bytes = 0;
+    while (batch->sent < batch->count) {
+        len = iperf_shape_len(ctrl, sizeof(*udp), ctrl->buffer_len);
+        /* the payload is copied, not referenced: the driver may still hold the datagram when the run ends and
+           ctrl->buffer is freed; the pbuf has room in front for the UDP/IP/link headers */
+        p = pbuf_alloc(PBUF_TRANSPORT, len, PBUF_RAM);
+        if (!p) {
+            err = ERR_MEM;
+            break;
+        }
+        udp = (iperf_udp_pkt_t *)p->payload;
+        udp->id = htonl(batch->id + 1);
+        udp->sec = 0;
+        udp->usec = 0;
+        memcpy(udp + 1, ctrl->buffer + sizeof(*udp), len - sizeof(*udp));
+        err = udp_send(batch->pcb, p);
+        pbuf_free(p);
+        if (err != ERR_OK) {
+            break;
+        }
+        batch->id++;
+        batch->sent++;
+        batch->bytes += len;
+    }
+    return err;
+}
+
+/* the UDP client with --batch: one wakeup of the tcpip thread per batch instead of per datagram */
+static esp_err_t IPERF_CLIENT_ATTR iperf_run_udp_batch_client(iperf_ctrl_t *ctrl)
+{
+    iperf_batch_t batch;
+    bool retry = false;
+    uint32_t delay = 1;
+    err_t err;
+
+    memset(&batch, 0, sizeof(batch));
+    batch.ctrl = ctrl;
+    ip_addr_set_ip4_u32(&batch.dip, ctrl->cfg.dip.sin.sin_addr.s_addr);
+    batch.dport = ctrl->cfg.dport;
+    batch.ttl = ctrl->cfg.ttl ? ctrl->cfg.ttl : IPERF_DEFAULT_MCAST_TTL;
+    batch.count = ctrl->cfg.batch;
+
+    err = tcpip_api_call(iperf_batch_open_fn, &batch.call);
+    if (err != ERR_OK) {
+        ESP_LOGE(TAG, "udp batch client create: err=%d", err);
+        if (batch.pcb) {
+            tcpip_api_call(iperf_batch_close_fn, &batch.call);
+        }
+        return ESP_FAIL;
+    }
+    ESP_LOGI(TAG, "udp client: %u datagrams per call", batch.count);
+
+    iperf_shape_init(ctrl);
+    iperf_start_report(ctrl);
+
+    while (!ctrl->finish) {
+        iperf_report_poll(ctrl);
+        if (false == retry) {
+            if (!iperf_shape_ready(ctrl)) {
+                continue;
+            }
+            delay = 1;
+        }
+
+        retry = false;
+        IPERF_TRACE(IPERF_TRACE_SEND_BEGIN, batch.count);
+        IPERF_HIST_BEGIN();
+        err = tcpip_api_call(iperf_batch_send_fn, &batch.call);
+        IPERF_HIST_END();
+        IPERF_TRACE(IPERF_TRACE_SEND_END, batch.sent);
+        ctrl->total_len += batch.bytes;
+
+        if (err == ERR_MEM) {
+            IPERF_HIST_ENOMEM();
+            IPERF_HIST_BACKOFF(delay * portTICK_PERIOD_MS * 1000);
+            IPERF_TRACE(IPERF_TRACE_ENOMEM, delay * portTICK_PERIOD_MS);
+            vTaskDelay(delay);
+            if (delay < IPERF_MAX_DELAY) {
+                delay <<= 1;
+            }
+            retry = true;
+        } else if (err != ERR_OK) {
+            ESP_LOGE(TAG, "udp batch client send abort: err=%d", err);
+            break;
+        }
+    }
+
+    ctrl->finish = true;
+    tcpip_api_call(iperf_batch_close_fn, &batch.call);
+    return ESP_OK;
+}
+
+static esp_err_t IPERF_CLIENT_ATTR iperf_run_tcp_client(iperf_ctrl_t *ctrl)
+{
+    iperf_addr_t remote_addr;
+    socklen_t addr_len;
+    int actual_send = 0;
+    int want_send = 0;
+    uint8_t *buffer;
+    int sockfd;
+    bool verify = (ctrl->cfg.flag & IPERF_FLAG_VERIFY) != 0;
+    int64_t verify_us;
+    int ret;
+
+    sockfd = socket(iperf_addr_family(&ctrl->cfg.dip), SOCK_STREAM, IPPROTO_TCP);
+    if (sockfd < 0) {
+        iperf_show_socket_error_reason("tcp client create", sockfd);
+        return ESP_FAIL;
+    }
+
+    addr_len = iperf_sockaddr(&remote_addr, &ctrl->cfg.dip, ctrl->cfg.dport);
+    IPERF_TRACE(IPERF_TRACE_CONNECT_BEGIN, 0);
+    ret = connect(sockfd, &remote_addr.sa, addr_len);
+    IPERF_TRACE(IPERF_TRACE_CONNECT_END, ret);
+    if (ret < 0) {
+        iperf_show_socket_error_reason("tcp client connect", sockfd);
+        return ESP_FAIL;
+    }
+    if ((ctrl->cfg.flag & IPERF_FLAG_TLS) && iperf_tls_start(ctrl, sockfd) != ESP_OK) {
+        close(sockfd);
+        return ESP_FAIL;
+    }
+
+    ctrl->sockfd = sockfd;
+    iperf_shape_init(ctrl);
+    iperf_start_report(ctrl);
+    if (ctrl->cfg.flag & IPERF_FLAG_FLASH) {
+        /* loops until the end of the run */
+        iperf_flash_send(ctrl, sockfd);
+    }
+    buffer = ctrl->buffer;
+    want_send = ctrl->buffer_len;
+    while (!ctrl->finish) {
+        iperf_report_poll(ctrl);
+        if (!iperf_shape_ready(ctrl)) {
+            continue;
+        }
+        want_send = iperf_shape_len(ctrl, 1, ctrl->buffer_len);
+        if (verify) {
+            /* regenerate from the word holding the next stream byte on; partial sends can leave it unaligned */
+            verify_us = esp_timer_get_time();
+            iperf_verify_fill((uint32_t *)ctrl->buffer, ctrl->verify.offset >> 2,
+                              ((ctrl->verify.offset & 3) + want_send + sizeof(uint32_t) - 1) / sizeof(uint32_t));
+            buffer = ctrl->buffer + (ctrl->verify.offset & 3);
+            ctrl->verify.cost_us += esp_timer_get_time() - verify_us;
+        }
+        IPERF_TRACE(IPERF_TRACE_SEND_BEGIN, want_send);
+        IPERF_HIST_BEGIN();
+        actual_send = iperf_tcp_send(ctrl, sockfd, buffer, want_send);
+        IPERF_HIST_END();
+        IPERF_TRACE(IPERF_TRACE_SEND_END, actual_send);
+        if (actual_send <= 0) {
+            iperf_show_socket_error_reason("tcp client send", sockfd);
+            break;
+        } else {
+            ctrl->total_len += actual_send;
+            ctrl->verify.offset += actual_send;
+        }
+    }
+
+    ctrl->finish = true;
+    ctrl->sockfd = -1;
+    iperf_tls_stop(ctrl);
+    close(sockfd);
+    return ESP_OK;
+}
+
+/* --isochronous: bytes in the next frame, drawn from a normal distribution of the offered load */
+static uint32_t iperf_isoch_frame_len(const iperf_cfg_t *cfg, uint32_t fps, uint32_t min_len)
+{
+    double bits = cfg->isoch_mean_bps ? cfg->isoch_mean_bps : IPERF_DEFAULT_ISOCH_MEAN_BPS;
+    double u1, u2;
+    double len;
+
+    if (cfg->isoch_stddev_bps) {
+        /* Box-Muller; u1 is kept away from 0 */
+        u1 = (esp_random() + 1.0) / 4294967297.0;
+        u2 = esp_random() / 4294967296.0;
+        bits += cfg->isoch_stddev_bps * sqrt(-2 * log(u1)) * cos(2 * M_PI * u2);
+    }
+    len = bits / 8 / fps;
+    return (len > min_len) ? (uint32_t)len : min_len;
+}
+
+/* --isochronous client: one burst (frame) every 1/fps seconds, as a video source would send them */
+static esp_err_t IPERF_CLIENT_ATTR iperf_run_isoch_client(iperf_ctrl_t *ctrl)
+{
+    bool is_udp = (ctrl->cfg.flag & IPERF_FLAG_UDP) != 0;
+    uint32_t fps = ctrl->cfg.isoch_fps ? ctrl->cfg.isoch_fps : IPERF_DEFAULT_ISOCH_FPS;
+    uint32_t period_us = 1000000 / fps;
+    uint32_t hdr_off = is_udp ? sizeof(iperf_udp_pkt_t) : 0;
+    iperf_frame_hdr_t *hdr = (iperf_frame_hdr_t *)(ctrl->buffer + hdr_off);
+    iperf_udp_pkt_t *udp = (iperf_udp_pkt_t *)ctrl->buffer;
+    iperf_addr_t addr;
+    socklen_t addr_len;
+    uint32_t frame_id = 0;
+    uint32_t remain;
+    uint32_t sent;
+    uint8_t *data;
+    uint32_t delay;
+    int64_t next_us;
+    int64_t now_us;
+    int want_send;
+    int actual_send;
+    int sockfd;
+    int err;
+    int ret;
+    int id = 0;
+    TickType_t ticks;
+    esp_err_t rc = ESP_OK;
+
+    sockfd = socket(iperf_addr_family(&ctrl->cfg.dip), is_udp ? SOCK_DGRAM : SOCK_STREAM, is_udp ? IPPROTO_UDP : IPPROTO_TCP);
+    if (sockfd < 0) {
+        iperf_show_socket_error_reason("isoch client create", sockfd);
         return ESP_FAIL;
     }
 
-    memset(&s_iperf_ctrl, 0, sizeof(s_iperf_ctrl));
-    memcpy(&s_iperf_ctrl.cfg, cfg, sizeof(*cfg));
-    s_iperf_is_running = true;
-    s_iperf_ctrl.finish = false;
-    s_iperf_ctrl.buffer_len = iperf_get_buffer_len();
-    s_iperf_ctrl.buffer = (uint8_t *)malloc(s_iperf_ctrl.buffer_len);
-    if (!s_iperf_ctrl.buffer) {
+    addr_len = iperf_sockaddr(&addr, &ctrl->cfg.dip, ctrl->cfg.dport);
+    if (!is_udp) {
+        IPERF_TRACE(IPERF_TRACE_CONNECT_BEGIN, 0);
+        ret = connect(sockfd, &addr.sa, addr_len);
+        IPERF_TRACE(IPERF_TRACE_CONNECT_END, ret);
+        if (ret < 0) {
+            iperf_show_socket_error_reason("isoch client connect", sockfd);
+            close(sockfd);
+            return ESP_FAIL;
+        }
+        ctrl->sockfd = sockfd;
+    }
+
+    printf("isochronous: %u frames/sec, mean %u stddev %u bits/sec\n", fps,
+           ctrl->cfg.isoch_mean_bps ? ctrl->cfg.isoch_mean_bps : IPERF_DEFAULT_ISOCH_MEAN_BPS, ctrl->cfg.isoch_stddev_bps);
+    iperf_start_report(ctrl);
+    next_us = esp_timer_get_time();
+
+    while (!ctrl->finish && rc == ESP_OK) {
+        iperf_report_poll(ctrl);
+        now_us = esp_timer_get_time();
+        if (now_us < next_us) {
+            ticks = (next_us - now_us) / (portTICK_PERIOD_MS * 1000);
+            vTaskDelay(ticks ? ticks : 1);
+            continue;
+        }
+        next_us += period_us;
+        if (now_us - next_us > period_us) {
+            /* fell more than a frame behind (stalled sends); don't burst to catch up */
+            next_us = now_us + period_us;
+        }
+
+        remain = iperf_isoch_frame_len(&ctrl->cfg, fps, hdr_off + sizeof(*hdr));
+        hdr->frame_id = htonl(++frame_id);
+        hdr->frame_len = htonl(is_udp ? (remain + ctrl->buffer_len - 1) / ctrl->buffer_len : remain);
+        hdr->period_us = htonl(period_us);
+        hdr->tx_sec = htonl((uint32_t)(now_us / 1000000));
+        hdr->tx_usec = htonl((uint32_t)(now_us % 1000000));
+
+        delay = 1;
+        sent = 0;
+        while (remain && !ctrl->finish) {
+            /* TCP: a partial send may have left the frame header half sent, resume it */
+            data = ctrl->buffer + ((sent < hdr_off + sizeof(*hdr)) ? sent : 0);
+            want_send = ctrl->buffer_len - (data - ctrl->buffer);
+            want_send = (remain < want_send) ? remain : want_send;
+            if (is_udp) {
+                /* the last datagram of a frame still has to carry the headers */
+                want_send = (want_send > hdr_off + sizeof(*hdr)) ? want_send : hdr_off + sizeof(*hdr);
+                udp->id = htonl(id + 1);
+                IPERF_TRACE(IPERF_TRACE_SEND_BEGIN, want_send);
+                IPERF_HIST_BEGIN();
+                actual_send = sendto(sockfd, ctrl->buffer, want_send, 0, &addr.sa, addr_len);
+                IPERF_HIST_END();
+                IPERF_TRACE(IPERF_TRACE_SEND_END, actual_send);
+            } else {
+                IPERF_TRACE(IPERF_TRACE_SEND_BEGIN, want_send);
+                IPERF_HIST_BEGIN();
+                actual_send = send(sockfd, data, want_send, 0);
+                IPERF_HIST_END();
+                IPERF_TRACE(IPERF_TRACE_SEND_END, actual_send);
+            }
+            if (actual_send <= 0) {
+                err = iperf_get_socket_error_code(sockfd);
+                if (is_udp && err == ENOMEM) {
+                    IPERF_HIST_ENOMEM();
+                    IPERF_HIST_BACKOFF(delay * portTICK_PERIOD_MS * 1000);
+                    IPERF_TRACE(IPERF_TRACE_ENOMEM, delay * portTICK_PERIOD_MS);
+                    vTaskDelay(delay);
+                    if (delay < IPERF_MAX_DELAY) {
+                        delay <<= 1;
+                    }
+                    continue;
+                }
+                ESP_LOGE(TAG, "isoch client send abort: err=%d", err);
+                rc = ESP_FAIL;
+                break;
+            }
+            if (is_udp) {
+                id++;
+                delay = 1;
+            }
+            ctrl->total_len += actual_send;
+            sent += actual_send;
+            remain -= (actual_send < remain) ? actual_send : remain;
+        }
+    }
+
+    ctrl->finish = true;
+    ctrl->sockfd = -1;
+    close(sockfd);
+    return rc;
+}
+
+static void iperf_task_traffic(void *arg)
+{
+    iperf_ctrl_t *ctrl = (iperf_ctrl_t *)arg;
+    int64_t start_us = esp_timer_get_time();
+
+    IPERF_TRACE(IPERF_TRACE_TASK_WAKE, IPERF_TRACE_TASK_TRAFFIC);
+    if ((ctrl->cfg.flag & IPERF_FLAG_FLASH) && iperf_flash_start(ctrl) != ESP_OK) {
+        /* nothing to run */
+    } else if ((ctrl->cfg.flag & IPERF_FLAG_ISOCHRONOUS) && (ctrl->cfg.flag & IPERF_FLAG_CLIENT)) {
+        iperf_run_isoch_client(ctrl);
+    } else if (iperf_is_udp_client(ctrl) && ctrl->cfg.batch > 1) {
+        iperf_run_udp_batch_client(ctrl);
+    } else if (iperf_is_udp_client(ctrl)) {
+        iperf_run_udp_client(ctrl);
+    } else if (iperf_is_udp_server(ctrl)) {
+        iperf_run_udp_server(ctrl);
+    } else if (iperf_is_tcp_client(ctrl)) {
+        iperf_run_tcp_client(ctrl);
+    } else {
+        iperf_run_tcp_server(ctrl);
+    }
+
+    if (iperf_is_single_task(ctrl) && ctrl->report.next_us) {
+        iperf_report_end(ctrl);
+    }
+
+    iperf_flash_stop(ctrl);
+
+    if (ctrl->cfg.flag & IPERF_FLAG_VERIFY) {
+        iperf_verify_show(ctrl, (uint32_t)((esp_timer_get_time() - start_us) / 1000));
+    }
+
+#if CONFIG_IPERF_CALL_HISTOGRAM
+    iperf_hist_show(&ctrl->hist, (ctrl->cfg.flag & IPERF_FLAG_CLIENT) ? "send" : "recv",
+                    (uint32_t)((esp_timer_get_time() - start_us) / 1000));
+#endif
+
+    if (ctrl->buffer) {
+        free(ctrl->buffer);
+        ctrl->buffer = NULL;
+    }
+
+    /* other instances may be finishing too */
+    vTaskSuspendAll();
+    if (iperf_is_tcp_client(ctrl)) {
+        s_iperf_totals.tcp_tx_bytes += ctrl->total_len;
+    } else if (iperf_is_tcp_server(ctrl)) {
+        s_iperf_totals.tcp_rx_bytes += ctrl->total_len;
+    } else if (iperf_is_udp_client(ctrl)) {
+        s_iperf_totals.udp_tx_bytes += ctrl->total_len;
+    } else {
+        s_iperf_totals.udp_rx_bytes += ctrl->total_len;
+    }
+    s_iperf_totals.runs++;
+    xTaskResumeAll();
+
+    /* the summary is only complete once the report task has printed its last line */
+    while (ctrl->reporting) {
+        vTaskDelay(IPERF_REPORT_WAIT_MS / portTICK_PERIOD_MS);
+    }
+    if (ctrl->result.flag) {
+        ctrl->result.corrupted = ctrl->verify.corrupted;
+        ctrl->has_result = true;
+        if (ctrl->cfg.result_cb) {
+            ctrl->cfg.result_cb(ctrl, &ctrl->result, ctrl->cfg.cb_arg);
+        }
+    }
+    if (ctrl->heap_free && ctrl->heap_low) {
+        printf("heap: %u bytes free before the run, %u at the lowest report (%s)\n", ctrl->heap_free, ctrl->heap_low,
+               iperf_is_single_task(ctrl) ? "single task" : "traffic + report task");
+    }
+
+    ESP_LOGI(TAG, "iperf exit");
+    IPERF_TRACE(IPERF_TRACE_TASK_SLEEP, IPERF_TRACE_TASK_TRAFFIC);
+    ctrl->running = false;
+    vTaskDelete(NULL);
+}
+
+static uint32_t iperf_get_buffer_len(const iperf_ctrl_t *ctrl)
+{
+    if (ctrl->cfg.flag & IPERF_FLAG_FLASH) {
+        return 2 * IPERF_FLASH_CHUNK;
+    } else if (iperf_is_udp_client(ctrl)) {
+        return iperf_addr_is_ipv6(&ctrl->cfg.dip) ? IPERF_UDP_TX_LEN_IPV6 : IPERF_UDP_TX_LEN;
+    } else if (iperf_is_udp_server(ctrl)) {
+        return IPERF_UDP_RX_LEN;
+    } else if (iperf_is_tcp_client(ctrl)) {
+        return IPERF_TCP_TX_LEN;
+    } else {
+        return IPERF_TCP_RX_LEN;
+    }
+    return 0;
+}
+
+static esp_err_t iperf_ctrl_init(iperf_ctrl_t *ctrl, const iperf_cfg_t *cfg, uint32_t buffer_len)
+{
+    iperf_cfg_t run_cfg = *cfg; /* cfg may be ctrl's own */
+
+    memset(ctrl, 0, sizeof(*ctrl));
+    ctrl->cfg = run_cfg;
+    ctrl->finish = false;
+    ctrl->sockfd = -1;
+    ctrl->buffer_len = buffer_len ? buffer_len : iperf_get_buffer_len(ctrl);
+    /* --verify shifts the data by up to 3 bytes to keep it aligned with the stream offset, and fills whole words */
+    ctrl->buffer = (uint8_t *)malloc(ctrl->buffer_len + IPERF_VERIFY_SLACK);
+    if (!ctrl->buffer) {
         ESP_LOGE(TAG, "create buffer: not enough memory");
         return ESP_FAIL;
     }
-    memset(s_iperf_ctrl.buffer, 0, s_iperf_ctrl.buffer_len);
+    memset(ctrl->buffer, 0, ctrl->buffer_len + IPERF_VERIFY_SLACK);
+
+    return ESP_OK;
+}
+
+static esp_err_t iperf_start_traffic(iperf_ctrl_t *ctrl, TaskFunction_t fn, const char *name)
+{
+    BaseType_t ret;
 
-    ret = xTaskCreatePinnedToCore(iperf_task_traffic, IPERF_TRAFFIC_TASK_NAME, IPERF_TRAFFIC_TASK_STACK, NULL, IPERF_TRAFFIC_TASK_PRIORITY, NULL, portNUM_PROCESSORS - 1);
+    ctrl->running = true;
+    ret = xTaskCreatePinnedToCore(fn, name, IPERF_TRAFFIC_TASK_STACK, ctrl, IPERF_TRAFFIC_TASK_PRIORITY, &ctrl->traffic_task, portNUM_PROCESSORS - 1);
     if (ret != pdPASS) {
-        ESP_LOGE(TAG, "create task %s failed", IPERF_TRAFFIC_TASK_NAME);
-        free(s_iperf_ctrl.buffer);
-        s_iperf_ctrl.buffer = NULL;
+        ESP_LOGE(TAG, "create task %s failed", name);
+        ctrl->running = false;
+        free(ctrl->buffer);
+        ctrl->buffer = NULL;
         return ESP_FAIL;
     }
 
     return ESP_OK;
 }
 
-esp_err_t iperf_stop(void)
+static const char *iperf_iram_variant_name(void)
+{
+    switch (IPERF_IRAM_VARIANT) {
+    case 0: return "none";
+    case IPERF_IRAM_SERVERS: return "servers";
+    case IPERF_IRAM_CLIENTS: return "clients";
+    case IPERF_IRAM_SERVERS | IPERF_IRAM_CLIENTS: return "engines";
+    case IPERF_IRAM_SERVERS | IPERF_IRAM_CLIENTS | IPERF_IRAM_REPORT: return "all";
+    default: return "custom";
+    }
+}
+
+/* run one server/client pair over 127.0.0.1 and report what the stack alone can do */
+static void iperf_run_self(iperf_ctrl_t *ctrl, uint32_t proto)
+{
+    iperf_ctrl_t *pair = calloc(2, sizeof(iperf_ctrl_t));
+    iperf_ctrl_t *server = &pair[0];
+    iperf_ctrl_t *client = &pair[1];
+    uint32_t limit_ms = (ctrl->cfg.time + IPERF_SOCKET_RX_TIMEOUT) * 1000;
+    iperf_cfg_t cfg = ctrl->cfg;
+    int64_t start_us;
+    uint32_t elapsed_ms;
+    uint32_t len;
+    uint32_t packets;
+    double cycles;
+#if CONFIG_FREERTOS_USE_TRACE_FACILITY && CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+    iperf_cpu_t cpu = { 0 };
+#endif
+
+    if (!pair) {
+        ESP_LOGE(TAG, "self: not enough memory");
+        return;
+    }
+
+    cfg.flag = (cfg.flag & ~(IPERF_FLAG_CLIENT | IPERF_FLAG_SERVER | IPERF_FLAG_TCP | IPERF_FLAG_UDP | IPERF_FLAG_SELF)) | proto;
+    cfg.result_cb = NULL;
+    /* cfg.sip only tells which family to test, -V gives the IPv6 any address */
+    iperf_addr_from_str(iperf_addr_is_ipv6(&ctrl->cfg.sip) ? "::1" : "127.0.0.1", &cfg.sip);
+    cfg.dip = cfg.sip;
+    cfg.dport = cfg.sport;
+    len = (proto == IPERF_FLAG_TCP) ? IPERF_SELF_TCP_LEN :
+          iperf_addr_is_ipv6(&cfg.dip) ? IPERF_UDP_TX_LEN_IPV6 : IPERF_UDP_TX_LEN;
+
+    printf("\nself: %s over %s loopback\n", (proto == IPERF_FLAG_TCP) ? "tcp" : "udp",
+           iperf_addr_is_ipv6(&cfg.dip) ? "IPv6" : "IPv4");
+
+    cfg.flag |= IPERF_FLAG_SERVER;
+    if (iperf_ctrl_init(server, &cfg, len) != ESP_OK) {
+        goto exit;
+    }
+    cfg.flag = (cfg.flag & ~IPERF_FLAG_SERVER) | IPERF_FLAG_CLIENT;
+    if (iperf_ctrl_init(client, &cfg, len) != ESP_OK) {
+        free(server->buffer);
+        goto exit;
+    }
+    client->no_report = true;
+
+    if (iperf_start_traffic(server, iperf_task_traffic, IPERF_SELF_SERVER_TASK_NAME) != ESP_OK) {
+        free(client->buffer);
+        goto exit;
+    }
+    /* give the server time to bind before the client starts sending */
+    vTaskDelay(100 / portTICK_PERIOD_MS);
+    if (iperf_start_traffic(client, iperf_task_traffic, IPERF_SELF_CLIENT_TASK_NAME) != ESP_OK) {
+        server->finish = true;
+    }
+
+    start_us = esp_timer_get_time();
+#if CONFIG_FREERTOS_USE_TRACE_FACILITY && CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+    cpu.task[0] = server->traffic_task;
+    cpu.task[1] = client->traffic_task;
+    iperf_cpu_sample(&cpu, true);
+#endif
+
+    while (server->running || client->running) {
+        vTaskDelay(IPERF_SELF_SAMPLE_MS / portTICK_PERIOD_MS);
+        elapsed_ms = (esp_timer_get_time() - start_us) / 1000;
+        /* the server's report task ends the run; also give up if nothing ever arrives */
+        if (ctrl->finish || server->finish || elapsed_ms > limit_ms) {
+            server->finish = true;
+            client->finish = true;
+        }
+#if CONFIG_FREERTOS_USE_TRACE_FACILITY && CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+        cpu.task[2] = server->report_task;
+        iperf_cpu_sample(&cpu, false);
+#endif
+    }
+
+    elapsed_ms = (esp_timer_get_time() - start_us) / 1000;
+    printf("self: %s ceiling %.2f Mbits/sec (%u bytes in %u ms)\n", (proto == IPERF_FLAG_TCP) ? "tcp" : "udp",
+           elapsed_ms ? (double)server->total_len * 8 / elapsed_ms / 1e3 : 0.0, server->total_len, elapsed_ms);
+    /* the loopback run keeps the CPU busy, so every cycle of it is spent moving packets: comparing this
+       between builds shows what each IRAM variant buys */
+    packets = server->total_len / len;
+    cycles = (double)elapsed_ms * 1000 * ets_get_cpu_frequency();
+    printf("self: %.0f cpu cycles per %u byte packet (engine code in IRAM: %s)\n", packets ? cycles / packets : 0.0,
+           len, iperf_iram_variant_name());
+#if CONFIG_FREERTOS_USE_TRACE_FACILITY && CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+    printf("self: cpu %s %.1f%%, %s %.1f%%, %s %.1f%%\n",
+           IPERF_SELF_SERVER_TASK_NAME, iperf_cpu_percent(&cpu, 0),
+           IPERF_SELF_CLIENT_TASK_NAME, iperf_cpu_percent(&cpu, 1),
+           IPERF_REPORT_TASK_NAME, iperf_cpu_percent(&cpu, 2));
+    if (packets) {
+        printf("self: cycles per packet %s %.0f, %s %.0f\n",
+               IPERF_SELF_SERVER_TASK_NAME, cycles * iperf_cpu_percent(&cpu, 0) / 100 / packets,
+               IPERF_SELF_CLIENT_TASK_NAME, cycles * iperf_cpu_percent(&cpu, 1) / 100 / packets);
+    }
+#endif
+
+exit:
+    free(pair);
+}
+
+static void iperf_task_self(void *arg)
+{
+    iperf_ctrl_t *ctrl = (iperf_ctrl_t *)arg;
+
+    iperf_run_self(ctrl, IPERF_FLAG_TCP);
+    if (!ctrl->finish && !(ctrl->cfg.flag & IPERF_FLAG_TLS)) {
+        iperf_run_self(ctrl, IPERF_FLAG_UDP);
+    }
+
+    ESP_LOGI(TAG, "iperf self test exit");
+    ctrl->running = false;
+    vTaskDelete(NULL);
+}
+
+/* --pps-sweep: datagram sizes, from the smallest useful (per-datagram cost only) to a full IPv4 MTU */
+static const uint16_t s_iperf_sweep_len[] = { 64, 128, 256, 512, 1024, IPERF_UDP_TX_LEN };
+
+/* send len byte datagrams for ms milliseconds, batch at a time, and return the datagrams sent per second */
+static uint32_t iperf_sweep_point(iperf_ctrl_t *ctrl, iperf_ctrl_t *client, uint32_t len, uint8_t batch, uint32_t ms)
+{
+    iperf_cfg_t cfg = ctrl->cfg;
+    int64_t start_us;
+    uint32_t elapsed_ms;
+
+    cfg.flag &= ~IPERF_FLAG_PPS_SWEEP;
+    cfg.result_cb = NULL;
+    cfg.interval_cb = NULL;
+    cfg.batch = batch;
+    cfg.len_dist = IPERF_LEN_FIXED;
+    cfg.len_min = len;
+    if (iperf_ctrl_init(client, &cfg, 0) != ESP_OK) {
+        return 0;
+    }
+    /* the peer is a plain iperf server: the point is what the sending side can do, timed here */
+    client->no_report = true;
+    if (iperf_start_traffic(client, iperf_task_traffic, IPERF_SWEEP_CLIENT_TASK_NAME) != ESP_OK) {
+        return 0;
+    }
+
+    start_us = esp_timer_get_time();
+    while (client->running && !ctrl->finish && esp_timer_get_time() - start_us < (int64_t)ms * 1000) {
+        vTaskDelay(IPERF_SELF_SAMPLE_MS / portTICK_PERIOD_MS);
+    }
+    client->finish = true;
+    elapsed_ms = (esp_timer_get_time() - start_us) / 1000;
+    while (client->running) {
+        vTaskDelay(IPERF_REPORT_WAIT_MS / portTICK_PERIOD_MS);
+    }
+    return elapsed_ms ? (uint32_t)((uint64_t)client->total_len / len * 1000 / elapsed_ms) : 0;
+}
+
+/* packets per second over the sizes in s_iperf_sweep_len, with one sendto() per datagram and with --batch */
+static void iperf_task_sweep(void *arg)
+{
+    iperf_ctrl_t *ctrl = (iperf_ctrl_t *)arg;
+    iperf_ctrl_t *client = calloc(1, sizeof(iperf_ctrl_t));
+    int points = sizeof(s_iperf_sweep_len) / sizeof(s_iperf_sweep_len[0]);
+    uint8_t batch = (ctrl->cfg.batch > 1) ? ctrl->cfg.batch : IPERF_DEFAULT_SWEEP_BATCH;
+    /* -t is the length of the whole sweep */
+    uint32_t ms = ctrl->cfg.time * 1000 / (2 * points);
+    uint32_t single;
+    uint32_t batched;
+    int i;
+
+    if (!client) {
+        ESP_LOGE(TAG, "sweep: not enough memory");
+        goto exit;
+    }
+    if (ms < IPERF_SELF_SAMPLE_MS) {
+        ms = IPERF_SELF_SAMPLE_MS;
+    }
+
+    printf("\nsweep: udp packets/sec, %u ms per point, batches of %u\n", ms, batch);
+    printf("%8s %12s %12s %8s\n", "bytes", "sendto", "batched", "gain");
+    for (i = 0; i < points && !ctrl->finish; i++) {
+        single = iperf_sweep_point(ctrl, client, s_iperf_sweep_len[i], 1, ms);
+        batched = iperf_sweep_point(ctrl, client, s_iperf_sweep_len[i], batch, ms);
+        printf("%8u %12u %12u %7.0f%%\n", s_iperf_sweep_len[i], single, batched,
+               single ? ((double)batched - single) * 100 / single : 0.0);
+    }
+    free(client);
+
+exit:
+    ESP_LOGI(TAG, "iperf sweep exit");
+    ctrl->running = false;
+    vTaskDelete(NULL);
+}
+
+esp_err_t iperf_create(const iperf_cfg_t *cfg, iperf_handle_t *handle)
+{
+    iperf_ctrl_t *ctrl;
+
+    if (!cfg || !handle) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    ctrl = calloc(1, sizeof(*ctrl));
+    if (!ctrl) {
+        ESP_LOGE(TAG, "create instance: not enough memory");
+        return ESP_ERR_NO_MEM;
+    }
+    ctrl->cfg = *cfg;
+    ctrl->sockfd = -1;
+
+    *handle = ctrl;
+    return ESP_OK;
+}
+
+esp_err_t iperf_handle_start(iperf_handle_t handle)
+{
+    iperf_ctrl_t *ctrl = handle;
+    uint32_t heap_free;
+
+    if (!ctrl) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (ctrl->running) {
+        ESP_LOGW(TAG, "iperf is running");
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    if ((ctrl->cfg.flag & IPERF_FLAG_FLASH) &&
+        (ctrl->cfg.flag & (IPERF_FLAG_UDP | IPERF_FLAG_SELF | IPERF_FLAG_VERIFY | IPERF_FLAG_ISOCHRONOUS))) {
+        ESP_LOGE(TAG, "flash streaming is TCP only, without verify, self or isochronous");
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if ((ctrl->cfg.flag & IPERF_FLAG_TLS) && (ctrl->cfg.flag & (IPERF_FLAG_UDP | IPERF_FLAG_ISOCHRONOUS | IPERF_FLAG_FLASH))) {
+        ESP_LOGE(TAG, "tls is for the plain TCP client and server");
+        return ESP_ERR_INVALID_ARG;
+    }
+#if !CONFIG_IPERF_TLS
+    if (ctrl->cfg.flag & IPERF_FLAG_TLS) {
+        ESP_LOGE(TAG, "tls is not built in, enable CONFIG_IPERF_TLS");
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+#endif
+
+    if ((ctrl->cfg.flag & IPERF_FLAG_ISOCHRONOUS) && (ctrl->cfg.flag & (IPERF_FLAG_VERIFY | IPERF_FLAG_SELF))) {
+        ESP_LOGE(TAG, "isochronous mode can't be combined with verify or self");
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (ctrl->cfg.batch > IPERF_MAX_BATCH) {
+        ESP_LOGE(TAG, "batch is at most %d datagrams", IPERF_MAX_BATCH);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if ((ctrl->cfg.batch > 1 || (ctrl->cfg.flag & IPERF_FLAG_PPS_SWEEP)) &&
+        (!iperf_is_udp_client(ctrl) || iperf_addr_is_ipv6(&ctrl->cfg.dip) || ctrl->cfg.pps ||
+         (ctrl->cfg.flag & (IPERF_FLAG_SELF | IPERF_FLAG_VERIFY | IPERF_FLAG_ISOCHRONOUS)))) {
+        ESP_LOGE(TAG, "batch and pps sweep are for the IPv4 UDP client, without verify, self, isochronous or poisson");
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (ctrl->cfg.flag & (IPERF_FLAG_SELF | IPERF_FLAG_PPS_SWEEP)) {
+        /* the engines use their own buffers, this one only coordinates them */
+        iperf_cfg_t cfg = ctrl->cfg;
+
+        memset(ctrl, 0, sizeof(*ctrl));
+        ctrl->cfg = cfg;
+        ctrl->sockfd = -1;
+        return iperf_start_traffic(ctrl, (ctrl->cfg.flag & IPERF_FLAG_SELF) ? iperf_task_self : iperf_task_sweep,
+                                   IPERF_TRAFFIC_TASK_NAME);
+    }
+
+    heap_free = esp_get_free_heap_size();
+    if (iperf_ctrl_init(ctrl, &ctrl->cfg, 0) != ESP_OK) {
+        return ESP_ERR_NO_MEM;
+    }
+    ctrl->heap_free = heap_free;
+
+    return iperf_start_traffic(ctrl, iperf_task_traffic, IPERF_TRAFFIC_TASK_NAME);
+}
+
+esp_err_t iperf_handle_stop(iperf_handle_t handle)
 {
-    if (s_iperf_is_running) {
-        s_iperf_ctrl.finish = true;
+    iperf_ctrl_t *ctrl = handle;
+
+    if (!ctrl) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (ctrl->running) {
+        ctrl->finish = true;
     }
 
-    while (s_iperf_is_running) {
+    while (ctrl->running) {
         ESP_LOGI(TAG, "wait current iperf to stop ...");
         vTaskDelay(300 / portTICK_PERIOD_MS);
     }
 
     return ESP_OK;
 }
+
+esp_err_t iperf_destroy(iperf_handle_t handle)
+{
+    if (!handle) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    iperf_handle_stop(handle);
+    free(handle);
+    return ESP_OK;
+}
+
+bool iperf_handle_is_running(iperf_handle_t handle)
+{
+    return handle && handle->running;
+}
+
+esp_err_t iperf_handle_get_result(iperf_handle_t handle, iperf_result_t *result)
+{
+    if (!handle || !result) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (handle->running) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (!handle->has_result) {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    *result = handle->result;
+    return ESP_OK;
+}
+
+esp_err_t iperf_start(iperf_cfg_t *cfg)
+{
+    if (!cfg) {
+        return ESP_FAIL;
+    }
+
+    if (iperf_handle_is_running(s_iperf_handle)) {
+        ESP_LOGW(TAG, "iperf is running");
+        return ESP_FAIL;
+    }
+
+    if (!s_iperf_handle && iperf_create(cfg, &s_iperf_handle) != ESP_OK) {
+        return ESP_FAIL;
+    }
+    s_iperf_handle->cfg = *cfg;
+
+    return (iperf_handle_start(s_iperf_handle) == ESP_OK) ? ESP_OK : ESP_FAIL;
+}
+
+esp_err_t iperf_stop(void)
+{
+    return s_iperf_handle ? iperf_handle_stop(s_iperf_handle) : ESP_OK;
+}
+
+bool iperf_is_running(void)
+{
+    return iperf_handle_is_running(s_iperf_handle);
+}
+
+esp_err_t iperf_get_result(iperf_result_t *result)
+{
+    return s_iperf_handle ? iperf_handle_get_result(s_iperf_handle, result) : ESP_ERR_NOT_FOUND;
+}
+
+void iperf_get_totals(iperf_totals_t *totals)
+{
+    vTaskSuspendAll();
+    *totals = s_iperf_totals;
+    xTaskResumeAll();
+}
+
+esp_err_t iperf_run_sync(const iperf_cfg_t *cfg, iperf_result_t *result)
+{
+    iperf_handle_t handle;
+    esp_err_t err;
+
+    if (!cfg || !result || (cfg->flag & (IPERF_FLAG_SELF | IPERF_FLAG_PPS_SWEEP))) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    err = iperf_create(cfg, &handle);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    err = iperf_handle_start(handle);
+    if (err == ESP_OK) {
+        while (handle->running) {
+            vTaskDelay(IPERF_SYNC_POLL_MS / portTICK_PERIOD_MS);
+        }
+        err = iperf_handle_get_result(handle, result);
+    }
+
+    iperf_destroy(handle);
+    return err;
+}
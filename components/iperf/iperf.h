@@ -16,15 +16,31 @@ extern "C" {
 
 #include "esp_types.h"
 #include "esp_err.h"
+#include <sys/socket.h>
 
 #define IPERF_FLAG_CLIENT (1)
 #define IPERF_FLAG_SERVER (1 << 1)
 #define IPERF_FLAG_TCP (1 << 2)
 #define IPERF_FLAG_UDP (1 << 3)
+#define IPERF_FLAG_AUTO (1 << 4)
+#define IPERF_FLAG_ENHANCED (1 << 5)
+#define IPERF_FLAG_SELF (1 << 6)
+#define IPERF_FLAG_VERIFY (1 << 7)
+#define IPERF_FLAG_SINGLE_TASK (1 << 8)
+#define IPERF_FLAG_ISOCHRONOUS (1 << 9)
+#define IPERF_FLAG_FLASH (1 << 10)
+#define IPERF_FLAG_TLS (1 << 11)
+#define IPERF_FLAG_PPS_SWEEP (1 << 12)
 
 #define IPERF_DEFAULT_PORT 5001
 #define IPERF_DEFAULT_INTERVAL 3
+#define IPERF_DEFAULT_MCAST_TTL 1
 #define IPERF_DEFAULT_TIME 12
+#define IPERF_DEFAULT_AUTO_TIME 60
+#define IPERF_DEFAULT_AUTO_TOLERANCE 5
+#define IPERF_DEFAULT_ISOCH_FPS 60
+#define IPERF_DEFAULT_ISOCH_MEAN_BPS (20 * 1000 * 1000)
+#define IPERF_AUTO_MIN_SAMPLES 3
 
 #define IPERF_TRAFFIC_TASK_NAME "iperf_traffic"
 #define IPERF_TRAFFIC_TASK_PRIORITY 10
@@ -32,31 +48,192 @@ extern "C" {
 #define IPERF_REPORT_TASK_NAME "iperf_report"
 #define IPERF_REPORT_TASK_PRIORITY 20
 #define IPERF_REPORT_TASK_STACK 4096
+#define IPERF_SELF_SERVER_TASK_NAME "iperf_self_rx"
+#define IPERF_SELF_CLIENT_TASK_NAME "iperf_self_tx"
+#define IPERF_SELF_SAMPLE_MS 200
+#define IPERF_FLASH_TASK_NAME "iperf_flash"
+#define IPERF_FLASH_TASK_PRIORITY (IPERF_TRAFFIC_TASK_PRIORITY - 1) /* runs while the traffic task waits on the socket */
+#define IPERF_FLASH_TASK_STACK 2048
+#define IPERF_FLASH_POLL_MS 100
+#define IPERF_REPORT_WAIT_MS 10
+#define IPERF_SYNC_POLL_MS 50
+#define IPERF_SINGLE_TASK_POLL_MS 100 /* --single-task: longest a receive may block before reports are checked */
+#define IPERF_SWEEP_CLIENT_TASK_NAME "iperf_sweep_tx"
 
 #define IPERF_UDP_TX_LEN (1472)
+#define IPERF_UDP_TX_LEN_IPV6 (1452) /* the IPv6 header is 20 bytes longer, keep datagrams within a 1500 byte MTU */
 #define IPERF_UDP_RX_LEN (16 << 10)
 #define IPERF_TCP_TX_LEN (16 << 10)
 #define IPERF_TCP_RX_LEN (16 << 10)
+#define IPERF_SELF_TCP_LEN (4 << 10) /* --self runs both ends at once, so use smaller buffers */
+#define IPERF_FLASH_CHUNK (8 << 10)  /* flash modes: two of these alternate between flash and socket, a multiple of the sector */
+#define IPERF_FLASH_SECTOR (4 << 10)
+#define IPERF_PARTITION_LABEL_LEN 17
+
+#define IPERF_VERIFY_SLACK 8      /* extra buffer bytes so --verify can keep payloads word aligned: up to 3 bytes of
+                                     skew, plus rounding the fill up to whole words */
+#define IPERF_VERIFY_ID_SHIFT 9   /* --verify: UDP datagram id n uses pattern words n << 9 onwards (up to 2 KB) */
 
 #define IPERF_MAX_DELAY 64
 
+#define IPERF_MAX_BATCH 32        /* --batch: datagrams per call into the tcpip thread */
+#define IPERF_DEFAULT_SWEEP_BATCH 8 /* --pps-sweep: batch depth compared with plain sendto() when --batch isn't given */
+
+/* client send sizes, iperf_cfg_t.len_dist */
+#define IPERF_LEN_FIXED 0       /* len_min bytes, or the whole buffer if 0 */
+#define IPERF_LEN_UNIFORM 1     /* uniformly distributed in [len_min, len_max] */
+#define IPERF_LEN_EXP 2         /* exponentially distributed with mean len_min */
+
+#define IPERF_ADDR_STR_LEN 46 /* INET6_ADDRSTRLEN */
+
 #define IPERF_SOCKET_RX_TIMEOUT 10
 #define IPERF_SOCKET_ACCEPT_TIMEOUT 5
 
+/* an IPv4 or IPv6 address, as stored in iperf_cfg_t; the port is kept separately (sport/dport).
+   All zeroes is the IPv4 any address. */
+typedef union {
+    struct sockaddr sa;
+    struct sockaddr_in sin;
+#if LWIP_IPV6
+    struct sockaddr_in6 sin6;
+#endif
+} iperf_addr_t;
+
+/* one iperf instance, see iperf_create() */
+typedef struct iperf_ctrl *iperf_handle_t;
+
+/* summary of the last finished run, as printed on its final report line */
+typedef struct {
+    uint32_t flag;          /* cfg.flag of the run */
+    uint32_t duration_ms;   /* measured time, without the omitted warm-up */
+    uint64_t bytes;         /* bytes sent/received in that time */
+    uint32_t bandwidth_kbps;
+    uint32_t packets;       /* UDP server: datagrams received */
+    uint32_t lost;          /* UDP server: datagrams lost */
+    uint32_t reordered;     /* UDP server: datagrams out of order */
+    uint32_t corrupted;     /* --verify server: corrupted bytes */
+    int64_t start_us;       /* esp_timer_get_time() when traffic started: connected, accepted or first datagram */
+} iperf_result_t;
+
+/* bytes moved by every run since boot, across all instances, for monitoring; updated as each run ends */
+typedef struct {
+    uint64_t tcp_tx_bytes;
+    uint64_t tcp_rx_bytes;
+    uint64_t udp_tx_bytes;
+    uint64_t udp_rx_bytes;
+    uint32_t runs;
+} iperf_totals_t;
+
+/* one periodic report, as printed on its interval line */
+typedef struct {
+    uint32_t start_sec;     /* interval start, in seconds since the test started */
+    uint32_t end_sec;
+    uint32_t bytes;         /* bytes sent/received in the interval */
+    uint32_t bandwidth_kbps;
+    uint32_t packets;       /* UDP server: datagrams received in the interval */
+    uint32_t lost;          /* UDP server: datagrams lost in the interval */
+    uint32_t frames;        /* --isochronous server: frames completed in the interval */
+    uint32_t frames_lost;   /* --isochronous server: frames that never completed */
+    uint32_t frames_late;   /* --isochronous server: frames completed more than a frame period late */
+    uint32_t frame_delay_avg_us; /* --isochronous server: frame completion delay, relative to the fastest frame */
+    uint32_t frame_delay_max_us;
+    bool omitted;           /* still in the -O warm-up, not part of the result */
+} iperf_interval_t;
+
+/* called from the instance's traffic task once a run has finished and its result is available;
+   it must not stop or destroy the instance */
+typedef void (*iperf_result_cb_t)(iperf_handle_t handle, const iperf_result_t *result, void *arg);
+
+/* called from the instance's report task after every interval; keep it short, the next interval
+   is already being measured */
+typedef void (*iperf_interval_cb_t)(iperf_handle_t handle, const iperf_interval_t *interval, void *arg);
+
 typedef struct {
     uint32_t flag;
-    uint32_t dip;
-    uint32_t sip;
+    iperf_addr_t dip;
+    iperf_addr_t sip;
+    iperf_addr_t group; /* UDP server: multicast group to join, or broadcast address to receive on */
+    uint8_t ttl;        /* UDP client: multicast TTL, 0 for the default */
     uint16_t dport;
     uint16_t sport;
     uint32_t interval;
     uint32_t time;
+    uint32_t omit;      /* seconds of warm-up excluded from the results */
+    uint32_t tolerance; /* --auto: stop once the 95% CI half-width is within this many percent of the mean */
+    uint32_t isoch_fps;        /* --isochronous client: frames per second */
+    uint32_t isoch_mean_bps;   /* --isochronous client: mean offered load, in bits/s */
+    uint32_t isoch_stddev_bps; /* --isochronous client: standard deviation of the load */
+    uint32_t burst_on_ms;   /* client: send for this long, then pause for burst_off_ms; 0 for a steady stream */
+    uint32_t burst_off_ms;
+    uint32_t pps;           /* client: Poisson arrivals, this many sends a second on average; 0 to send back to back */
+    uint8_t len_dist;       /* client: IPERF_LEN_*, size of each send (clamped to the buffer) */
+    uint32_t len_min;
+    uint32_t len_max;
+    uint32_t seed;          /* client: seed of the shaping/size generator; 0 picks one, which is printed for reruns */
+    char partition[IPERF_PARTITION_LABEL_LEN]; /* IPERF_FLAG_FLASH, TCP: client sends this partition's contents,
+                                                  server writes what it receives to it (both wrap around at its end) */
+    int tls_ciphersuite;    /* IPERF_FLAG_TLS: mbedTLS ciphersuite id to offer/accept, 0 for the library's list */
+    uint32_t tls_record;    /* IPERF_FLAG_TLS client: plaintext bytes per record, 0 for the largest the build allows */
+    uint8_t batch;          /* UDP client: datagrams handed to lwIP per call into its thread (raw API, IPv4 only);
+                               0 or 1 for one sendto() per datagram */
+    iperf_result_cb_t result_cb;     /* optional */
+    iperf_interval_cb_t interval_cb; /* optional */
+    void *cb_arg;                    /* passed to both callbacks */
 } iperf_cfg_t;
 
+/* Instances are independent: each has its own tasks, buffers and statistics, so eg a server and a client
+   can run side by side (on different ports). An instance runs one test at a time, and can be started
+   again once it has finished. */
+
+/* create an instance for cfg, without starting it */
+esp_err_t iperf_create(const iperf_cfg_t *cfg, iperf_handle_t *handle);
+
+/* start a run; ESP_ERR_INVALID_STATE if the instance is still running */
+esp_err_t iperf_handle_start(iperf_handle_t handle);
+
+/* stop the run, if any, and wait for it to finish */
+esp_err_t iperf_handle_stop(iperf_handle_t handle);
+
+/* stop the instance and free it */
+esp_err_t iperf_destroy(iperf_handle_t handle);
+
+bool iperf_handle_is_running(iperf_handle_t handle);
+
+/* copy out the summary of the instance's last run; ESP_ERR_INVALID_STATE while one is running,
+   ESP_ERR_NOT_FOUND if there is none (nothing run yet, or a --self test) */
+esp_err_t iperf_handle_get_result(iperf_handle_t handle, iperf_result_t *result);
+
+/* The functions below drive a single default instance, as the console does. */
+
 esp_err_t iperf_start(iperf_cfg_t *cfg);
 
 esp_err_t iperf_stop(void);
 
+/* whether a run is in progress */
+bool iperf_is_running(void);
+
+/* same as iperf_handle_get_result() */
+esp_err_t iperf_get_result(iperf_result_t *result);
+
+/* copy out the totals since boot */
+void iperf_get_totals(iperf_totals_t *totals);
+
+/* run a test on a new instance and block until it finishes, eg for a link check at boot; result gets
+   its summary. Callbacks in cfg are still called. Not for --self or --pps-sweep, which have no single result. */
+esp_err_t iperf_run_sync(const iperf_cfg_t *cfg, iperf_result_t *result);
+
+/* parse an IPv4 or IPv6 literal into addr */
+esp_err_t iperf_addr_from_str(const char *str, iperf_addr_t *addr);
+
+/* format addr for printing, returns buf */
+const char *iperf_addr_to_str(const iperf_addr_t *addr, char *buf, size_t len);
+
+/* whether addr has been set */
+bool iperf_addr_is_set(const iperf_addr_t *addr);
+
+/* addr with port, ready for bind/connect/sendto; returns its length */
+socklen_t iperf_sockaddr(iperf_addr_t *out, const iperf_addr_t *addr, uint16_t port);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,141 @@
+/* Iperf Example - packet capture
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <string.h>
+#include <sys/socket.h>
+#include "iperf_capture.h"
+
+#if CONFIG_IPERF_CAPTURE
+
+#define PCAP_MAGIC 0xa1b2c3d4
+#define PCAP_VERSION_MAJOR 2
+#define PCAP_VERSION_MINOR 4
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version_major;
+    uint16_t version_minor;
+    int32_t thiszone;
+    uint32_t sigfigs;
+    uint32_t snaplen;
+    uint32_t linktype;
+} pcap_file_hdr_t;
+
+typedef struct {
+    uint32_t ts_sec;
+    uint32_t ts_usec;
+    uint32_t incl_len;
+    uint32_t orig_len;
+} pcap_rec_hdr_t;
+
+typedef struct {
+    int64_t ts_us;
+    uint32_t len;           /* bytes received */
+    uint16_t caplen;        /* of them in data */
+    iperf_capture_pseudo_t pseudo;
+    uint8_t data[CONFIG_IPERF_CAPTURE_SNAPLEN];
+} iperf_capture_rec_t;
+
+bool g_iperf_capture_on;
+
+static iperf_capture_rec_t s_capture_ring[CONFIG_IPERF_CAPTURE_PACKETS];
+static uint32_t s_capture_head;
+static uint32_t s_capture_tail;    /* head at the last clear */
+
+/* Servers of different instances may both record: each takes its own slot first, so they only collide
+   if the whole ring is refilled while one of them is copying. */
+void iperf_capture_add(uint8_t proto, const iperf_addr_t *peer, const void *buf, uint32_t len, int64_t ts_us)
+{
+    iperf_capture_rec_t *rec = &s_capture_ring[s_capture_head++ % CONFIG_IPERF_CAPTURE_PACKETS];
+
+    rec->ts_us = ts_us;
+    rec->len = len;
+    rec->caplen = (len < CONFIG_IPERF_CAPTURE_SNAPLEN) ? len : CONFIG_IPERF_CAPTURE_SNAPLEN;
+    rec->pseudo.proto = proto;
+    rec->pseudo.reserved = 0;
+    rec->pseudo.peer_port = peer->sin.sin_port;
+    rec->pseudo.peer_ip4 = (peer->sa.sa_family == AF_INET) ? peer->sin.sin_addr.s_addr : 0;
+    memcpy(rec->data, buf, rec->caplen);
+}
+
+void iperf_capture_start(void)
+{
+    g_iperf_capture_on = true;
+}
+
+void iperf_capture_stop(void)
+{
+    g_iperf_capture_on = false;
+}
+
+bool iperf_capture_is_running(void)
+{
+    return g_iperf_capture_on;
+}
+
+void iperf_capture_clear(void)
+{
+    s_capture_tail = s_capture_head;
+}
+
+void iperf_capture_get_count(uint32_t *count, uint32_t *dropped)
+{
+    uint32_t n = s_capture_head - s_capture_tail;
+
+    *count = (n > CONFIG_IPERF_CAPTURE_PACKETS) ? CONFIG_IPERF_CAPTURE_PACKETS : n;
+    *dropped = n - *count;
+}
+
+size_t iperf_capture_dump_size(void)
+{
+    uint32_t count;
+    uint32_t dropped;
+    uint32_t i;
+    size_t size = sizeof(pcap_file_hdr_t);
+
+    iperf_capture_get_count(&count, &dropped);
+    for (i = s_capture_head - count; i != s_capture_head; i++) {
+        size += sizeof(pcap_rec_hdr_t) + sizeof(iperf_capture_pseudo_t) + s_capture_ring[i % CONFIG_IPERF_CAPTURE_PACKETS].caplen;
+    }
+    return size;
+}
+
+void iperf_capture_dump(iperf_capture_write_t write, void *arg)
+{
+    bool was_on = g_iperf_capture_on;
+    pcap_file_hdr_t file = {
+        .magic = PCAP_MAGIC,
+        .version_major = PCAP_VERSION_MAJOR,
+        .version_minor = PCAP_VERSION_MINOR,
+        .snaplen = sizeof(iperf_capture_pseudo_t) + CONFIG_IPERF_CAPTURE_SNAPLEN,
+        .linktype = IPERF_CAPTURE_LINKTYPE,
+    };
+    pcap_rec_hdr_t hdr;
+    const iperf_capture_rec_t *rec;
+    uint32_t count;
+    uint32_t dropped;
+    uint32_t i;
+
+    g_iperf_capture_on = false;
+    iperf_capture_get_count(&count, &dropped);
+    write(&file, sizeof(file), arg);
+    for (i = s_capture_head - count; i != s_capture_head; i++) {
+        rec = &s_capture_ring[i % CONFIG_IPERF_CAPTURE_PACKETS];
+        hdr.ts_sec = (uint32_t)(rec->ts_us / 1000000);
+        hdr.ts_usec = (uint32_t)(rec->ts_us % 1000000);
+        hdr.incl_len = sizeof(rec->pseudo) + rec->caplen;
+        hdr.orig_len = sizeof(rec->pseudo) + rec->len;
+        write(&hdr, sizeof(hdr), arg);
+        write(&rec->pseudo, sizeof(rec->pseudo), arg);
+        write(rec->data, rec->caplen, arg);
+    }
+    g_iperf_capture_on = was_on;
+}
+
+#endif
@@ -0,0 +1,76 @@
+/* Iperf Example - packet capture declaration
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#ifndef __IPERF_CAPTURE_H_
+#define __IPERF_CAPTURE_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "esp_types.h"
+#include "esp_err.h"
+#include "sdkconfig.h"
+#include "iperf.h"
+
+/* The dump is a pcap stream (microsecond timestamps since boot) with link type LINKTYPE_USER0; each
+   packet starts with an iperf_capture_pseudo_t, followed by the first bytes of the payload as received.
+   iperf_pcap.py rewrites the pseudo header into IPv4 and UDP/TCP headers. */
+#define IPERF_CAPTURE_LINKTYPE 147
+
+typedef struct {
+    uint8_t proto;          /* IPPROTO_UDP or IPPROTO_TCP */
+    uint8_t reserved;
+    uint16_t peer_port;     /* network byte order */
+    uint32_t peer_ip4;      /* network byte order, 0 for an IPv6 peer */
+} iperf_capture_pseudo_t;
+
+/* writes len bytes of the dump somewhere */
+typedef void (*iperf_capture_write_t)(const void *data, size_t len, void *arg);
+
+#if CONFIG_IPERF_CAPTURE
+extern bool g_iperf_capture_on;
+
+void iperf_capture_add(uint8_t proto, const iperf_addr_t *peer, const void *buf, uint32_t len, int64_t ts_us);
+
+/* the servers call this for every packet received; a load and a branch while not capturing */
+#define IPERF_CAPTURE(proto, peer, buf, len, ts_us) \
+    do { \
+        if (g_iperf_capture_on) { \
+            iperf_capture_add((proto), (peer), (buf), (len), (ts_us)); \
+        } \
+    } while (0)
+
+void iperf_capture_start(void);
+
+void iperf_capture_stop(void);
+
+bool iperf_capture_is_running(void);
+
+/* forget the packets held */
+void iperf_capture_clear(void);
+
+/* packets held, and how many older ones were overwritten since the last clear */
+void iperf_capture_get_count(uint32_t *count, uint32_t *dropped);
+
+/* size of the pcap stream iperf_capture_dump() writes for the packets held now; stop capturing first
+   for the two to agree */
+size_t iperf_capture_dump_size(void);
+
+/* write the packets held as a pcap stream, oldest first; capturing pauses meanwhile */
+void iperf_capture_dump(iperf_capture_write_t write, void *arg);
+#else
+#define IPERF_CAPTURE(proto, peer, buf, len, ts_us)
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,288 @@
+/* Iperf Example - link monitor
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+/* Sends a small timestamped UDP probe to a collector a few times a second; the collector echoes it, and
+   the round trip goes into per-10-second buckets. Windows are sums over the latest buckets, so the state
+   is a fixed array and nothing is allocated once the monitor runs. */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "iperf_linkmon.h"
+
+#define LINKMON_MAGIC 0x4c4d4f4e /* "LMON" */
+#define LINKMON_PENDING 64       /* probes in flight; older ones are given up on */
+
+typedef struct {
+    uint32_t magic;
+    uint32_t seq;
+    uint32_t tx_hi;          /* esp_timer_get_time() when sent */
+    uint32_t tx_lo;
+} linkmon_probe_t;
+
+typedef struct {
+    uint32_t epoch;          /* which IPERF_LINKMON_BUCKET_SEC slot since start this holds */
+    uint16_t received;
+    uint16_t lost;
+    uint16_t jitter_n;
+    uint32_t rtt_sum_us;
+    uint32_t rtt_max_us;
+    uint32_t jitter_sum_us;
+} linkmon_bucket_t;
+
+typedef struct {
+    uint32_t seq;            /* 0 for a free slot */
+    int64_t tx_us;
+} linkmon_pending_t;
+
+typedef struct {
+    iperf_linkmon_cfg_t cfg;
+    bool running;
+    bool finish;
+    int sockfd;
+    int64_t start_us;
+    uint32_t last_rtt_us;    /* for the jitter, 0 before the first echo */
+    linkmon_bucket_t bucket[IPERF_LINKMON_BUCKETS];
+    linkmon_pending_t pending[LINKMON_PENDING];
+} linkmon_t;
+
+static const char *TAG = "linkmon";
+static linkmon_t s_linkmon;
+
+/* the bucket for time t, recycled if it still holds an older slot */
+static linkmon_bucket_t *linkmon_bucket(linkmon_t *mon, int64_t t_us)
+{
+    uint32_t epoch = (uint32_t)((t_us - mon->start_us) / (IPERF_LINKMON_BUCKET_SEC * 1000000LL));
+    linkmon_bucket_t *b = &mon->bucket[epoch % IPERF_LINKMON_BUCKETS];
+
+    if (b->epoch != epoch) {
+        memset(b, 0, sizeof(*b));
+        b->epoch = epoch;
+    }
+    return b;
+}
+
+static void linkmon_sent(linkmon_t *mon, uint32_t seq, int64_t tx_us, bool sent)
+{
+    linkmon_pending_t *p = &mon->pending[seq % LINKMON_PENDING];
+
+    if (p->seq) {
+        /* still unanswered after LINKMON_PENDING more probes, certainly lost */
+        linkmon_bucket(mon, p->tx_us)->lost++;
+    }
+    if (sent) {
+        p->seq = seq;
+        p->tx_us = tx_us;
+    } else {
+        /* a probe that never left (eg no buffers while a test runs) is lost all the same */
+        p->seq = 0;
+        linkmon_bucket(mon, tx_us)->lost++;
+    }
+}
+
+static void linkmon_echo(linkmon_t *mon, const linkmon_probe_t *probe, int64_t now_us)
+{
+    uint32_t seq = ntohl(probe->seq);
+    linkmon_pending_t *p = &mon->pending[seq % LINKMON_PENDING];
+    linkmon_bucket_t *b;
+    uint32_t rtt_us;
+
+    if (ntohl(probe->magic) != LINKMON_MAGIC || p->seq != seq || seq == 0) {
+        /* not ours, a duplicate, or already counted as lost */
+        return;
+    }
+    p->seq = 0;
+    rtt_us = (uint32_t)(now_us - p->tx_us);
+
+    /* accounted to the bucket it was sent in, like the losses */
+    b = linkmon_bucket(mon, p->tx_us);
+    b->received++;
+    b->rtt_sum_us += rtt_us;
+    if (rtt_us > b->rtt_max_us) {
+        b->rtt_max_us = rtt_us;
+    }
+    if (mon->last_rtt_us) {
+        b->jitter_sum_us += (rtt_us > mon->last_rtt_us) ? rtt_us - mon->last_rtt_us : mon->last_rtt_us - rtt_us;
+        b->jitter_n++;
+    }
+    mon->last_rtt_us = rtt_us;
+}
+
+static void linkmon_expire(linkmon_t *mon, int64_t now_us)
+{
+    int i;
+
+    for (i = 0; i < LINKMON_PENDING; i++) {
+        if (mon->pending[i].seq && now_us - mon->pending[i].tx_us > IPERF_LINKMON_TIMEOUT_MS * 1000) {
+            linkmon_bucket(mon, mon->pending[i].tx_us)->lost++;
+            mon->pending[i].seq = 0;
+        }
+    }
+}
+
+static void linkmon_task(void *arg)
+{
+    linkmon_t *mon = (linkmon_t *)arg;
+    int64_t period_us = 1000000 / mon->cfg.pps;
+    int64_t next_us = esp_timer_get_time();
+    linkmon_probe_t probe;
+    iperf_addr_t addr;
+    socklen_t addr_len;
+    struct timeval t;
+    uint32_t seq = 0;
+    int64_t now_us;
+    int64_t wait_us;
+    bool sent;
+    int len;
+
+    addr_len = iperf_sockaddr(&addr, &mon->cfg.dip, mon->cfg.dport);
+    while (!mon->finish) {
+        now_us = esp_timer_get_time();
+        if (now_us >= next_us) {
+            probe.magic = htonl(LINKMON_MAGIC);
+            probe.seq = htonl(++seq);
+            probe.tx_hi = htonl((uint32_t)(now_us >> 32));
+            probe.tx_lo = htonl((uint32_t)now_us);
+            sent = sendto(mon->sockfd, &probe, sizeof(probe), 0, &addr.sa, addr_len) == sizeof(probe);
+            /* the buckets are read by iperf_linkmon_get(); sockets can't be used with the scheduler suspended */
+            vTaskSuspendAll();
+            linkmon_expire(mon, now_us);
+            linkmon_sent(mon, seq, now_us, sent);
+            xTaskResumeAll();
+            next_us += period_us;
+            if (next_us < now_us) {
+                next_us = now_us + period_us;
+            }
+        }
+
+        /* wait for echoes until the next probe is due */
+        wait_us = next_us - esp_timer_get_time();
+        if (wait_us <= 0) {
+            continue;
+        }
+        /* lwIP takes whole ms, and 0 would block for good */
+        wait_us = (wait_us < 1000) ? 1000 : wait_us;
+        t.tv_sec = wait_us / 1000000;
+        t.tv_usec = wait_us % 1000000;
+        setsockopt(mon->sockfd, SOL_SOCKET, SO_RCVTIMEO, &t, sizeof(t));
+        len = recv(mon->sockfd, &probe, sizeof(probe), 0);
+        if (len == sizeof(probe)) {
+            now_us = esp_timer_get_time();
+            vTaskSuspendAll();
+            linkmon_echo(mon, &probe, now_us);
+            xTaskResumeAll();
+        }
+    }
+
+    close(mon->sockfd);
+    mon->sockfd = -1;
+    mon->running = false;
+    vTaskDelete(NULL);
+}
+
+esp_err_t iperf_linkmon_start(const iperf_linkmon_cfg_t *cfg)
+{
+    linkmon_t *mon = &s_linkmon;
+
+    if (mon->running) {
+        ESP_LOGW(TAG, "already running");
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (!cfg || !iperf_addr_is_set(&cfg->dip) || cfg->pps == 0 || cfg->pps > IPERF_LINKMON_MAX_PPS) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    memset(mon, 0, sizeof(*mon));
+    mon->cfg = *cfg;
+    mon->cfg.dport = cfg->dport ? cfg->dport : IPERF_LINKMON_DEFAULT_PORT;
+    mon->start_us = esp_timer_get_time();
+    mon->sockfd = socket(mon->cfg.dip.sa.sa_family, SOCK_DGRAM, IPPROTO_UDP);
+    if (mon->sockfd < 0) {
+        ESP_LOGE(TAG, "socket create failed: errno=%d", errno);
+        return ESP_FAIL;
+    }
+
+    mon->running = true;
+    if (xTaskCreate(linkmon_task, IPERF_LINKMON_TASK_NAME, IPERF_LINKMON_TASK_STACK, mon,
+                    IPERF_LINKMON_TASK_PRIORITY, NULL) != pdPASS) {
+        ESP_LOGE(TAG, "create task %s failed", IPERF_LINKMON_TASK_NAME);
+        close(mon->sockfd);
+        mon->running = false;
+        return ESP_ERR_NO_MEM;
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t iperf_linkmon_stop(void)
+{
+    if (!s_linkmon.running) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    s_linkmon.finish = true;
+    while (s_linkmon.running) {
+        vTaskDelay(IPERF_REPORT_WAIT_MS / portTICK_PERIOD_MS);
+    }
+    return ESP_OK;
+}
+
+bool iperf_linkmon_is_running(void)
+{
+    return s_linkmon.running;
+}
+
+esp_err_t iperf_linkmon_get(uint32_t seconds, iperf_linkmon_window_t *window)
+{
+    linkmon_t *mon = &s_linkmon;
+    uint32_t n = (seconds + IPERF_LINKMON_BUCKET_SEC - 1) / IPERF_LINKMON_BUCKET_SEC;
+    uint32_t jitter_n = 0;
+    uint64_t jitter_sum = 0;
+    uint64_t rtt_sum = 0;
+    uint32_t now;
+    uint32_t i;
+    const linkmon_bucket_t *b;
+
+    if (!window) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (!mon->start_us) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    n = (n == 0) ? 1 : (n > IPERF_LINKMON_BUCKETS) ? IPERF_LINKMON_BUCKETS : n;
+    memset(window, 0, sizeof(*window));
+    vTaskSuspendAll();
+    now = (uint32_t)((esp_timer_get_time() - mon->start_us) / (IPERF_LINKMON_BUCKET_SEC * 1000000LL));
+    for (i = 0; i < n && i <= now; i++) {
+        b = &mon->bucket[(now - i) % IPERF_LINKMON_BUCKETS];
+        if (b->epoch != now - i) {
+            continue;
+        }
+        window->received += b->received;
+        window->lost += b->lost;
+        rtt_sum += b->rtt_sum_us;
+        if (b->rtt_max_us > window->rtt_max_us) {
+            window->rtt_max_us = b->rtt_max_us;
+        }
+        jitter_sum += b->jitter_sum_us;
+        jitter_n += b->jitter_n;
+    }
+    xTaskResumeAll();
+
+    window->seconds = ((now + 1 < n) ? now + 1 : n) * IPERF_LINKMON_BUCKET_SEC;
+    window->sent = window->received + window->lost;
+    window->rtt_avg_us = window->received ? (uint32_t)(rtt_sum / window->received) : 0;
+    window->jitter_us = jitter_n ? (uint32_t)(jitter_sum / jitter_n) : 0;
+    return ESP_OK;
+}
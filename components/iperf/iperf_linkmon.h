@@ -0,0 +1,63 @@
+/* Iperf Example - link monitor declaration
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#ifndef __IPERF_LINKMON_H_
+#define __IPERF_LINKMON_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "esp_types.h"
+#include "esp_err.h"
+#include "iperf.h"
+
+#define IPERF_LINKMON_DEFAULT_PORT 5004
+#define IPERF_LINKMON_DEFAULT_PPS 5
+#define IPERF_LINKMON_MAX_PPS 50
+#define IPERF_LINKMON_TIMEOUT_MS 2000    /* a probe not echoed within this is counted as lost */
+#define IPERF_LINKMON_BUCKET_SEC 10      /* granularity of the rolling windows */
+#define IPERF_LINKMON_BUCKETS 30         /* so the longest window is 5 minutes */
+
+#define IPERF_LINKMON_TASK_NAME "iperf_linkmon"
+#define IPERF_LINKMON_TASK_PRIORITY 3    /* below the iperf tasks, it must not disturb a test */
+#define IPERF_LINKMON_TASK_STACK 2048
+
+typedef struct {
+    iperf_addr_t dip;       /* collector, which echoes every probe back unchanged */
+    uint16_t dport;
+    uint32_t pps;           /* probes a second */
+} iperf_linkmon_cfg_t;
+
+/* loss, RTT and jitter over the last `seconds` */
+typedef struct {
+    uint32_t seconds;       /* span actually covered, less than asked for until the monitor has run that long */
+    uint32_t sent;          /* probes whose fate is known: echoed, or timed out */
+    uint32_t received;
+    uint32_t lost;
+    uint32_t rtt_avg_us;
+    uint32_t rtt_max_us;
+    uint32_t jitter_us;     /* mean difference between consecutive RTTs */
+} iperf_linkmon_window_t;
+
+/* start probing; everything is allocated here (socket, task), nothing while running */
+esp_err_t iperf_linkmon_start(const iperf_linkmon_cfg_t *cfg);
+
+esp_err_t iperf_linkmon_stop(void);
+
+bool iperf_linkmon_is_running(void);
+
+/* the rolling window over the last `seconds` (rounded to whole buckets, at most 5 minutes) */
+esp_err_t iperf_linkmon_get(uint32_t seconds, iperf_linkmon_window_t *window);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
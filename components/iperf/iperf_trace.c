@@ -0,0 +1,51 @@
+/* Iperf Example - event tracer
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <string.h>
+#include "rom/ets_sys.h"
+#include "iperf_trace.h"
+
+#if CONFIG_IPERF_TRACE
+
+_Static_assert((CONFIG_IPERF_TRACE_EVENTS & (CONFIG_IPERF_TRACE_EVENTS - 1)) == 0,
+               "CONFIG_IPERF_TRACE_EVENTS must be a power of 2");
+
+iperf_trace_event_t g_iperf_trace_ring[CONFIG_IPERF_TRACE_EVENTS];
+uint32_t g_iperf_trace_head;
+
+static uint32_t s_iperf_trace_tail; /* head at the last clear */
+
+void iperf_trace_get_header(iperf_trace_header_t *hdr)
+{
+    uint32_t head = g_iperf_trace_head;
+    uint32_t n = head - s_iperf_trace_tail;
+
+    hdr->magic = IPERF_TRACE_MAGIC;
+    hdr->version = IPERF_TRACE_VERSION;
+    hdr->cpu_mhz = ets_get_cpu_frequency();
+    hdr->count = (n > CONFIG_IPERF_TRACE_EVENTS) ? CONFIG_IPERF_TRACE_EVENTS : n;
+    hdr->dropped = n - hdr->count;
+    hdr->first = head - hdr->count;
+}
+
+void iperf_trace_read(uint32_t seq, iperf_trace_event_t *events, uint32_t n)
+{
+    uint32_t i;
+
+    for (i = 0; i < n; i++) {
+        events[i] = g_iperf_trace_ring[(seq + i) & (CONFIG_IPERF_TRACE_EVENTS - 1)];
+    }
+}
+
+void iperf_trace_clear(void)
+{
+    s_iperf_trace_tail = g_iperf_trace_head;
+}
+
+#endif
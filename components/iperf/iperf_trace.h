@@ -0,0 +1,90 @@
+/* Iperf Example - event tracer declaration
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#ifndef __IPERF_TRACE_H_
+#define __IPERF_TRACE_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "esp_types.h"
+#include "sdkconfig.h"
+
+/* event ids; the _BEGIN/_END pairs become spans in the Chrome trace, see iperf_trace.py */
+#define IPERF_TRACE_SEND_BEGIN 1    /* arg: bytes asked for */
+#define IPERF_TRACE_SEND_END 2      /* arg: send()/sendto() result */
+#define IPERF_TRACE_RECV_BEGIN 3    /* arg: bytes asked for */
+#define IPERF_TRACE_RECV_END 4      /* arg: recv()/recvfrom() result */
+#define IPERF_TRACE_ENOMEM 5        /* arg: ms the traffic task backs off for */
+#define IPERF_TRACE_REPORT 6        /* arg: interval end, in seconds */
+#define IPERF_TRACE_CONNECT_BEGIN 7
+#define IPERF_TRACE_CONNECT_END 8   /* arg: connect() result */
+#define IPERF_TRACE_ACCEPT 9        /* arg: accepted socket */
+#define IPERF_TRACE_TASK_WAKE 10    /* arg: IPERF_TRACE_TASK_* */
+#define IPERF_TRACE_TASK_SLEEP 11   /* arg: IPERF_TRACE_TASK_* */
+
+#define IPERF_TRACE_TASK_TRAFFIC 0
+#define IPERF_TRACE_TASK_REPORT 1
+
+#define IPERF_TRACE_MAGIC 0x52545049 /* "IPTR" */
+#define IPERF_TRACE_VERSION 1
+
+typedef struct {
+    uint32_t ccount;        /* CPU cycle count, wraps every 2^32 cycles */
+    uint16_t id;
+    int16_t arg;            /* clipped to 16 bits */
+} iperf_trace_event_t;
+
+/* what `trace dump` sends first, followed by `count` events, oldest first; all little endian */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t cpu_mhz;       /* to turn cycles into time */
+    uint32_t count;
+    uint32_t dropped;       /* older events overwritten since the last clear */
+    uint32_t first;         /* sequence number of the oldest event */
+} iperf_trace_header_t;
+
+#if CONFIG_IPERF_TRACE
+extern iperf_trace_event_t g_iperf_trace_ring[CONFIG_IPERF_TRACE_EVENTS];
+extern uint32_t g_iperf_trace_head;
+
+/* No locking: the traffic and report tasks both record, and if one preempts the other between taking a
+   slot and filling it, an event can be lost. That's the price of keeping this to a few instructions. */
+static inline void iperf_trace(uint16_t id, int16_t arg)
+{
+    iperf_trace_event_t *ev = &g_iperf_trace_ring[g_iperf_trace_head++ & (CONFIG_IPERF_TRACE_EVENTS - 1)];
+    uint32_t ccount;
+
+    __asm__ __volatile__("rsr %0, ccount" : "=a"(ccount));
+    ev->ccount = ccount;
+    ev->id = id;
+    ev->arg = arg;
+}
+
+#define IPERF_TRACE(id, arg) iperf_trace((id), (int16_t)(arg))
+
+/* header for the current contents, then copy them out with iperf_trace_read(hdr->first + i, ...);
+   events recorded meanwhile overwrite the oldest ones, so dump after the test */
+void iperf_trace_get_header(iperf_trace_header_t *hdr);
+
+/* copy the n events from sequence number seq on */
+void iperf_trace_read(uint32_t seq, iperf_trace_event_t *events, uint32_t n);
+
+void iperf_trace_clear(void);
+#else
+#define IPERF_TRACE(id, arg)
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,424 @@
+"""
+Fleet simulator: N emulated devices on this host, all sending to one iperf server, to load-test the server and the
+test harness without hardware.
+
+Each emulated device is a thread with its own loopback address (127.0.1.1, 127.0.1.2, ...; Linux routes all of 127/8
+to the loopback interface) that plays the same kind of autorun command-list as a real one (see `autorun_set`)::
+
+    python iperf_fleet.py -n 24 --sink --script "iperf -c 127.0.0.1 -t 10; autorun_wait iperf_traffic"
+    python iperf_fleet.py -n 8 --script "iperf -c 192.168.1.10 -u -l 512 -t 5; autorun_wait iperf_traffic; \\
+        autorun_delay 1000; iperf -c 192.168.1.10 -t 5; autorun_wait iperf_traffic"
+
+As on the device, `iperf` only starts a run and `autorun_wait iperf_traffic` waits for it to finish; `autorun_delay`
+takes milliseconds. The client options are the device's own: -c, -u, -p, -t, -l <bytes>, --poisson <pps> and -a (-i
+is accepted, but there are no interval reports). UDP datagrams carry iperf2's id/timestamp header, so a PC `iperf -s -u` counts their loss as it would a device's.
+Other commands (sta, restart, ...) are skipped, there is no radio here.
+
+`--sink` runs the shared server in-process instead (TCP and UDP on -p), counting what arrives from each device. With
+`--remote-base-port` every device also answers the network control channel (iperf_remote.py) on its own port, running
+real traffic for each START, so a harness can drive the whole fleet. The summary lists each device's throughput, the
+aggregate and Jain's fairness index, (sum x)^2 / (n * sum x^2): 1 when every device got the same, 1/n when one got it
+all.
+"""
+from __future__ import division
+from __future__ import print_function
+import argparse
+import random
+import shlex
+import socket
+import struct
+import threading
+import time
+
+from iperf_remote import (IperfRemote, StandIn, IperfResult, RESULT, FLAG_CLIENT, FLAG_UDP, STATUS_INVALID, CFG)
+
+IPERF_DEFAULT_PORT = 5001
+DEFAULT_TIME = 12
+DEFAULT_INTERVAL = 3
+UDP_TX_LEN = 1472
+TCP_TX_LEN = 16 << 10
+UDP_HDR = struct.Struct(">iII")     # iperf2's id, sec, usec
+FLEET_NET = "127.0.1."
+
+
+def jain_index(values):
+    """ Jain's fairness index of the throughputs in values """
+    values = list(values)
+    square_sum = sum(v * v for v in values)
+    if not values or not square_sum:
+        return 0.0
+    return sum(values) ** 2 / (len(values) * square_sum)
+
+
+class RunConfig(object):
+    """ the device's iperf client options, as far as an emulated device honours them """
+
+    def __init__(self, host, udp=False, port=IPERF_DEFAULT_PORT, time_=DEFAULT_TIME, interval=DEFAULT_INTERVAL,
+                 length=0, pps=0):
+        self.host = host
+        self.udp = udp
+        self.port = port
+        self.time = time_
+        self.interval = interval
+        self.length = length or (UDP_TX_LEN if udp else TCP_TX_LEN)
+        self.pps = pps
+
+
+class EmulatedDevice(object):
+    """ one device: plays its script, keeps its totals """
+
+    def __init__(self, index, address, script, verbose=False):
+        self.index = index
+        self.address = address
+        self.script = script
+        self.verbose = verbose
+        self.thread = None
+        self.finish = False
+        self.abort = False      # `iperf -a`: stop the current run
+        self.runs = 0
+        self.errors = 0
+        self.bytes = 0
+        self.busy_s = 0.0       # time spent in runs, for the device's throughput
+        self.last_bytes = 0
+        self.last_s = 0.0
+        self.lock = threading.Lock()
+
+    def log(self, text):
+        if self.verbose:
+            print("dev{:02d} {}".format(self.index, text))
+
+    def connect(self, cfg):
+        sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM if cfg.udp else socket.SOCK_STREAM)
+        sock.bind((self.address, 0))
+        sock.connect((cfg.host, cfg.port))
+        return sock
+
+    def run(self, cfg, until=None):
+        """ one client run, like iperf_run_tcp_client()/iperf_run_udp_client(), for cfg.time or, if given, until
+        until() has passed; returns (bytes, seconds) """
+        total = 0
+        start = time.time()
+        end = until or (lambda: start + cfg.time)
+        try:
+            sock = self.connect(cfg)
+        except socket.error as e:
+            self.log("connect failed: {}".format(e))
+            with self.lock:
+                self.errors += 1
+            return 0, 0.0
+        buf = bytearray(cfg.length)
+        rng = random.Random(self.index)
+        next_send = start
+        datagram_id = 0
+        try:
+            while not self.finish and not self.abort and time.time() < end():
+                if cfg.pps:
+                    now = time.time()
+                    if now < next_send:
+                        time.sleep(min(next_send - now, 0.01))
+                        continue
+                    next_send += rng.expovariate(cfg.pps)
+                if cfg.udp:
+                    datagram_id += 1
+                    now = time.time()
+                    UDP_HDR.pack_into(buf, 0, datagram_id, int(now), int(now % 1 * 1e6))
+                    try:
+                        total += sock.send(buf)
+                    except socket.error:
+                        # ENOBUFS and the like, the device backs off too
+                        time.sleep(0.001)
+                else:
+                    total += sock.send(buf)
+        except socket.error as e:
+            self.log("send failed: {}".format(e))
+            with self.lock:
+                self.errors += 1
+        finally:
+            sock.close()
+        elapsed = time.time() - start
+        with self.lock:
+            self.runs += 1
+            self.bytes += total
+            self.busy_s += elapsed
+            self.last_bytes, self.last_s = total, elapsed
+        self.log("{} {} bytes in {:.2f} s, {:.2f} Mbits/sec".format("udp" if cfg.udp else "tcp", total, elapsed,
+                                                                   total * 8 / elapsed / 1e6 if elapsed else 0))
+        return total, elapsed
+
+    @staticmethod
+    def parse_iperf(argv):
+        parser = argparse.ArgumentParser(prog="iperf", add_help=False)
+        parser.add_argument("-c", dest="host")
+        parser.add_argument("-u", action="store_true")
+        parser.add_argument("-p", type=int, default=IPERF_DEFAULT_PORT)
+        parser.add_argument("-t", type=int, default=DEFAULT_TIME)
+        parser.add_argument("-i", type=int, default=DEFAULT_INTERVAL)
+        parser.add_argument("-l", type=int, default=0)
+        parser.add_argument("--poisson", type=int, default=0)
+        parser.add_argument("-a", action="store_true")
+        args, _ = parser.parse_known_args(argv)
+        return args
+
+    def play(self):
+        """ run the command-list once, as the device's main loop does with its autorun list """
+        traffic = None
+        for line in self.script.split(";"):
+            if self.finish:
+                break
+            argv = shlex.split(line)
+            if not argv:
+                continue
+            if argv[0] == "iperf":
+                args = self.parse_iperf(argv[1:])
+                if args.a:
+                    self.abort = True
+                    if traffic:
+                        traffic.join()
+                    self.abort = False
+                    continue
+                if not args.host:
+                    self.log("only client runs are emulated, skipping `{}`".format(line.strip()))
+                    continue
+                if traffic and traffic.is_alive():
+                    self.log("iperf is running")
+                    continue
+                cfg = RunConfig(args.host, args.u, args.p, args.t, args.i, args.l, args.poisson)
+                traffic = threading.Thread(target=self.run, args=(cfg,))
+                traffic.start()
+            elif argv[0] == "autorun_wait":
+                if traffic:
+                    traffic.join()
+            elif argv[0] == "autorun_delay" and len(argv) > 1:
+                time.sleep(int(argv[1]) / 1000)
+            else:
+                self.log("skipping `{}`".format(line.strip()))
+        if traffic:
+            traffic.join()
+
+    def start(self, stagger=0.0):
+        def body():
+            time.sleep(stagger)
+            self.play()
+        self.thread = threading.Thread(target=body)
+        self.thread.daemon = True
+        self.thread.start()
+
+    @property
+    def mbps(self):
+        return self.bytes * 8 / self.busy_s / 1e6 if self.busy_s else 0.0
+
+
+class RemoteDevice(StandIn):
+    """ the control channel of an emulated device: each START runs real client traffic from it """
+
+    def __init__(self, device, port):
+        StandIn.__init__(self, port, host="127.0.0.1")
+        self.device = device
+        self.traffic = None
+
+    def _start(self, payload):
+        status = StandIn._start(self, payload)
+        if status != 0:
+            return status
+        flag, _, _, port, raw, interval, time_, _, _ = CFG.unpack(payload)
+        if not flag & FLAG_CLIENT:
+            # a device as server would need the harness to send to it; nothing to emulate
+            self.end_time = None
+            return STATUS_INVALID
+        cfg = RunConfig(socket.inet_ntoa(raw[:4]), bool(flag & FLAG_UDP), port or IPERF_DEFAULT_PORT,
+                        time_ or DEFAULT_TIME, interval or DEFAULT_INTERVAL)
+        # STOP moves end_time forward, which ends the run early just like on the device
+        self.traffic = threading.Thread(target=self.device.run, args=(cfg, lambda: self.end_time or 0))
+        self.traffic.start()
+        return status
+
+    def _finish(self):
+        self.traffic.join()
+        result = IperfResult(b"\0" * RESULT.size)
+        result.flag = self.flag
+        result.duration_ms = int(self.device.last_s * 1000)
+        result.bytes = self.device.last_bytes
+        result.bandwidth_kbps = int(result.bytes * 8 / self.device.last_s / 1000) if self.device.last_s else 0
+        self.last = result
+        self.end_time = None
+        return result
+
+
+class Sink(object):
+    """ a shared TCP and UDP server counting what each source address sends it """
+
+    def __init__(self, port, host="0.0.0.0"):
+        self.port = port
+        self.host = host
+        self.lock = threading.Lock()
+        self.rx = {}            # source address: [bytes, datagrams, datagrams lost]
+        self.last_id = {}       # (address, port): highest UDP datagram id seen
+        self.first = None
+        self.last = None
+
+    def account(self, addr, length, datagram_id=None):
+        now = time.time()
+        with self.lock:
+            entry = self.rx.setdefault(addr[0], [0, 0, 0])
+            entry[0] += length
+            self.first = self.first or now
+            self.last = now
+            if datagram_id is not None and datagram_id > 0:
+                entry[1] += 1
+                last = self.last_id.get(addr)
+                if last is not None and datagram_id > last + 1:
+                    entry[2] += datagram_id - last - 1
+                if last is None or datagram_id > last:
+                    self.last_id[addr] = datagram_id
+
+    def serve_udp(self, sock):
+        while True:
+            data, addr = sock.recvfrom(65535)
+            self.account(addr, len(data), UDP_HDR.unpack_from(data)[0] if len(data) >= UDP_HDR.size else None)
+
+    def serve_tcp_conn(self, conn, addr):
+        try:
+            while True:
+                data = conn.recv(65536)
+                if not data:
+                    break
+                self.account(addr, len(data))
+        except socket.error:
+            pass
+        finally:
+            conn.close()
+
+    def serve_tcp(self, listener):
+        while True:
+            conn, addr = listener.accept()
+            thread = threading.Thread(target=self.serve_tcp_conn, args=(conn, addr))
+            thread.daemon = True
+            thread.start()
+
+    def start(self):
+        udp = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        udp.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 4 << 20)
+        udp.bind((self.host, self.port))
+        tcp = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        tcp.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        tcp.bind((self.host, self.port))
+        tcp.listen(128)
+        for target, sock in ((self.serve_udp, udp), (self.serve_tcp, tcp)):
+            thread = threading.Thread(target=target, args=(sock,))
+            thread.daemon = True
+            thread.start()
+
+
+def print_summary(devices, sink=None):
+    print("\n{:>5} {:>12} {:>5} {:>6} {:>14} {:>10}".format("dev", "address", "runs", "errors", "bytes sent",
+                                                           "Mbits/sec"))
+    for dev in devices:
+        print("{:>5} {:>12} {:>5} {:>6} {:>14} {:>10.2f}".format(dev.index, dev.address, dev.runs, dev.errors,
+                                                                 dev.bytes, dev.mbps))
+    total = sum(dev.bytes for dev in devices)
+    print("sent: {} bytes from {} devices, {:.2f} Mbits/sec summed, Jain's index {:.3f}".format(
+        total, len(devices), sum(dev.mbps for dev in devices), jain_index(dev.mbps for dev in devices)))
+    if sink is None:
+        return
+    rx = [sink.rx.get(dev.address, [0, 0, 0]) for dev in devices]
+    span = (sink.last - sink.first) if sink.first else 0
+    print("received: {} bytes in {:.1f} s, {:.2f} Mbits/sec, Jain's index {:.3f} over bytes received".format(
+        sum(r[0] for r in rx), span, sum(r[0] for r in rx) * 8 / span / 1e6 if span else 0,
+        jain_index(r[0] for r in rx)))
+    lost = sum(r[2] for r in rx)
+    if any(r[1] for r in rx):
+        print("udp: {} datagrams received, {} lost ({:.2f}%)".format(
+            sum(r[1] for r in rx), lost, lost * 100 / (sum(r[1] for r in rx) + lost)))
+
+
+def self_check():
+    """ the index on known inputs, then a small fleet against the sink """
+    assert abs(jain_index([5, 5, 5, 5]) - 1) < 1e-9
+    assert abs(jain_index([8, 0, 0, 0]) - 0.25) < 1e-9
+    assert abs(jain_index([1, 2, 3]) - 36 / 42) < 1e-9
+    sink = Sink(0, "127.0.0.1")
+    probe = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    probe.bind(("127.0.0.1", 0))
+    sink.port = probe.getsockname()[1]
+    probe.close()
+    sink.start()
+    script = "iperf -c 127.0.0.1 -p {0} -t 1; autorun_wait iperf_traffic; autorun_delay 100; " \
+             "iperf -c 127.0.0.1 -p {0} -u -l 256 --poisson 500 -t 1; autorun_wait iperf_traffic".format(sink.port)
+    devices = [EmulatedDevice(i, FLEET_NET + str(i + 1), script) for i in range(4)]
+    for dev in devices:
+        dev.start()
+    for dev in devices:
+        dev.thread.join(10)
+    time.sleep(0.2)
+    for dev in devices:
+        assert dev.runs == 2 and dev.errors == 0, (dev.index, dev.runs, dev.errors)
+        assert sink.rx[dev.address][0] > 0, dev.address
+        # about 500 datagrams/sec for a second
+        assert 200 < sink.rx[dev.address][1] < 1000, sink.rx[dev.address]
+    # and one run through the control channel
+    remote_dev = EmulatedDevice(9, FLEET_NET + "10", "")
+    stand_in = RemoteDevice(remote_dev, 0)
+    stand_in.start_thread()
+    with IperfRemote("127.0.0.1", stand_in.port) as remote:
+        result = remote.run(FLAG_CLIENT | FLAG_UDP, addr="127.0.0.1", port=sink.port, time_=1, timeout=5)
+    assert result.bytes > 0 and result.bytes == sink.rx[remote_dev.address][0], (result.bytes, sink.rx)
+    print_summary(devices, sink)
+    print("self-check ok")
+
+
+def main():
+    parser = argparse.ArgumentParser(description="emulate a fleet of devices driving one iperf server")
+    parser.add_argument("-n", "--devices", type=int, default=8, help="number of emulated devices")
+    parser.add_argument("--script", help="autorun command-list every device plays, `;` separated")
+    parser.add_argument("--repeat", type=int, default=1, help="times each device plays the script")
+    parser.add_argument("--stagger", type=float, default=0, help="seconds between the devices' starts")
+    parser.add_argument("--sink", action="store_true", help="run the shared server here, on -p")
+    parser.add_argument("-p", "--port", type=int, default=IPERF_DEFAULT_PORT, help="--sink: port to listen on")
+    parser.add_argument("--remote-base-port", type=int, default=0,
+                        help="serve the control channel, device i on this port + i, until interrupted")
+    parser.add_argument("-v", "--verbose", action="store_true", help="print every run of every device")
+    parser.add_argument("--self-check", action="store_true", help="test the simulator on loopback and exit")
+    args = parser.parse_args()
+
+    if args.self_check:
+        self_check()
+        return
+    if not args.script and not args.remote_base_port:
+        parser.error("give a --script, --remote-base-port or both")
+
+    sink = None
+    if args.sink:
+        sink = Sink(args.port)
+        sink.start()
+        print("sink on port {}".format(args.port))
+
+    devices = [EmulatedDevice(i, FLEET_NET + str(i + 1), args.script or "", args.verbose) for i in range(args.devices)]
+    if args.remote_base_port:
+        for dev in devices:
+            RemoteDevice(dev, args.remote_base_port + dev.index).start_thread()
+        print("control channels on ports {}-{}".format(args.remote_base_port, args.remote_base_port + len(devices) - 1))
+
+    start = time.time()
+    try:
+        if args.script:
+            for _ in range(args.repeat):
+                for dev in devices:
+                    dev.start(args.stagger * dev.index)
+                for dev in devices:
+                    while dev.thread.is_alive():
+                        dev.thread.join(0.5)
+        if args.remote_base_port:
+            while True:
+                time.sleep(1)
+    except KeyboardInterrupt:
+        for dev in devices:
+            dev.finish = True
+    print("\nfleet ran for {:.1f} s".format(time.time() - start))
+    if sink:
+        # let the sink drain what is still in the socket buffers
+        time.sleep(0.5)
+    print_summary(devices, sink)
+
+
+if __name__ == "__main__":
+    main()
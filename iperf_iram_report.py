@@ -0,0 +1,88 @@
+"""
+Per-function IRAM report for the iperf component, to go with the CONFIG_IPERF_IRAM_* build variants.
+
+Give it one or more ELF files, eg one build per variant::
+
+    for v in none servers clients engines all; do
+        IPERF_IRAM=$v make -j8 && cp build/iperf.elf iperf-$v.elf
+    done
+    python iperf_iram_report.py iperf-*.elf
+
+It lists the size of every iperf function and whether it landed in IRAM, then the IRAM used by the whole image (the
+ESP8266 has 32 KB of it, shared with the SDK) and what is left. Run `iperf --self` on each build for the cycles per
+packet it buys.
+"""
+from __future__ import division
+from __future__ import print_function
+import argparse
+import os
+import subprocess
+
+IRAM_START = 0x40100000
+IRAM_SIZE = 0x8000
+DEFAULT_PREFIX = "xtensa-lx106-elf-"
+
+
+def is_iram(addr):
+    return IRAM_START <= addr < IRAM_START + IRAM_SIZE
+
+
+def read_functions(nm, elf, pattern):
+    """ {name: (address, size)} of the text symbols containing pattern """
+    out = subprocess.check_output([nm, "--print-size", "--defined-only", elf]).decode()
+    functions = {}
+    for line in out.splitlines():
+        fields = line.split()
+        if len(fields) != 4 or fields[2] not in "tTW" or pattern not in fields[3]:
+            continue
+        functions[fields[3]] = (int(fields[0], 16), int(fields[1], 16))
+    return functions
+
+
+def read_iram_used(size_tool, elf):
+    """ bytes of IRAM taken by the sections loaded there """
+    out = subprocess.check_output([size_tool, "-A", elf]).decode()
+    used = 0
+    for line in out.splitlines():
+        fields = line.split()
+        if len(fields) == 3 and fields[1].isdigit() and fields[2].isdigit() and is_iram(int(fields[2])):
+            used += int(fields[1])
+    return used
+
+
+def main():
+    parser = argparse.ArgumentParser(description="IRAM cost of the iperf functions in one or more builds")
+    parser.add_argument("elf", nargs="+", help="ELF files, eg one per IPERF_IRAM variant")
+    parser.add_argument("--prefix", default=DEFAULT_PREFIX, help="toolchain prefix for nm and size")
+    parser.add_argument("--pattern", default="iperf", help="report the functions whose name contains this")
+    args = parser.parse_args()
+
+    builds = []
+    for elf in args.elf:
+        builds.append((os.path.basename(elf), read_functions(args.prefix + "nm", elf, args.pattern),
+                       read_iram_used(args.prefix + "size", elf)))
+
+    names = sorted(set(name for _, functions, _ in builds for name in functions),
+                   key=lambda n: -max(f.get(n, (0, 0))[1] for _, f, _ in builds))
+    width = max([len(n) for n in names] + [len("iperf in IRAM")])
+    print("{:{w}}".format("function", w=width) + "".join("  {:>16}".format(b[0][:16]) for b in builds))
+    for name in names:
+        cells = []
+        for _, functions, _ in builds:
+            if name in functions:
+                addr, size = functions[name]
+                cells.append("{:>11} {:>4}".format(size, "IRAM" if is_iram(addr) else ""))
+            else:
+                cells.append("{:>16}".format("-"))
+        print("{:{w}}".format(name, w=width) + "".join("  " + c for c in cells))
+
+    print()
+    print("{:{w}}".format("iperf in IRAM", w=width) + "".join(
+        "  {:>16}".format(sum(s for a, s in f.values() if is_iram(a))) for _, f, _ in builds))
+    print("{:{w}}".format("IRAM used", w=width) + "".join("  {:>16}".format(used) for _, _, used in builds))
+    print("{:{w}}".format("IRAM free", w=width) + "".join(
+        "  {:>16}".format(IRAM_SIZE - used) for _, _, used in builds))
+
+
+if __name__ == "__main__":
+    main()
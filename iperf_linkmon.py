@@ -0,0 +1,55 @@
+"""
+Collector for the device's background link monitor (`linkmon -c <this host>` on the device, see
+components/iperf/iperf_linkmon.c).
+
+It echoes every probe straight back, which is all the device needs to measure loss, RTT and jitter, and prints a line per
+device every `-i` seconds with the probes it got, so a link that drops out is also visible from this side::
+
+    python iperf_linkmon.py -p 5004 -i 60
+"""
+from __future__ import division
+from __future__ import print_function
+import argparse
+import socket
+import struct
+import time
+
+DEFAULT_PORT = 5004
+PROBE = struct.Struct(">IIII")  # magic, seq, tx time (hi, lo) in device microseconds
+MAGIC = 0x4c4d4f4e
+
+
+def main():
+    parser = argparse.ArgumentParser(description="echo collector for the device link monitor")
+    parser.add_argument("-p", "--port", type=int, default=DEFAULT_PORT)
+    parser.add_argument("-i", "--interval", type=int, default=60, help="seconds between per-device summaries")
+    args = parser.parse_args()
+
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.bind(("0.0.0.0", args.port))
+    sock.settimeout(1.0)
+    devices = {}    # address: [probes, lowest seq, highest seq] in this interval
+    next_report = time.time() + args.interval
+    while True:
+        try:
+            data, addr = sock.recvfrom(2048)
+            if len(data) == PROBE.size and PROBE.unpack(data)[0] == MAGIC:
+                sock.sendto(data, addr)
+                seq = PROBE.unpack(data)[1]
+                stats = devices.setdefault(addr[0], [0, seq, seq])
+                stats[0] += 1
+                stats[1] = min(stats[1], seq)
+                stats[2] = max(stats[2], seq)
+        except socket.timeout:
+            pass
+        if time.time() >= next_report:
+            for device, (count, first, last) in sorted(devices.items()):
+                expected = last - first + 1
+                print("{} {}: {}/{} probes ({:.2f}% missing on the way here)".format(
+                    time.strftime("%H:%M:%S"), device, count, expected, (expected - count) * 100 / expected))
+            devices.clear()
+            next_report += args.interval
+
+
+if __name__ == "__main__":
+    main()
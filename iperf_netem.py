@@ -0,0 +1,327 @@
+"""
+Network impairment relay for iperf tests, a user-space stand-in for Linux netem.
+
+Put it between a PC iperf and the device (or between two devices) to see how loss, delay, jitter, reordering and a
+bandwidth cap show up in the reports, without a real bad link::
+
+    python iperf_netem.py -u --listen 5001 --to 192.168.1.50:5001 --loss 2 --delay 20 --jitter 5 --rate 5m
+    iperf -c 127.0.0.1 -u -b 10M -t 10        # the device runs `iperf -s -u`
+
+Datagrams (UDP) or stream chunks (TCP) are held for `--delay` ms plus a random `--jitter` (uniform, or normal with
+`--dist normal`), then queued behind a link of `--rate` bits/sec with a `--limit` byte queue (overflow is dropped, like a
+router). UDP datagrams are also dropped with `--loss` percent probability, and `--reorder` percent of them are held for
+an extra `--reorder-gap` ms so later ones overtake them. TCP is a byte stream, so it only gets delay, jitter (without
+reordering) and the rate cap; losses would be TCP's own to recover. Replies (eg iperf2's UDP server report) are passed
+back unimpaired. `--seed` repeats a run's random choices.
+
+`--self-check` pushes UDP traffic through a relay on 127.0.0.1 and checks the measured loss, delay, jitter and
+throughput against what was injected, to make sure the relay itself can be trusted on this host.
+"""
+from __future__ import division
+from __future__ import print_function
+import argparse
+import collections
+import heapq
+import random
+import select
+import socket
+import threading
+import time
+
+UDP_MAX = 65535
+TCP_CHUNK = 4096
+DEFAULT_LIMIT = 256 * 1024
+
+
+def parse_rate(text):
+    """ bits/sec with an optional k/m/g suffix, 0 for no cap """
+    scale = {"k": 1e3, "m": 1e6, "g": 1e9}.get(text[-1:].lower())
+    return float(text[:-1]) * scale if scale else float(text)
+
+
+class Impairment(object):
+    """ the random part: which packets to drop and how long to hold each """
+
+    def __init__(self, loss=0.0, delay_ms=0.0, jitter_ms=0.0, dist="uniform", reorder=0.0, reorder_gap_ms=0.0,
+                 rate_bps=0.0, limit=DEFAULT_LIMIT, seed=None):
+        self.loss = loss / 100
+        self.delay = delay_ms / 1000
+        self.jitter = jitter_ms / 1000
+        self.dist = dist
+        self.reorder = reorder / 100
+        self.reorder_gap = reorder_gap_ms / 1000
+        self.rate_bps = rate_bps
+        self.limit = limit
+        self.random = random.Random(seed)
+        self.link_free = 0.0
+        self.queued = []    # (time the bytes leave the link queue, length), to know its backlog
+        self.backlog = 0
+        self.dropped = 0
+        self.overflow = 0
+
+    def drop(self):
+        if self.loss and self.random.random() < self.loss:
+            self.dropped += 1
+            return True
+        return False
+
+    def hold(self, reorderable=True):
+        """ seconds to delay the next packet by """
+        if self.dist == "normal":
+            extra = self.random.gauss(0, self.jitter)
+        else:
+            extra = self.random.uniform(-self.jitter, self.jitter)
+        hold = max(0.0, self.delay + extra)
+        if reorderable and self.reorder and self.random.random() < self.reorder:
+            hold += self.reorder_gap
+        return hold
+
+    def transmit(self, now, length):
+        """ when a packet of length bytes arriving now is through the rate cap, or None if the queue is full """
+        if not self.rate_bps:
+            return now
+        while self.queued and self.queued[0][0] <= now:
+            self.backlog -= heapq.heappop(self.queued)[1]
+        if self.backlog + length > self.limit:
+            self.overflow += 1
+            return None
+        self.link_free = max(self.link_free, now) + length * 8 / self.rate_bps
+        heapq.heappush(self.queued, (self.link_free, length))
+        self.backlog += length
+        return self.link_free
+
+
+class UdpRelay(object):
+    """ relays datagrams from any sender on `listen` to `target`, impaired; replies go back to the latest sender """
+
+    def __init__(self, listen, target, impairment):
+        self.target = target
+        self.imp = impairment
+        self.sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        self.sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        self.sock.bind(listen)
+        self.port = self.sock.getsockname()[1]
+        self.upstream = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        self.peer = None
+        self.pending = []
+        self.seq = 0
+        self.relayed = 0
+        self.stopped = False
+
+    def _schedule(self, now, data):
+        if self.imp.drop():
+            return
+        out = self.imp.transmit(now, len(data))
+        if out is None:
+            return
+        self.seq += 1
+        heapq.heappush(self.pending, (out + self.imp.hold(), self.seq, data))
+
+    def serve(self):
+        while not self.stopped:
+            now = time.time()
+            while self.pending and self.pending[0][0] <= now:
+                self.upstream.sendto(heapq.heappop(self.pending)[2], self.target)
+                self.relayed += 1
+            timeout = min(0.1, self.pending[0][0] - now) if self.pending else 0.1
+            readable, _, _ = select.select([self.sock, self.upstream], [], [], max(0.0, timeout))
+            if self.sock in readable:
+                data, self.peer = self.sock.recvfrom(UDP_MAX)
+                self._schedule(time.time(), data)
+            if self.upstream in readable:
+                data, _ = self.upstream.recvfrom(UDP_MAX)
+                if self.peer:
+                    self.sock.sendto(data, self.peer)
+
+    def start_thread(self):
+        thread = threading.Thread(target=self.serve)
+        thread.daemon = True
+        thread.start()
+        return thread
+
+
+class TcpRelay(object):
+    """ relays each connection on `listen` to `target`, delayed and rate capped on the way there """
+
+    def __init__(self, listen, target, impairment):
+        self.target = target
+        self.imp = impairment
+        self.listener = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        self.listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        self.listener.bind(listen)
+        self.listener.listen(1)
+        self.port = self.listener.getsockname()[1]
+
+    @staticmethod
+    def _shutdown(sock, how):
+        try:
+            sock.shutdown(how)
+        except socket.error:
+            pass
+
+    def _forward(self, src, dst):
+        """ read chunks as they come and hand them to a writer that sends each at its release time, so the delay
+        is pipelined like on a real link rather than added per chunk """
+        chunks = collections.deque()
+        ready = threading.Condition()
+
+        def writer():
+            try:
+                while True:
+                    with ready:
+                        while not chunks:
+                            ready.wait()
+                        release, data = chunks.popleft()
+                    if data is None:
+                        break
+                    time.sleep(max(0.0, release - time.time()))
+                    dst.sendall(data)
+            except socket.error:
+                self._shutdown(src, socket.SHUT_RDWR)
+            self._shutdown(dst, socket.SHUT_WR)
+
+        thread = threading.Thread(target=writer)
+        thread.daemon = True
+        thread.start()
+        release = 0.0
+        try:
+            while True:
+                data = src.recv(TCP_CHUNK)
+                if not data:
+                    break
+                out = self.imp.transmit(time.time(), len(data))
+                # a stream can't lose bytes, a full queue just holds the sender back
+                while out is None:
+                    time.sleep(0.001)
+                    out = self.imp.transmit(time.time(), len(data))
+                # nor reorder them
+                release = max(release, out + self.imp.hold(reorderable=False))
+                with ready:
+                    chunks.append((release, data))
+                    ready.notify()
+        except socket.error:
+            pass
+        with ready:
+            chunks.append((release, None))
+            ready.notify()
+
+    def _backward(self, src, dst):
+        try:
+            while True:
+                data = src.recv(TCP_CHUNK)
+                if not data:
+                    break
+                dst.sendall(data)
+        except socket.error:
+            pass
+        self._shutdown(dst, socket.SHUT_WR)
+
+    def serve(self):
+        while True:
+            conn, _ = self.listener.accept()
+            upstream = socket.create_connection(self.target)
+            for pump, src, dst in ((self._forward, conn, upstream), (self._backward, upstream, conn)):
+                thread = threading.Thread(target=pump, args=(src, dst))
+                thread.daemon = True
+                thread.start()
+
+
+def self_check(args):
+    """ send a paced UDP stream through a relay on this host and compare what comes out with what was injected """
+    count, size, gap = 2000, 1000, 0.001
+    imp = Impairment(loss=5, delay_ms=20, jitter_ms=5, reorder=0, rate_bps=4e6, limit=10 ** 9, seed=args.seed or 1)
+
+    sink = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sink.bind(("127.0.0.1", 0))
+    sink.settimeout(1.0)
+    relay = UdpRelay(("127.0.0.1", 0), sink.getsockname(), imp)
+    relay.start_thread()
+
+    arrivals = {}
+
+    def receive():
+        try:
+            while True:
+                data = sink.recv(UDP_MAX)
+                seq, sent = int(data[:8]), float(data[8:32])
+                arrivals[seq] = (sent, time.time())
+        except socket.timeout:
+            pass
+
+    receiver = threading.Thread(target=receive)
+    receiver.start()
+    sender = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    start = time.time()
+    for seq in range(count):
+        payload = "{:8d}{:24.6f}".format(seq, time.time()).encode()
+        sender.sendto(payload.ljust(size, b"\0"), ("127.0.0.1", relay.port))
+        time.sleep(max(0.0, start + (seq + 1) * gap - time.time()))
+    receiver.join()
+    relay.stopped = True
+
+    loss = 100 - len(arrivals) * 100 / count
+    # the link is the bottleneck (1000 B at 4 Mbits/sec is 2 ms a datagram), so the queue grows steadily; the spread of
+    # the excess delay over the pure queueing delay is the jitter
+    order = sorted(arrivals)
+    first_sent = arrivals[order[0]][0]
+    excess = []
+    for n, seq in enumerate(order):
+        sent, received = arrivals[seq]
+        queueing = max(0.0, (n + 1) * size * 8 / imp.rate_bps - (sent - first_sent))
+        excess.append(received - sent - queueing)
+    mean = sum(excess) / len(excess)
+    spread = (sum((e - mean) ** 2 for e in excess) / len(excess)) ** 0.5
+    span = arrivals[order[-1]][1] - arrivals[order[0]][1]
+    mbps = len(arrivals) * size * 8 / span / 1e6
+
+    checks = [
+        ("loss %", loss, 5, 1.5),
+        ("delay ms", mean * 1000, 20, 3),
+        ("jitter ms (uniform +/-5, stddev 2.9)", spread * 1000, 5 / 3 ** 0.5, 1),
+        ("throughput Mbits/sec", mbps, 4, 0.4),
+    ]
+    failed = False
+    for name, measured, injected, tolerance in checks:
+        ok = abs(measured - injected) <= tolerance
+        failed |= not ok
+        print("{:40} measured {:8.2f} injected {:8.2f} +/- {:5.2f}  {}".format(name, measured, injected, tolerance,
+                                                                            "ok" if ok else "FAIL"))
+    return 1 if failed else 0
+
+
+def main():
+    parser = argparse.ArgumentParser(description="netem-like impairment relay for iperf tests")
+    parser.add_argument("-u", "--udp", action="store_true", help="relay UDP (default TCP)")
+    parser.add_argument("--listen", type=int, default=5001, help="local port to relay from")
+    parser.add_argument("--to", metavar="HOST:PORT", help="where to relay to")
+    parser.add_argument("--loss", type=float, default=0, help="UDP: percent of datagrams to drop")
+    parser.add_argument("--delay", type=float, default=0, help="ms to hold every packet")
+    parser.add_argument("--jitter", type=float, default=0, help="ms of random variation around --delay")
+    parser.add_argument("--dist", choices=["uniform", "normal"], default="uniform",
+                        help="jitter distribution: uniform +/- jitter, or normal with jitter as stddev")
+    parser.add_argument("--reorder", type=float, default=0, help="UDP: percent of datagrams held back")
+    parser.add_argument("--reorder-gap", type=float, default=10, help="ms extra for the held back datagrams")
+    parser.add_argument("--rate", type=parse_rate, default=0, help="bits/sec cap, k/m/g suffixes")
+    parser.add_argument("--limit", type=int, default=DEFAULT_LIMIT, help="bytes queued behind the rate cap")
+    parser.add_argument("--seed", type=int, help="seed of the random choices, to repeat a run")
+    parser.add_argument("--self-check", action="store_true", help="check the relay itself on this host and exit")
+    args = parser.parse_args()
+
+    if args.self_check:
+        raise SystemExit(self_check(args))
+    if not args.to:
+        parser.error("--to is required")
+    host, port = args.to.rsplit(":", 1)
+    imp = Impairment(args.loss, args.delay, args.jitter, args.dist, args.reorder, args.reorder_gap, args.rate, args.limit,
+                     args.seed)
+    relay = (UdpRelay if args.udp else TcpRelay)(("0.0.0.0", args.listen), (host, int(port)), imp)
+    print("relaying {} port {} to {}".format("udp" if args.udp else "tcp", relay.port, args.to))
+    try:
+        relay.serve()
+    except KeyboardInterrupt:
+        if args.udp:
+            print("dropped {}, queue overflow {}, relayed {}".format(imp.dropped, imp.overflow, relay.relayed))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,171 @@
+"""
+Turn the device's packet capture (build option CONFIG_IPERF_CAPTURE, see components/iperf/iperf_capture.h) into a
+pcap file that Wireshark decodes: the device only keeps the start of each payload and who sent it, so this puts
+IPv4 and UDP/TCP headers back in front (addressed to --device, port --port), and Wireshark's iperf2 dissector then
+shows the datagram ids and client timestamps.
+
+Either let it run `capture dump` on the serial port itself (needs pyserial), or give it a raw serial log that
+contains a dump::
+
+    python iperf_pcap.py --serial /dev/ttyUSB0 -o capture.pcap
+    python iperf_pcap.py capture.log --device 192.168.1.50 -o capture.pcap
+
+Timestamps are microseconds since the device booted. For a UDP test the interval reports start with the first
+datagram, so after `capture clear` they line up with Wireshark's time since the first packet.
+"""
+from __future__ import division
+from __future__ import print_function
+import argparse
+import re
+import socket
+import struct
+import sys
+import time
+
+PCAP_HEADER = struct.Struct("<IHHiIII")     # magic, major, minor, thiszone, sigfigs, snaplen, linktype
+RECORD = struct.Struct("<IIII")             # ts_sec, ts_usec, incl_len, orig_len
+PSEUDO = struct.Struct("<BBHI")             # proto, reserved, port and IPv4 address (both kept in network order)
+PCAP_MAGIC = 0xa1b2c3d4
+LINKTYPE_USER0 = 147
+LINKTYPE_RAW = 101
+IPPROTO_TCP = 6
+IPPROTO_UDP = 17
+BEGIN = re.compile(br"IPERF-CAPTURE-BEGIN (\d+)\r?\n")
+
+
+def find_dump(data):
+    """ the pcap stream of the last dump in a serial capture """
+    matches = list(BEGIN.finditer(data))
+    if not matches:
+        raise ValueError("no IPERF-CAPTURE-BEGIN in the input")
+    match = matches[-1]
+    size = int(match.group(1))
+    blob = data[match.end():match.end() + size]
+    if len(blob) < size:
+        raise ValueError("dump truncated: {} of {} bytes".format(len(blob), size))
+    return blob
+
+
+def read_records(blob):
+    magic, _, _, _, _, _, linktype = PCAP_HEADER.unpack_from(blob)
+    if magic != PCAP_MAGIC or linktype != LINKTYPE_USER0:
+        raise ValueError("not an iperf capture dump")
+    off = PCAP_HEADER.size
+    while off < len(blob):
+        ts_sec, ts_usec, incl_len, orig_len = RECORD.unpack_from(blob, off)
+        off += RECORD.size
+        proto, _, port, ip4 = PSEUDO.unpack_from(blob, off)
+        payload = blob[off + PSEUDO.size:off + incl_len]
+        off += incl_len
+        # port and address were copied from the sockaddr, ie are in network order already
+        yield ts_sec, ts_usec, proto, struct.pack("<H", port), struct.pack("<I", ip4), orig_len - PSEUDO.size, payload
+
+
+def ip_checksum(header):
+    total = sum(struct.unpack("!10H", header))
+    total = (total >> 16) + (total & 0xffff)
+    total += total >> 16
+    return ~total & 0xffff
+
+
+def to_raw_pcap(blob, device_ip, device_port):
+    """ rewrite the dump as LINKTYPE_RAW, with IPv4 and UDP/TCP headers """
+    dst = socket.inet_aton(device_ip)
+    out = [PCAP_HEADER.pack(PCAP_MAGIC, 2, 4, 0, 0, 65535, LINKTYPE_RAW)]
+    tcp_seq = {}    # sender: stream offset of its next byte
+    count = 0
+    for ts_sec, ts_usec, proto, sport, src, length, payload in read_records(blob):
+        if proto == IPPROTO_UDP:
+            l4 = sport + struct.pack("!HHH", device_port, 8 + length, 0)
+        else:
+            seq = tcp_seq.get((src, sport), 0)
+            tcp_seq[(src, sport)] = (seq + length) & 0xffffffff
+            l4 = sport + struct.pack("!HIIBBHHH", device_port, seq, 0, 5 << 4, 0x18, 65535, 0, 0)
+        total = 20 + len(l4) + length
+        # IPv6 senders were recorded as 0.0.0.0
+        ip = struct.pack("!BBHHHBBH4s4s", 0x45, 0, min(total, 65535), count & 0xffff, 0, 64, proto, 0, src, dst)
+        ip = ip[:10] + struct.pack("!H", ip_checksum(ip)) + ip[12:]
+        packet = ip + l4 + payload
+        out.append(RECORD.pack(ts_sec, ts_usec, len(packet), total) + packet)
+        count += 1
+    return b"".join(out), count
+
+
+def read_serial(port, baud, timeout):
+    import serial
+    ser = serial.Serial(port, baud, timeout=0.5)
+    ser.reset_input_buffer()
+    ser.write(b"capture dump\r")
+    data = b""
+    deadline = time.time() + timeout
+    while b"IPERF-CAPTURE-END" not in data and time.time() < deadline:
+        data += ser.read(4096)
+    ser.close()
+    return data
+
+
+def self_check():
+    """ round-trip a made-up dump of one UDP datagram and two TCP reads """
+    peer = socket.inet_aton("10.0.0.2")
+    port = struct.pack("!H", 40000)
+    records = [(5, 100, IPPROTO_UDP, 1470, struct.pack("!iII", 7, 5, 100)),
+               (5, 200, IPPROTO_TCP, 16384, b"\0" * 48), (5, 300, IPPROTO_TCP, 1000, b"\0" * 48)]
+    blob = PCAP_HEADER.pack(PCAP_MAGIC, 2, 4, 0, 0, 56, LINKTYPE_USER0)
+    for ts_sec, ts_usec, proto, length, payload in records:
+        pseudo = struct.pack("<BB", proto, 0) + port + peer
+        blob += RECORD.pack(ts_sec, ts_usec, len(pseudo) + len(payload), len(pseudo) + length) + pseudo + payload
+    data = b"capture dump\r\nIPERF-CAPTURE-BEGIN %d\r\n" % len(blob) + blob + b"\r\nIPERF-CAPTURE-END\r\n"
+    pcap, count = to_raw_pcap(find_dump(data), "192.0.2.1", 5001)
+    assert count == 3
+    off = PCAP_HEADER.size
+    seqs = []
+    for ts_sec, ts_usec, proto, length, payload in records:
+        _, _, incl_len, orig_len = RECORD.unpack_from(pcap, off)
+        packet = pcap[off + RECORD.size:off + RECORD.size + incl_len]
+        assert ip_checksum(packet[:20]) == 0, "bad IPv4 checksum"
+        assert packet[12:16] == peer and packet[9:10] == struct.pack("B", proto)
+        assert struct.unpack("!HH", packet[20:24]) == (40000, 5001)
+        assert orig_len == 20 + (8 if proto == IPPROTO_UDP else 20) + length
+        if proto == IPPROTO_UDP:
+            assert struct.unpack("!i", packet[28:32])[0] == 7, "datagram id not kept"
+        else:
+            seqs.append(struct.unpack("!I", packet[24:28])[0])
+        off += RECORD.size + incl_len
+    assert seqs == [0, 16384], seqs
+    print("self-check ok")
+
+
+def main():
+    parser = argparse.ArgumentParser(description="convert an iperf capture dump to a pcap file for Wireshark")
+    parser.add_argument("capture", nargs="?", help="serial log containing a `capture dump`")
+    parser.add_argument("--serial", help="serial port of the device, to run `capture dump` on it")
+    parser.add_argument("--baud", type=int, default=115200)
+    parser.add_argument("--timeout", type=float, default=60, help="seconds to wait for the dump on --serial")
+    parser.add_argument("--device", default="192.0.2.1", help="device address to put in the IP headers")
+    parser.add_argument("--port", type=int, default=5001, help="iperf server port to put in the UDP/TCP headers")
+    parser.add_argument("-o", "--output", help="pcap file to write (default: stdout)")
+    parser.add_argument("--self-check", action="store_true", help="test the converter and exit")
+    args = parser.parse_args()
+
+    if args.self_check:
+        self_check()
+        return
+    if args.serial:
+        data = read_serial(args.serial, args.baud, args.timeout)
+    elif args.capture:
+        with open(args.capture, "rb") as f:
+            data = f.read()
+    else:
+        parser.error("give a capture file or --serial")
+
+    pcap, count = to_raw_pcap(find_dump(data), args.device, args.port)
+    if args.output:
+        with open(args.output, "wb") as f:
+            f.write(pcap)
+    else:
+        getattr(sys.stdout, "buffer", sys.stdout).write(pcap)
+    print("{} packets".format(count), file=sys.stderr)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,315 @@
+"""
+Host side of the iperf network control channel (main/cmd_remote.c).
+
+Start the channel on the device with the `remote` console command (or put it in the autorun command-list), then::
+
+    python iperf_remote.py 192.168.1.50 -c 192.168.1.10 -u -t 10
+    python iperf_remote.py 192.168.1.50 -s
+
+The run is started with one frame and its binary result comes back as soon as it finishes, so a script can drive many
+devices without waiting on their consoles. `IperfRemote` can also be imported and used directly.
+
+`--stand-in` runs a fake device on the host instead, speaking the same protocol and returning made-up results, to try
+scripts (and this module) without hardware::
+
+    python iperf_remote.py --stand-in -p 5003 &
+    python iperf_remote.py 127.0.0.1 -c 10.0.0.1 -t 2
+"""
+from __future__ import division
+from __future__ import print_function
+import argparse
+import socket
+import struct
+import threading
+import time
+
+DEFAULT_PORT = 5003
+IPERF_DEFAULT_PORT = 5001
+
+# keep in step with main/cmd_remote.c and components/iperf/iperf.h
+OP_START = 1
+OP_STOP = 2
+OP_RESULT = 3
+
+STATUS_OK = 0
+STATUS_BUSY = 1
+STATUS_INVALID = 2
+STATUS_NONE = 3
+STATUS_FAIL = 4
+STATUS_NAMES = {STATUS_OK: "ok", STATUS_BUSY: "busy", STATUS_INVALID: "invalid", STATUS_NONE: "no result",
+                STATUS_FAIL: "failed"}
+
+FLAG_CLIENT = 1
+FLAG_SERVER = 1 << 1
+FLAG_TCP = 1 << 2
+FLAG_UDP = 1 << 3
+FLAG_AUTO = 1 << 4
+FLAG_ENHANCED = 1 << 5
+FLAG_SELF = 1 << 6
+FLAG_VERIFY = 1 << 7
+FLAG_SINGLE_TASK = 1 << 8
+FLAG_ISOCHRONOUS = 1 << 9
+# what a START may ask for; the device refuses the rest (--self, flash, TLS, --pps-sweep)
+REMOTE_FLAGS = (FLAG_CLIENT | FLAG_SERVER | FLAG_TCP | FLAG_UDP | FLAG_AUTO | FLAG_ENHANCED | FLAG_VERIFY |
+                FLAG_SINGLE_TASK | FLAG_ISOCHRONOUS)
+
+HDR = struct.Struct(">BBH")
+CFG = struct.Struct(">IBBH16sIIII")
+RESULT = struct.Struct(">IIIIIIIII")
+
+
+class RemoteError(Exception):
+    def __init__(self, op, status):
+        super(RemoteError, self).__init__("op {} failed: {}".format(op, STATUS_NAMES.get(status, status)))
+        self.status = status
+
+
+class IperfResult(object):
+    FIELDS = ["flag", "duration_ms", "bytes", "bandwidth_kbps", "packets", "lost", "reordered", "corrupted"]
+
+    def __init__(self, payload):
+        values = RESULT.unpack(payload)
+        self.flag, self.duration_ms = values[0:2]
+        self.bytes = (values[2] << 32) | values[3]
+        self.bandwidth_kbps, self.packets, self.lost, self.reordered, self.corrupted = values[4:]
+
+    def pack(self):
+        return RESULT.pack(self.flag, self.duration_ms, self.bytes >> 32, self.bytes & 0xFFFFFFFF,
+                           self.bandwidth_kbps, self.packets, self.lost, self.reordered, self.corrupted)
+
+    @property
+    def mbps(self):
+        return self.bandwidth_kbps / 1000
+
+    def as_dict(self):
+        return dict((name, getattr(self, name)) for name in self.FIELDS)
+
+    def __str__(self):
+        text = "{:.2f} Mbits/sec, {} bytes in {} ms".format(self.mbps, self.bytes, self.duration_ms)
+        if self.flag & FLAG_UDP and self.flag & FLAG_SERVER:
+            total = self.packets + self.lost
+            text += ", {}/{} ({:.2f}%) lost, {} out of order".format(
+                self.lost, total, self.lost * 100 / total if total else 0, self.reordered)
+        if self.flag & FLAG_VERIFY and self.flag & FLAG_SERVER:
+            text += ", {} bytes corrupted".format(self.corrupted)
+        return text
+
+
+def pack_cfg(flag, addr=None, port=0, interval=0, time_=0, omit=0, tolerance=0, ttl=0):
+    """ build a START payload; zeroes take the device's defaults """
+    if addr and ":" in addr:
+        family, raw = 6, socket.inet_pton(socket.AF_INET6, addr)
+    elif addr:
+        family, raw = 4, socket.inet_aton(addr).ljust(16, b"\0")
+    else:
+        family, raw = 4, b"\0" * 16
+    return CFG.pack(flag, family, ttl, port, raw, interval, time_, omit, tolerance)
+
+
+def _recv_all(sock, length):
+    data = b""
+    while len(data) < length:
+        chunk = sock.recv(length - len(data))
+        if not chunk:
+            raise EOFError("connection closed")
+        data += chunk
+    return data
+
+
+def recv_frame(sock):
+    op, status, length = HDR.unpack(_recv_all(sock, HDR.size))
+    return op, status, _recv_all(sock, length) if length else b""
+
+
+def send_frame(sock, op, payload=b"", status=0):
+    sock.sendall(HDR.pack(op, status, len(payload)) + payload)
+
+
+class IperfRemote(object):
+    """ one device's control channel """
+
+    def __init__(self, host, port=DEFAULT_PORT, timeout=10):
+        self.sock = socket.create_connection((host, port), timeout)
+        self.sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+
+    def close(self):
+        self.sock.close()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args):
+        self.close()
+
+    def _request(self, op, payload=b""):
+        send_frame(self.sock, op, payload)
+        reply_op, status, payload = recv_frame(self.sock)
+        if reply_op != op or status != STATUS_OK:
+            raise RemoteError(op, status)
+        return payload
+
+    def start(self, flag, **kwargs):
+        """ start a run (see pack_cfg for the arguments); call wait() for its result """
+        self._request(OP_START, pack_cfg(flag, **kwargs))
+
+    def wait(self, timeout=None):
+        """ block until the running test finishes and return its IperfResult """
+        self.sock.settimeout(timeout)
+        op, status, payload = recv_frame(self.sock)
+        if op != OP_RESULT or status != STATUS_OK:
+            raise RemoteError(op, status)
+        return IperfResult(payload)
+
+    def run(self, flag, timeout=None, **kwargs):
+        self.start(flag, **kwargs)
+        return self.wait(timeout)
+
+    def stop(self):
+        self._request(OP_STOP)
+
+    def result(self):
+        """ fetch the result of the last run """
+        return IperfResult(self._request(OP_RESULT))
+
+
+class StandIn(object):
+    """
+    Fake device speaking the control protocol, for trying host scripts without hardware. A run "takes" its configured
+    time scaled by `speedup` and reports `mbps` throughput, with a made-up 0.1% loss for UDP servers.
+    """
+
+    def __init__(self, port=DEFAULT_PORT, mbps=20.0, speedup=1.0, host="127.0.0.1"):
+        self.mbps = mbps
+        self.speedup = speedup
+        self.listener = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        self.listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        self.listener.bind((host, port))
+        self.listener.listen(1)
+        self.port = self.listener.getsockname()[1]
+        self.last = None
+        self.end_time = None
+        self.flag = 0
+        self.duration_ms = 0
+
+    def _finish(self):
+        result = IperfResult(b"\0" * RESULT.size)
+        result.flag = self.flag
+        result.duration_ms = self.duration_ms
+        result.bandwidth_kbps = int(self.mbps * 1000)
+        result.bytes = int(self.mbps * 1e6 / 8 * self.duration_ms / 1000)
+        if self.flag & FLAG_UDP and self.flag & FLAG_SERVER:
+            result.packets = result.bytes // 1470
+            result.lost = result.packets // 1000
+        self.last = result
+        self.end_time = None
+        return result
+
+    def _start(self, payload):
+        if self.end_time is not None:
+            return STATUS_BUSY
+        flag, family, _, _, _, interval, time_, _, _ = CFG.unpack(payload)
+        if (flag & ~REMOTE_FLAGS or bool(flag & FLAG_CLIENT) == bool(flag & FLAG_SERVER) or
+                bool(flag & FLAG_TCP) == bool(flag & FLAG_UDP) or family not in (4, 6)):
+            return STATUS_INVALID
+        self.flag = flag
+        self.duration_ms = (time_ or 12) * 1000
+        self.end_time = time.time() + self.duration_ms / 1000 / self.speedup
+        return STATUS_OK
+
+    def serve_one(self):
+        conn, _ = self.listener.accept()
+        pending = False
+        try:
+            while True:
+                if pending and time.time() >= self.end_time:
+                    pending = False
+                    send_frame(conn, OP_RESULT, self._finish().pack())
+                conn.settimeout(0.02 if pending else None)
+                try:
+                    op, _, payload = recv_frame(conn)
+                except socket.timeout:
+                    continue
+                if op == OP_START and len(payload) == CFG.size:
+                    status = self._start(payload)
+                    if status == STATUS_OK:
+                        pending = True
+                    send_frame(conn, OP_START, status=status)
+                elif op == OP_STOP:
+                    if self.end_time is not None:
+                        self.duration_ms -= int(max(0, self.end_time - time.time()) * 1000 * self.speedup)
+                        self.end_time = time.time()
+                    send_frame(conn, OP_STOP)
+                elif op == OP_RESULT:
+                    if self.end_time is not None:
+                        send_frame(conn, OP_RESULT, status=STATUS_BUSY)
+                    elif self.last is None:
+                        send_frame(conn, OP_RESULT, status=STATUS_NONE)
+                    else:
+                        send_frame(conn, OP_RESULT, self.last.pack())
+                else:
+                    send_frame(conn, op, status=STATUS_INVALID)
+        except (EOFError, socket.error):
+            pass
+        finally:
+            conn.close()
+
+    def serve_forever(self):
+        while True:
+            self.serve_one()
+
+    def start_thread(self):
+        thread = threading.Thread(target=self.serve_forever)
+        thread.daemon = True
+        thread.start()
+        return thread
+
+
+def main():
+    parser = argparse.ArgumentParser(description="drive iperf on a device over its network control channel")
+    parser.add_argument("device", nargs="?", help="device address")
+    parser.add_argument("-P", "--remote-port", type=int, default=DEFAULT_PORT, help="control channel port")
+    parser.add_argument("-c", "--client", metavar="IP", help="run the device as client, sending to IP")
+    parser.add_argument("-s", "--server", action="store_true", help="run the device as server")
+    parser.add_argument("-u", "--udp", action="store_true")
+    parser.add_argument("-p", "--port", type=int, default=0, help="iperf port")
+    parser.add_argument("-B", "--bind", metavar="GROUP", help="UDP server: multicast/broadcast group")
+    parser.add_argument("-i", "--interval", type=int, default=0)
+    parser.add_argument("-t", "--time", type=int, default=0)
+    parser.add_argument("-O", "--omit", type=int, default=0)
+    parser.add_argument("--auto", action="store_true")
+    parser.add_argument("--verify", action="store_true")
+    parser.add_argument("--single-task", action="store_true")
+    parser.add_argument("--isochronous", action="store_true", help="video-like frames, at the device's default rate")
+    parser.add_argument("--result", action="store_true", help="only fetch the result of the last run")
+    parser.add_argument("-a", "--abort", action="store_true", help="stop the running test")
+    parser.add_argument("--stand-in", action="store_true", help="run a fake device on this host instead")
+    args = parser.parse_args()
+
+    if args.stand_in:
+        stand_in = StandIn(args.remote_port)
+        print("stand-in device listening on port {}".format(stand_in.port))
+        stand_in.serve_forever()
+        return
+
+    if not args.device:
+        parser.error("device address is required")
+
+    with IperfRemote(args.device, args.remote_port) as remote:
+        if args.abort:
+            remote.stop()
+            return
+        if args.result:
+            print(remote.result())
+            return
+        if bool(args.client) == args.server:
+            parser.error("should specify client or server mode")
+        flag = (FLAG_CLIENT if args.client else FLAG_SERVER) | (FLAG_UDP if args.udp else FLAG_TCP)
+        flag |= (FLAG_AUTO if args.auto else 0) | (FLAG_VERIFY if args.verify else 0)
+        flag |= FLAG_SINGLE_TASK if args.single_task else 0
+        flag |= FLAG_ISOCHRONOUS if args.isochronous else 0
+        print(remote.run(flag, addr=args.client or args.bind, port=args.port, interval=args.interval,
+                         time_=args.time, omit=args.omit))
+
+
+if __name__ == "__main__":
+    main()
@@ -18,16 +18,39 @@ The test env Example_ShieldBox do need the following config::
     iperf: "/dev/ttyUSB1"
     apc_ip: "192.168.1.88"
     pc_nic: "eth0"
+
+The multi-DUT test env Example_ShieldBox_Multi lists its DUTs; the ones on the same AP, or with the same
+`air_group`, take turns, the others are tested at the same time::
+
+  Example_ShieldBox_Multi:
+    dut_list:
+      - name: "iperf"
+        ap_ssid: "ssid"
+        ap_password: "password"
+      - name: "iperf2"
+        ap_ssid: "ssid2"
+        ap_password: "password"
+        air_group: "channel6"
+    pc_nic: "eth0"
+
+Every result is also appended to results.jsonl in the log folder as soon as it is measured, so nothing is lost if a
+run dies half way, and the reports can be made again from it without rerunning anything (with `TEST_FW_PATH` set,
+as for the tests themselves)::
+
+  python iperf_test.py --replay results.jsonl <output folder>
 """
 from __future__ import division
 from __future__ import unicode_literals
+from __future__ import print_function
 from builtins import str
 from builtins import range
 from builtins import object
 import re
 import os
 import sys
+import json
 import time
+import threading
 import subprocess
 
 try:
@@ -48,10 +71,12 @@ from Utility import (Attenuator, PowerControl, LineChart)
 
 try:
     from test_report import (ThroughputForConfigsReport, ThroughputVsRssiReport)
+    from iperf_netem import (Impairment, UdpRelay)
 except ImportError:
     # add current folder to system path for importing test_report
     sys.path.append(os.path.dirname(__file__))
     from test_report import (ThroughputForConfigsReport, ThroughputVsRssiReport)
+    from iperf_netem import (Impairment, UdpRelay)
 
 # configurations
 TEST_TIME = TEST_TIMEOUT = 60
@@ -61,11 +86,21 @@ SCAN_RETRY_COUNT = 3
 RETRY_COUNT_FOR_BEST_PERFORMANCE = 2
 ATTEN_VALUE_LIST = range(0, 60, 2)
 
+# impairment test: injected through iperf_netem.py, and how close the DUT's report has to come
+IMPAIRMENT_TEST_TIME = 20
+IMPAIRMENT_LOSS = 5
+IMPAIRMENT_LOSS_TOLERANCE = 1.5
+IMPAIRMENT_RATE_MBPS = 5
+IMPAIRMENT_RATE_TOLERANCE = 0.1
+IMPAIRMENT_RELAY_PORT = 5101
+
 # constants
 FAILED_TO_SCAN_RSSI = -97
 INVALID_HEAP_SIZE = 0xFFFFFFFF
 
 PC_IPERF_TEMP_LOG_FILE = ".tmp_iperf.log"
+RESULT_STORE_FILE = "results.jsonl"
+MULTI_DUT_BASE_PORT = 5201  # DUT n of the multi-DUT test uses this port + n, so the PC servers don't collide
 CONFIG_NAME_PATTERN = re.compile(r"sdkconfig\.defaults\.(.+)")
 
 # We need to auto compare the difference between adjacent configs (01 -> 00, 02 -> 01, ...) and put them to reports.
@@ -287,11 +322,77 @@ class TestResult(object):
         return ret
 
 
+def new_test_results(config_name):
+    """ an empty TestResult for every case """
+    return {
+        "tcp_tx": TestResult("tcp", "tx", config_name),
+        "tcp_rx": TestResult("tcp", "rx", config_name),
+        "udp_tx": TestResult("udp", "tx", config_name),
+        "udp_rx": TestResult("udp", "rx", config_name),
+    }
+
+
+class ResultStore(object):
+    """
+    append-only JSON lines file of every measured result, with the raw iperf output it was parsed from.
+
+    Each record is written and synced as it arrives, so a crash loses at most the case that was running, and
+    `load_test_results()` rebuilds the TestResult objects from it exactly as the run made them.
+    """
+
+    def __init__(self, path):
+        self.path = path
+        self.lock = threading.Lock()
+
+    def append(self, record):
+        line = json.dumps(record, sort_keys=True) + "\n"
+        with self.lock:
+            with open(self.path, "a") as f:
+                f.write(line)
+                f.flush()
+                os.fsync(f.fileno())
+
+    @staticmethod
+    def read(path):
+        """ yield the records of a store file; a line cut short by a crash is skipped """
+        with open(path, "r") as f:
+            for line in f:
+                try:
+                    yield json.loads(line)
+                except ValueError:
+                    continue
+
+
+def load_test_results(path, dut=None):
+    """
+    rebuild test results from a ResultStore file
+
+    :param path: store file
+    :param dut: only the results of this DUT, None for all of them
+    :return: {config_name: {case: TestResult}}
+    """
+    results = dict()
+    for record in ResultStore.read(path):
+        if dut is not None and record["dut"] != dut:
+            continue
+        if record["config"] not in results:
+            results[record["config"]] = new_test_results(record["config"])
+        results[record["config"]][record["case"]].add_result(record["raw"], record["ap"], record["att"],
+                                                             record["rssi"], record["heap"])
+    return results
+
+
 class IperfTestUtility(object):
     """ iperf test implementation """
 
     def __init__(self, dut, config_name, ap_ssid, ap_password,
-                 pc_nic_ip, pc_iperf_log_file, test_result=None):
+                 pc_nic_ip, pc_iperf_log_file, test_result=None,
+                 result_store=None, pc_iperf_port=None, kill_pc_iperf=True):
+        """
+        :param result_store: ResultStore to append every result to, optional
+        :param pc_iperf_port: iperf port for this DUT's runs, when several DUTs share the PC; None for the default
+        :param kill_pc_iperf: kill any iperf on the PC at setup, not when other DUTs' runs may be using it
+        """
         self.config_name = config_name
         self.dut = dut
 
@@ -299,6 +400,15 @@ class IperfTestUtility(object):
         self.ap_ssid = ap_ssid
         self.ap_password = ap_password
         self.pc_nic_ip = pc_nic_ip
+        self.result_store = result_store
+        self.kill_pc_iperf = kill_pc_iperf
+        if pc_iperf_port:
+            self.port_args = ["-p", str(pc_iperf_port)]
+            self.pc_iperf_temp_log_file = ".tmp_iperf_{}.log".format(pc_iperf_port)
+        else:
+            self.port_args = []
+            self.pc_iperf_temp_log_file = PC_IPERF_TEMP_LOG_FILE
+        self.dut_port_opt = "".join(" " + arg for arg in self.port_args)
 
         if test_result:
             self.test_result = test_result
@@ -319,10 +429,11 @@ class IperfTestUtility(object):
         3. scan to get AP RSSI
         4. connect to AP
         """
-        try:
-            subprocess.check_output("sudo killall iperf 2>&1 > /dev/null", shell=True)
-        except subprocess.CalledProcessError:
-            pass
+        if self.kill_pc_iperf:
+            try:
+                subprocess.check_output("sudo killall iperf 2>&1 > /dev/null", shell=True)
+            except subprocess.CalledProcessError:
+                pass
         self.dut.write("restart")
         self.dut.expect("esp32>")
         self.dut.write("scan {}".format(self.ap_ssid))
@@ -340,7 +451,21 @@ class IperfTestUtility(object):
         return dut_ip, rssi
 
     def _save_test_result(self, test_case, raw_data, att, rssi, heap_size):
-        return self.test_result[test_case].add_result(raw_data, self.ap_ssid, att, rssi, heap_size)
+        throughput = self.test_result[test_case].add_result(raw_data, self.ap_ssid, att, rssi, heap_size)
+        if self.result_store:
+            self.result_store.append({
+                "time": time.time(),
+                "dut": getattr(self.dut, "name", ""),
+                "config": self.config_name,
+                "case": test_case,
+                "ap": self.ap_ssid,
+                "att": att,
+                "rssi": rssi,
+                "heap": int(heap_size),
+                "throughput": throughput,
+                "raw": raw_data,
+            })
+        return throughput
 
     def _test_once(self, proto, direction):
         """ do measure once for one type """
@@ -352,17 +477,18 @@ class IperfTestUtility(object):
 
         # run iperf test
         if direction == "tx":
-            with open(PC_IPERF_TEMP_LOG_FILE, "w") as f:
+            with open(self.pc_iperf_temp_log_file, "w") as f:
                 if proto == "tcp":
                     process = subprocess.Popen(["iperf", "-s", "-B", self.pc_nic_ip,
-                                                "-t", str(TEST_TIME), "-i", "1", "-f", "m"],
+                                                "-t", str(TEST_TIME), "-i", "1", "-f", "m"] + self.port_args,
                                                stdout=f, stderr=f)
-                    self.dut.write("iperf -c {} -i 1 -t {}".format(self.pc_nic_ip, TEST_TIME))
+                    self.dut.write("iperf -c {} -i 1 -t {}{}".format(self.pc_nic_ip, TEST_TIME, self.dut_port_opt))
                 else:
                     process = subprocess.Popen(["iperf", "-s", "-u", "-B", self.pc_nic_ip,
-                                                "-t", str(TEST_TIME), "-i", "1", "-f", "m"],
+                                                "-t", str(TEST_TIME), "-i", "1", "-f", "m"] + self.port_args,
                                                stdout=f, stderr=f)
-                    self.dut.write("iperf -c {} -u -i 1 -t {}".format(self.pc_nic_ip, TEST_TIME))
+                    self.dut.write("iperf -c {} -u -i 1 -t {}{}".format(self.pc_nic_ip, TEST_TIME,
+                                                                        self.dut_port_opt))
 
                 for _ in range(TEST_TIMEOUT):
                     if process.poll() is not None:
@@ -371,19 +497,19 @@ class IperfTestUtility(object):
                 else:
                     process.terminate()
 
-            with open(PC_IPERF_TEMP_LOG_FILE, "r") as f:
+            with open(self.pc_iperf_temp_log_file, "r") as f:
                 pc_raw_data = server_raw_data = f.read()
         else:
-            with open(PC_IPERF_TEMP_LOG_FILE, "w") as f:
+            with open(self.pc_iperf_temp_log_file, "w") as f:
                 if proto == "tcp":
-                    self.dut.write("iperf -s -i 1 -t {}".format(TEST_TIME))
+                    self.dut.write("iperf -s -i 1 -t {}{}".format(TEST_TIME, self.dut_port_opt))
                     process = subprocess.Popen(["iperf", "-c", dut_ip,
-                                                "-t", str(TEST_TIME), "-f", "m"],
+                                                "-t", str(TEST_TIME), "-f", "m"] + self.port_args,
                                                stdout=f, stderr=f)
                 else:
-                    self.dut.write("iperf -s -u -i 1 -t {}".format(TEST_TIME))
+                    self.dut.write("iperf -s -u -i 1 -t {}{}".format(TEST_TIME, self.dut_port_opt))
                     process = subprocess.Popen(["iperf", "-c", dut_ip, "-u", "-b", "100M",
-                                                "-t", str(TEST_TIME), "-f", "m"],
+                                                "-t", str(TEST_TIME), "-f", "m"] + self.port_args,
                                                stdout=f, stderr=f)
 
                 for _ in range(TEST_TIMEOUT):
@@ -394,16 +520,16 @@ class IperfTestUtility(object):
                     process.terminate()
 
             server_raw_data = self.dut.read()
-            with open(PC_IPERF_TEMP_LOG_FILE, "r") as f:
+            with open(self.pc_iperf_temp_log_file, "r") as f:
                 pc_raw_data = f.read()
 
-        # save PC iperf logs to console
+        # save PC iperf logs to console, in one write as other DUTs' runs may be logging too
         with open(self.pc_iperf_log_file, "a+") as f:
             f.write("## [{}] `{}`\r\n##### {}"
                     .format(self.config_name,
                             "{}_{}".format(proto, direction),
-                            time.strftime("%m-%d %H:%M:%S", time.localtime(time.time()))))
-            f.write('\r\n```\r\n\r\n' + pc_raw_data + '\r\n```\r\n')
+                            time.strftime("%m-%d %H:%M:%S", time.localtime(time.time())))
+                    + '\r\n```\r\n\r\n' + pc_raw_data + '\r\n```\r\n')
         self.dut.write("heap")
         heap_size = self.dut.expect(re.compile(r"min heap size: (\d+)\D"))[0]
 
@@ -465,6 +591,53 @@ class IperfTestUtility(object):
         return ret
 
 
+class MultiDutScheduler(object):
+    """
+    run the cases of several DUTs at the same time.
+
+    DUTs in the same air group (by default, on the same AP) would disturb each other's throughput, so they take turns
+    a case at a time; DUTs in different groups are tested side by side. Give each DUT's IperfTestUtility its own
+    pc_iperf_port and kill_pc_iperf=False, so their PC iperf processes don't collide.
+    """
+    ALL_CASES = [("tcp", "tx"), ("tcp", "rx"), ("udp", "tx"), ("udp", "rx")]
+
+    def __init__(self, test_utilities, air_groups=None):
+        """
+        :param test_utilities: one IperfTestUtility per DUT
+        :param air_groups: {dut name: group name}; DUTs not in it are grouped by AP
+        """
+        self.test_utilities = test_utilities
+        self.air_locks = dict()
+        self.lock_for = dict()
+        air_groups = air_groups or dict()
+        for test_utility in test_utilities:
+            group = air_groups.get(test_utility.dut.name, test_utility.ap_ssid)
+            if group not in self.air_locks:
+                self.air_locks[group] = threading.Lock()
+            self.lock_for[test_utility] = self.air_locks[group]
+
+    def _run_cases(self, test_utility, cases, atten_val):
+        for proto, direction in cases:
+            with self.lock_for[test_utility]:
+                test_utility.run_test(proto, direction, atten_val)
+
+    def run_all_cases(self, atten_val, cases=None):
+        """
+        run the cases (default: all of them) on every DUT, and return once all are done
+
+        :param atten_val: attenuate value
+        :param cases: list of (proto, direction)
+        """
+        threads = []
+        for test_utility in self.test_utilities:
+            thread = threading.Thread(target=self._run_cases,
+                                      args=(test_utility, cases or self.ALL_CASES, atten_val))
+            thread.start()
+            threads.append(thread)
+        for thread in threads:
+            thread.join()
+
+
 def build_iperf_with_config(config_name):
     """
     we need to build iperf example with different configurations.
@@ -505,6 +678,7 @@ def test_wifi_throughput_with_different_configs(env, extra_data):
     }
 
     config_names_raw = subprocess.check_output(["ls", os.path.dirname(os.path.abspath(__file__))])
+    result_store = ResultStore(os.path.join(env.log_path, RESULT_STORE_FILE))
 
     test_result = dict()
     sdkconfig_files = dict()
@@ -529,7 +703,8 @@ def test_wifi_throughput_with_different_configs(env, extra_data):
         }
 
         test_utility = IperfTestUtility(dut, config_name, ap_info["ssid"],
-                                        ap_info["password"], pc_nic_ip, pc_iperf_log_file, test_result[config_name])
+                                        ap_info["password"], pc_nic_ip, pc_iperf_log_file, test_result[config_name],
+                                        result_store=result_store)
 
         for _ in range(RETRY_COUNT_FOR_BEST_PERFORMANCE):
             test_utility.run_all_cases(0)
@@ -579,9 +754,10 @@ def test_wifi_throughput_vs_rssi(env, extra_data):
     dut.expect("esp32>")
 
     # 3. run test for each required att value
+    result_store = ResultStore(os.path.join(env.log_path, RESULT_STORE_FILE))
     for ap_info in ap_list:
         test_utility = IperfTestUtility(dut, BEST_PERFORMANCE_CONFIG, ap_info["ssid"], ap_info["password"],
-                                        pc_nic_ip, pc_iperf_log_file, test_result)
+                                        pc_nic_ip, pc_iperf_log_file, test_result, result_store=result_store)
 
         PowerControl.Control.control_rest(apc_ip, ap_info["outlet"], "OFF")
         PowerControl.Control.control(apc_ip, {ap_info["outlet"]: "ON"})
@@ -636,7 +812,8 @@ def test_wifi_throughput_basic(env, extra_data):
     }
 
     test_utility = IperfTestUtility(dut, BEST_PERFORMANCE_CONFIG, ap_info["ssid"],
-                                    ap_info["password"], pc_nic_ip, pc_iperf_log_file, test_result)
+                                    ap_info["password"], pc_nic_ip, pc_iperf_log_file, test_result,
+                                    result_store=ResultStore(os.path.join(env.log_path, RESULT_STORE_FILE)))
 
     # 4. run test for TCP Tx, Rx and UDP Tx, Rx
     for _ in range(RETRY_COUNT_FOR_BEST_PERFORMANCE):
@@ -654,7 +831,134 @@ def test_wifi_throughput_basic(env, extra_data):
     env.close_dut("iperf")
 
 
+@IDF.idf_example_test(env_tag="Example_ShieldBox_Basic")
+def test_wifi_udp_impairment(env, extra_data):
+    """
+    steps: |
+      1. relay UDP from the PC to the DUT through iperf_netem, with known loss and a rate cap
+      2. check the loss and throughput the DUT reports against what was injected
+    """
+    ap_info = {
+        "ssid": env.get_variable("ap_ssid"),
+        "password": env.get_variable("ap_password"),
+    }
+    pc_nic_ip = env.get_pc_nic_info("pc_nic", "ipv4")["addr"]
+    pc_iperf_log_file = os.path.join(env.log_path, "pc_iperf_log.md")
+
+    # 1. build iperf with best config
+    build_iperf_with_config(BEST_PERFORMANCE_CONFIG)
+
+    # 2. get DUT and connect it
+    dut = env.get_dut("iperf", "examples/wifi/iperf")
+    dut.start_app()
+    dut.expect("esp32>")
+    test_utility = IperfTestUtility(dut, BEST_PERFORMANCE_CONFIG, ap_info["ssid"],
+                                    ap_info["password"], pc_nic_ip, pc_iperf_log_file)
+    dut_ip, _ = test_utility.setup()
+
+    # 3. offer twice the capped rate, so the cap is what limits throughput
+    impairment = Impairment(loss=IMPAIRMENT_LOSS, rate_bps=IMPAIRMENT_RATE_MBPS * 1e6, seed=1)
+    relay = UdpRelay(("127.0.0.1", IMPAIRMENT_RELAY_PORT), (dut_ip, 5001), impairment)
+    relay.start_thread()
+    dut.write("iperf -s -u -i 1 -t {}".format(IMPAIRMENT_TEST_TIME))
+    subprocess.check_output(["iperf", "-c", "127.0.0.1", "-p", str(IMPAIRMENT_RELAY_PORT), "-u",
+                             "-b", "{}M".format(IMPAIRMENT_RATE_MBPS * 2), "-t", str(IMPAIRMENT_TEST_TIME)])
+    summary = re.compile(r"\s0-\s*{}\s+sec\s+([\d.]+)\s+Mbits/sec\s+\d+/\d+\s+\(([\d.]+)%\)\s+lost"
+                         .format(IMPAIRMENT_TEST_TIME))
+    mbps, loss = [float(x) for x in dut.expect(summary, timeout=IMPAIRMENT_TEST_TIME + 10)]
+    relay.stopped = True
+    env.close_dut("iperf")
+
+    # 4. the relay's queue overflows on top of the random loss; only the datagrams that made it count
+    overflow = impairment.overflow * 100 / max(1, impairment.dropped + impairment.overflow + relay.relayed)
+    Utility.console_log("impairment: loss {:.2f}% (injected {}% + {:.2f}% overflow), {:.2f} Mbits/sec (cap {})"
+                        .format(loss, IMPAIRMENT_LOSS, overflow, mbps, IMPAIRMENT_RATE_MBPS))
+    assert abs(loss - IMPAIRMENT_LOSS - overflow) <= IMPAIRMENT_LOSS_TOLERANCE
+    assert abs(mbps - IMPAIRMENT_RATE_MBPS) <= IMPAIRMENT_RATE_MBPS * IMPAIRMENT_RATE_TOLERANCE
+
+
+@IDF.idf_example_test(env_tag="Example_ShieldBox_Multi", category="stress")
+def test_wifi_throughput_multi_dut(env, extra_data):
+    """
+    steps: |
+      1. build iperf with best config and start it on every DUT in dut_list
+      2. test TCP tx rx and UDP tx rx throughput on all of them, DUTs in different air groups at the same time
+      3. log each DUT's best throughput
+    """
+    pc_nic_ip = env.get_pc_nic_info("pc_nic", "ipv4")["addr"]
+    pc_iperf_log_file = os.path.join(env.log_path, "pc_iperf_log.md")
+    dut_list = env.get_variable("dut_list")
+    result_store = ResultStore(os.path.join(env.log_path, RESULT_STORE_FILE))
+
+    # 1. build iperf with best config, and get the DUTs
+    build_iperf_with_config(BEST_PERFORMANCE_CONFIG)
+
+    test_results = dict()
+    test_utilities = []
+    for i, dut_info in enumerate(dut_list):
+        dut = env.get_dut(dut_info["name"], "examples/wifi/iperf")
+        dut.start_app()
+        dut.expect("esp32>")
+        test_results[dut_info["name"]] = new_test_results(BEST_PERFORMANCE_CONFIG)
+        test_utilities.append(IperfTestUtility(dut, BEST_PERFORMANCE_CONFIG, dut_info["ap_ssid"],
+                                               dut_info["ap_password"], pc_nic_ip, pc_iperf_log_file,
+                                               test_results[dut_info["name"]], result_store=result_store,
+                                               pc_iperf_port=MULTI_DUT_BASE_PORT + i, kill_pc_iperf=False))
+
+    # 2. run the cases on all DUTs
+    scheduler = MultiDutScheduler(test_utilities, {dut_info["name"]: dut_info["air_group"]
+                                                   for dut_info in dut_list if "air_group" in dut_info})
+    for _ in range(RETRY_COUNT_FOR_BEST_PERFORMANCE):
+        scheduler.run_all_cases(0)
+
+    # 3. log performance
+    for dut_name in test_results:
+        for throughput_type in test_results[dut_name]:
+            summary = str(test_results[dut_name][throughput_type])
+            if summary:
+                Utility.console_log("[{}] {}".format(dut_name, summary), color="orange")
+            IDF.log_performance("{}_{}_throughput".format(dut_name, throughput_type),
+                                "{:.02f} Mbps".format(test_results[dut_name][throughput_type].get_best_throughput()))
+
+    for dut_info in dut_list:
+        env.close_dut(dut_info["name"])
+
+
+def regenerate_reports(store_path, output_path):
+    """
+    make the reports again from a ResultStore file, without rerunning the tests
+
+    :param store_path: results.jsonl of an earlier run
+    :param output_path: folder for the reports
+    """
+    test_result = load_test_results(store_path)
+    if not test_result:
+        raise AssertionError("no results in {}".format(store_path))
+    ap_ssids = set(record["ap"] for record in ResultStore.read(store_path))
+    example_path = os.path.dirname(os.path.abspath(__file__))
+    sdkconfig_files = dict((config_name, os.path.join(example_path, "sdkconfig.{}".format(config_name)))
+                           for config_name in test_result)
+
+    if all(os.path.exists(sdkconfig_files[config_name]) for config_name in test_result) and len(ap_ssids) == 1:
+        report = ThroughputForConfigsReport(os.path.join(output_path, "ThroughputForConfigsReport"),
+                                            ap_ssids.pop(), test_result, sdkconfig_files)
+        report.generate_report()
+    for config_name in test_result:
+        report = ThroughputVsRssiReport(os.path.join(output_path, "ThroughputVsRssiReport_{}".format(config_name)),
+                                        test_result[config_name])
+        report.generate_report()
+        for result_type in test_result[config_name]:
+            summary = str(test_result[config_name][result_type])
+            if summary:
+                print(summary)
+
+
 if __name__ == '__main__':
+    if len(sys.argv) == 4 and sys.argv[1] == "--replay":
+        regenerate_reports(sys.argv[2], sys.argv[3])
+        sys.exit(0)
     test_wifi_throughput_basic(env_config_file="EnvConfig.yml")
     test_wifi_throughput_with_different_configs(env_config_file="EnvConfig.yml")
     test_wifi_throughput_vs_rssi(env_config_file="EnvConfig.yml")
+    test_wifi_udp_impairment(env_config_file="EnvConfig.yml")
+    test_wifi_throughput_multi_dut(env_config_file="EnvConfig.yml")
@@ -0,0 +1,120 @@
+"""
+Host end for the device's `iperf --tls` (build option CONFIG_IPERF_TLS): a TLS server that discards what it receives,
+or a TLS client that sends for a while, reporting the throughput, the negotiated ciphersuite and the handshake time.
+Plain iperf2 doesn't speak TLS::
+
+    python iperf_tls.py -s                    # device: iperf -c <host> --tls
+    python iperf_tls.py -c <device> -t 10     # device: iperf -s --tls
+
+The server uses the device's test certificate (components/iperf/certs); neither end checks the other's, the point is
+the cost of the session, not its security.
+"""
+from __future__ import division
+from __future__ import print_function
+import argparse
+import os
+import socket
+import ssl
+import threading
+import time
+
+DEFAULT_PORT = 5001
+CERT_DIR = os.path.join(os.path.dirname(os.path.abspath(__file__)), "components", "iperf", "certs")
+CERT = os.path.join(CERT_DIR, "iperf_test_cert.pem")
+KEY = os.path.join(CERT_DIR, "iperf_test_key.pem")
+
+
+def serve_one(conn, addr, context):
+    start = time.time()
+    try:
+        tls = context.wrap_socket(conn, server_side=True)
+    except (ssl.SSLError, OSError) as e:
+        print("{}: handshake failed: {}".format(addr[0], e))
+        conn.close()
+        return
+    handshake = time.time() - start
+    cipher = tls.cipher()[0]
+    total = 0
+    start = time.time()
+    try:
+        while True:
+            data = tls.recv(65536)
+            if not data:
+                break
+            total += len(data)
+    except (ssl.SSLError, OSError):
+        pass
+    elapsed = time.time() - start
+    tls.close()
+    print("{}: {}, handshake {:.0f} ms, {} bytes in {:.2f} s, {:.2f} Mbits/sec".format(
+        addr[0], cipher, handshake * 1000, total, elapsed,
+        total * 8 / elapsed / 1e6 if elapsed else 0))
+
+
+def run_server(args):
+    context = ssl.SSLContext(ssl.PROTOCOL_TLS_SERVER)
+    context.load_cert_chain(CERT, KEY)
+    if args.cipher:
+        context.set_ciphers(args.cipher)
+    listener = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    listener.bind((args.bind, args.port))
+    listener.listen(5)
+    print("tls server on port {}".format(args.port))
+    while True:
+        conn, addr = listener.accept()
+        thread = threading.Thread(target=serve_one, args=(conn, addr, context))
+        thread.daemon = True
+        thread.start()
+        if args.once:
+            break
+    # --once: let that connection finish
+    for thread in threading.enumerate():
+        if thread is not threading.current_thread():
+            thread.join()
+
+
+def run_client(args):
+    context = ssl.SSLContext(ssl.PROTOCOL_TLS_CLIENT)
+    context.check_hostname = False
+    context.verify_mode = ssl.CERT_NONE
+    if args.cipher:
+        context.set_ciphers(args.cipher)
+    conn = socket.create_connection((args.client, args.port))
+    start = time.time()
+    tls = context.wrap_socket(conn)
+    handshake = time.time() - start
+    cipher = tls.cipher()[0]
+    buf = b"\0" * args.len
+    total = 0
+    start = time.time()
+    while time.time() - start < args.time:
+        total += tls.send(buf)
+    elapsed = time.time() - start
+    tls.close()
+    print("{}, handshake {:.0f} ms, {} bytes in {:.2f} s, {:.2f} Mbits/sec".format(
+        cipher, handshake * 1000, total, elapsed, total * 8 / elapsed / 1e6))
+
+
+def main():
+    parser = argparse.ArgumentParser(description="TLS peer for iperf --tls")
+    mode = parser.add_mutually_exclusive_group(required=True)
+    mode.add_argument("-s", "--server", action="store_true", help="receive and discard")
+    mode.add_argument("-c", "--client", metavar="HOST", help="send to HOST")
+    parser.add_argument("-p", "--port", type=int, default=DEFAULT_PORT)
+    parser.add_argument("-B", "--bind", default="0.0.0.0", help="server: address to listen on")
+    parser.add_argument("-t", "--time", type=float, default=10, help="client: seconds to send for")
+    parser.add_argument("-l", "--len", type=int, default=16384, help="client: bytes per send")
+    parser.add_argument("--cipher", help="OpenSSL cipher list to offer/accept for TLS 1.2 (what the device speaks), "
+                                         "eg ECDHE-ECDSA-AES128-GCM-SHA256")
+    parser.add_argument("--once", action="store_true", help="server: exit after one connection")
+    args = parser.parse_args()
+
+    if args.server:
+        run_server(args)
+    else:
+        run_client(args)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,168 @@
+"""
+Turn the device's iperf event trace (build option CONFIG_IPERF_TRACE, see components/iperf/iperf_trace.h) into
+Chrome trace_event JSON, for chrome://tracing or https://ui.perfetto.dev.
+
+Either let it run `trace dump` on the serial port itself (needs pyserial), or give it a raw serial log that contains
+a dump::
+
+    python iperf_trace.py --serial /dev/ttyUSB0 -o trace.json
+    python iperf_trace.py capture.log -o trace.json
+
+Sends, receives and connects become spans on the traffic task's track, ENOMEM backoffs become spans of the time
+backed off, and the report task's track shows when it was awake. Timestamps come from the CPU cycle counter, which
+wraps every 2^32 cycles (27 s at 160 MHz): gaps longer than that between two events, eg between tests, are lost.
+"""
+from __future__ import division
+from __future__ import print_function
+import argparse
+import json
+import re
+import struct
+import sys
+import time
+
+HEADER = struct.Struct("<IIIIII")   # magic, version, cpu_mhz, count, dropped, first
+EVENT = struct.Struct("<IHh")       # ccount, id, arg
+MAGIC = 0x52545049
+VERSION = 1
+BEGIN = re.compile(br"IPERF-TRACE-BEGIN (\d+)\r?\n")
+
+SEND_BEGIN, SEND_END, RECV_BEGIN, RECV_END, ENOMEM, REPORT, CONNECT_BEGIN, CONNECT_END, ACCEPT, TASK_WAKE, \
+    TASK_SLEEP = range(1, 12)
+TASK_TRAFFIC, TASK_REPORT = 0, 1
+TIDS = {TASK_TRAFFIC: 1, TASK_REPORT: 2}
+
+# event id: (phase, span name, name of its argument)
+SPANS = {
+    SEND_BEGIN: ("B", "send", "want"),
+    SEND_END: ("E", "send", "result"),
+    RECV_BEGIN: ("B", "recv", "want"),
+    RECV_END: ("E", "recv", "result"),
+    CONNECT_BEGIN: ("B", "connect", None),
+    CONNECT_END: ("E", "connect", "result"),
+}
+
+
+def find_dump(data):
+    """ the header and events of the last dump in a serial capture """
+    matches = list(BEGIN.finditer(data))
+    if not matches:
+        raise ValueError("no IPERF-TRACE-BEGIN in the input")
+    match = matches[-1]
+    size = int(match.group(1))
+    blob = data[match.end():match.end() + size]
+    if len(blob) < size:
+        raise ValueError("dump truncated: {} of {} bytes".format(len(blob), size))
+    header = HEADER.unpack_from(blob)
+    magic, version, _, count, _, _ = header
+    if magic != MAGIC or version != VERSION:
+        raise ValueError("not a version {} trace dump".format(VERSION))
+    events = [EVENT.unpack_from(blob, HEADER.size + i * EVENT.size) for i in range(count)]
+    return header, events
+
+
+def to_chrome(header, events):
+    _, _, cpu_mhz, _, dropped, _ = header
+    out = [
+        {"ph": "M", "pid": 1, "name": "process_name", "args": {"name": "iperf"}},
+        {"ph": "M", "pid": 1, "tid": TIDS[TASK_TRAFFIC], "name": "thread_name", "args": {"name": "iperf_traffic"}},
+        {"ph": "M", "pid": 1, "tid": TIDS[TASK_REPORT], "name": "thread_name", "args": {"name": "iperf_report"}},
+    ]
+    open_spans = set()      # (tid, name) of the spans begun and not yet ended
+    cycles = 0
+    last = events[0][0] if events else 0
+    for ccount, ev_id, arg in events:
+        cycles += (ccount - last) & 0xffffffff
+        last = ccount
+        ts = cycles / cpu_mhz
+        tid = TIDS[TASK_TRAFFIC]
+        if ev_id in SPANS:
+            phase, name, arg_name = SPANS[ev_id]
+            args = {arg_name: arg} if arg_name else {}
+        elif ev_id in (TASK_WAKE, TASK_SLEEP):
+            phase, name, args = ("B" if ev_id == TASK_WAKE else "E"), "running", {}
+            tid = TIDS.get(arg, TIDS[TASK_TRAFFIC])
+        elif ev_id == ENOMEM:
+            out.append({"ph": "X", "pid": 1, "tid": tid, "ts": ts, "dur": arg * 1000, "name": "ENOMEM backoff"})
+            continue
+        elif ev_id == REPORT:
+            out.append({"ph": "i", "s": "p", "pid": 1, "tid": TIDS[TASK_REPORT], "ts": ts, "name": "report",
+                        "args": {"end_sec": arg}})
+            continue
+        elif ev_id == ACCEPT:
+            out.append({"ph": "i", "s": "t", "pid": 1, "tid": tid, "ts": ts, "name": "accept", "args": {"fd": arg}})
+            continue
+        else:
+            continue
+        # the ring may start in the middle of a span; an end without its begin would confuse the viewers
+        if phase == "B":
+            open_spans.add((tid, name))
+        elif (tid, name) in open_spans:
+            open_spans.discard((tid, name))
+        else:
+            continue
+        out.append({"ph": phase, "pid": 1, "tid": tid, "ts": ts, "name": name, "args": args})
+    return {"traceEvents": out, "displayTimeUnit": "ms",
+            "otherData": {"cpu_mhz": cpu_mhz, "events": len(events), "dropped": dropped}}
+
+
+def read_serial(port, baud, timeout):
+    import serial
+    ser = serial.Serial(port, baud, timeout=0.5)
+    ser.reset_input_buffer()
+    ser.write(b"trace dump\r")
+    data = b""
+    deadline = time.time() + timeout
+    while b"IPERF-TRACE-END" not in data and time.time() < deadline:
+        data += ser.read(4096)
+    ser.close()
+    return data
+
+
+def self_check():
+    """ round-trip a made-up dump, including a wrap of the cycle counter """
+    events = [(0xfffff000, TASK_WAKE, TASK_TRAFFIC), (0xfffff100, SEND_END, 1460), (0xfffff200, SEND_BEGIN, 1460),
+              (0x00000100, SEND_END, 1460), (0x00000200, ENOMEM, 4), (0x00010000, REPORT, 3)]
+    blob = HEADER.pack(MAGIC, VERSION, 80, len(events), 7, 100) + b"".join(EVENT.pack(*e) for e in events)
+    data = b"I (123) x\r\nIPERF-TRACE-BEGIN %d\r\n" % len(blob) + blob + b"\r\nIPERF-TRACE-END\r\n"
+    trace = to_chrome(*find_dump(data))["traceEvents"]
+    spans = [e for e in trace if e["ph"] in "BE"]
+    assert [(e["ph"], e["name"]) for e in spans] == [("B", "running"), ("B", "send"), ("E", "send")], spans
+    assert abs(spans[2]["ts"] - (0x1000 + 0x100) / 80) < 1e-9, spans[2]
+    assert [e["dur"] for e in trace if e["ph"] == "X"] == [4000]
+    print("self-check ok")
+
+
+def main():
+    parser = argparse.ArgumentParser(description="convert an iperf trace dump to Chrome trace_event JSON")
+    parser.add_argument("capture", nargs="?", help="serial log containing a `trace dump`")
+    parser.add_argument("--serial", help="serial port of the device, to run `trace dump` on it")
+    parser.add_argument("--baud", type=int, default=115200)
+    parser.add_argument("--timeout", type=float, default=30, help="seconds to wait for the dump on --serial")
+    parser.add_argument("-o", "--output", help="JSON file to write (default: stdout)")
+    parser.add_argument("--self-check", action="store_true", help="test the converter and exit")
+    args = parser.parse_args()
+
+    if args.self_check:
+        self_check()
+        return
+    if args.serial:
+        data = read_serial(args.serial, args.baud, args.timeout)
+    elif args.capture:
+        with open(args.capture, "rb") as f:
+            data = f.read()
+    else:
+        parser.error("give a capture file or --serial")
+
+    header, events = find_dump(data)
+    trace = to_chrome(header, events)
+    if args.output:
+        with open(args.output, "w") as f:
+            json.dump(trace, f)
+    else:
+        json.dump(trace, sys.stdout)
+    print("{} events, {} overwritten on the device".format(len(events), header[4]), file=sys.stderr)
+
+
+if __name__ == "__main__":
+    main()
@@ -23,6 +23,7 @@
 #include "nvs.h"
 
 #include "cmd_decl.h"
+#include "cmd_autorun.h"
 #include "iperf.h"
 
 static const char current_namespace[16] = "autorun";
@@ -44,6 +45,11 @@ static struct {
     struct arg_end *end;
 } wait_args;
 
+static struct {
+    struct arg_int *seconds;
+    struct arg_end *end;
+} countdown_args;
+
 static esp_err_t fn_autorun_cmd_get(int argc, char **argv)
 {
 	esp_err_t err;
@@ -162,6 +168,59 @@ char* fn_autorun_get(void)
     return content;
 }
 
+// this is to be called from the main program before the autorun countdown, to get its length in seconds
+int fn_autorun_get_countdown(void)
+{
+    nvs_handle nvs;
+    uint8_t seconds = AUTORUN_DEFAULT_COUNTDOWN;
+
+    if (nvs_open(current_namespace, NVS_READONLY, &nvs) == ESP_OK) {
+        nvs_get_u8(nvs, "countdown", &seconds);
+        nvs_close(nvs);
+    }
+
+    return seconds;
+}
+
+static esp_err_t fn_autorun_cmd_countdown(int argc, char **argv)
+{
+    esp_err_t err;
+    nvs_handle nvs;
+
+    int nerrors = arg_parse(argc, argv, (void **) &countdown_args);
+    if (nerrors != 0) {
+        arg_print_errors(stderr, countdown_args.end, argv[0]);
+        return 1;
+    }
+
+    if (countdown_args.seconds->count == 0) {
+        ESP_LOGI(TAG, "fn_autorun_cmd_countdown(): autorun countdown is %d seconds", fn_autorun_get_countdown());
+        return ESP_OK;
+    }
+
+    if (countdown_args.seconds->ival[0] < 0 || countdown_args.seconds->ival[0] > 255) {
+        ESP_LOGE(TAG, "fn_autorun_cmd_countdown(): countdown should be 0-255 seconds");
+        return 1;
+    }
+
+    err = nvs_open(current_namespace, NVS_READWRITE, &nvs);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    err = nvs_set_u8(nvs, "countdown", countdown_args.seconds->ival[0]);
+    if (err == ESP_OK) {
+        err = nvs_commit(nvs);
+    }
+    nvs_close(nvs);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    ESP_LOGI(TAG, "fn_autorun_cmd_countdown(): autorun countdown set to %d seconds", countdown_args.seconds->ival[0]);
+    return ESP_OK;
+}
+
 static int fn_autorun_cmd_delay(int argc, char **argv)
 {    
 	int nerrors = arg_parse(argc, argv, (void **) &delay_args);
@@ -314,6 +373,18 @@ void register_autorun()
         .argtable = &wait_args
     };
     ESP_ERROR_CHECK( esp_console_cmd_register(&autorun_wait_cmd) );
+
+    //Command: autorun_countdown
+    countdown_args.seconds = arg_int0(NULL, NULL, "<seconds>", "seconds to wait for ^C/<Enter> before autorunning (0 runs at once, default 5)");
+    countdown_args.end = arg_end(2);
+    const esp_console_cmd_t autorun_countdown_cmd = {
+        .command = "autorun_countdown",
+        .help = "show or set the countdown before the autorun command-list runs at boot",
+        .hint = NULL,
+        .func = &fn_autorun_cmd_countdown,
+        .argtable = &countdown_args
+    };
+    ESP_ERROR_CHECK( esp_console_cmd_register(&autorun_countdown_cmd) );
 }
 
 //Eof cmd_autorun.c
@@ -7,6 +7,9 @@ extern "C" {
 // Register WiFi functions
 void register_autorun(void);
 char* fn_autorun_get(void);
+int fn_autorun_get_countdown(void);
+
+#define AUTORUN_DEFAULT_COUNTDOWN 5
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,101 @@
+/* cmd_capture.c: capture of received packets (`capture` console command)
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_console.h"
+#include "argtable3/argtable3.h"
+#include "driver/uart.h"
+#include "cmd_capture.h"
+#include "iperf_capture.h"
+
+static struct {
+    struct arg_str *action;
+    struct arg_end *end;
+} capture_args;
+
+static const char *TAG = "cmd_capture";
+
+#if CONFIG_IPERF_CAPTURE
+static void capture_write(const void *data, size_t len, void *arg)
+{
+    uart_write_bytes(CONFIG_CONSOLE_UART_NUM, (const char *)data, len);
+}
+
+/* framed like `trace dump`, see iperf_pcap.py */
+static void capture_dump(void)
+{
+    bool was_running = iperf_capture_is_running();
+
+    iperf_capture_stop();
+    printf("IPERF-CAPTURE-BEGIN %u\n", (unsigned)iperf_capture_dump_size());
+    fflush(stdout);
+    iperf_capture_dump(capture_write, NULL);
+    uart_wait_tx_done(CONFIG_CONSOLE_UART_NUM, portMAX_DELAY);
+    printf("\nIPERF-CAPTURE-END\n");
+    if (was_running) {
+        iperf_capture_start();
+    }
+}
+#endif
+
+static int fn_capture_cmd(int argc, char **argv)
+{
+    int nerrors = arg_parse(argc, argv, (void **) &capture_args);
+
+    if (nerrors != 0) {
+        arg_print_errors(stderr, capture_args.end, argv[0]);
+        return 1;
+    }
+
+#if CONFIG_IPERF_CAPTURE
+    const char *action = capture_args.action->count ? capture_args.action->sval[0] : "";
+    uint32_t count;
+    uint32_t dropped;
+
+    if (strcmp(action, "start") == 0) {
+        iperf_capture_start();
+    } else if (strcmp(action, "stop") == 0) {
+        iperf_capture_stop();
+    } else if (strcmp(action, "dump") == 0) {
+        capture_dump();
+    } else if (strcmp(action, "clear") == 0) {
+        iperf_capture_clear();
+    } else if (action[0] == '\0') {
+        iperf_capture_get_count(&count, &dropped);
+        printf("capture: %s, %u packets (room for %d, %d bytes each), %u older ones overwritten\n",
+               iperf_capture_is_running() ? "running" : "stopped", count, CONFIG_IPERF_CAPTURE_PACKETS,
+               CONFIG_IPERF_CAPTURE_SNAPLEN, dropped);
+    } else {
+        ESP_LOGE(TAG, "unknown action %s, expected start, stop, dump or clear", action);
+        return 1;
+    }
+    return 0;
+#else
+    ESP_LOGE(TAG, "capture is not built in, enable CONFIG_IPERF_CAPTURE (menuconfig: iperf)");
+    return 1;
+#endif
+}
+
+void register_capture(void)
+{
+    capture_args.action = arg_str0(NULL, NULL, "<start|stop|dump|clear>", "start/stop capturing what the iperf servers receive; "
+                                   "dump: send it as pcap, for iperf_pcap.py; clear: forget it");
+    capture_args.end = arg_end(1);
+    const esp_console_cmd_t capture_cmd = {
+        .command = "capture",
+        .help = "Capture the first bytes of every packet the iperf servers receive (build option CONFIG_IPERF_CAPTURE):\n"
+                "without an action, show how many packets are held",
+        .hint = NULL,
+        .func = &fn_capture_cmd,
+        .argtable = &capture_args
+    };
+    ESP_ERROR_CHECK( esp_console_cmd_register(&capture_cmd) );
+}
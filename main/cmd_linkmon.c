@@ -0,0 +1,109 @@
+/* cmd_linkmon.c: background link monitor (`linkmon` console command)
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_console.h"
+#include "argtable3/argtable3.h"
+#include "cmd_linkmon.h"
+#include "iperf_linkmon.h"
+
+static struct {
+    struct arg_str *ip;
+    struct arg_int *port;
+    struct arg_int *rate;
+    struct arg_lit *abort;
+    struct arg_end *end;
+} linkmon_args;
+
+static const char *TAG = "cmd_linkmon";
+
+static void linkmon_show(uint32_t seconds)
+{
+    iperf_linkmon_window_t w;
+
+    if (iperf_linkmon_get(seconds, &w) != ESP_OK) {
+        return;
+    }
+    printf("%3u min: %u/%u (%.2f%%) lost, rtt avg %.1f max %.1f ms, jitter %.1f ms (over %u sec)\n", seconds / 60,
+           w.lost, w.sent, w.sent ? w.lost * 100.0 / w.sent : 0.0, w.rtt_avg_us / 1000.0, w.rtt_max_us / 1000.0,
+           w.jitter_us / 1000.0, w.seconds);
+}
+
+static int fn_linkmon_cmd(int argc, char **argv)
+{
+    int nerrors = arg_parse(argc, argv, (void **) &linkmon_args);
+    iperf_linkmon_cfg_t cfg;
+
+    if (nerrors != 0) {
+        arg_print_errors(stderr, linkmon_args.end, argv[0]);
+        return 1;
+    }
+
+    if (linkmon_args.abort->count != 0) {
+        return (iperf_linkmon_stop() == ESP_OK) ? 0 : 1;
+    }
+
+    if (linkmon_args.ip->count == 0) {
+        /* no collector given, just show the windows */
+        if (!iperf_linkmon_is_running()) {
+            printf("link monitor not running\n");
+        }
+        linkmon_show(60);
+        linkmon_show(300);
+        return 0;
+    }
+
+    memset(&cfg, 0, sizeof(cfg));
+    if (iperf_addr_from_str(linkmon_args.ip->sval[0], &cfg.dip) != ESP_OK) {
+        ESP_LOGE(TAG, "invalid address %s", linkmon_args.ip->sval[0]);
+        return 1;
+    }
+    cfg.dport = IPERF_LINKMON_DEFAULT_PORT;
+    if (linkmon_args.port->count != 0) {
+        if (linkmon_args.port->ival[0] <= 0 || linkmon_args.port->ival[0] > 65535) {
+            ESP_LOGE(TAG, "port should be 1-65535");
+            return 1;
+        }
+        cfg.dport = linkmon_args.port->ival[0];
+    }
+    cfg.pps = IPERF_LINKMON_DEFAULT_PPS;
+    if (linkmon_args.rate->count != 0) {
+        if (linkmon_args.rate->ival[0] <= 0 || linkmon_args.rate->ival[0] > IPERF_LINKMON_MAX_PPS) {
+            ESP_LOGE(TAG, "rate should be 1-%d probes a second", IPERF_LINKMON_MAX_PPS);
+            return 1;
+        }
+        cfg.pps = linkmon_args.rate->ival[0];
+    }
+
+    if (iperf_linkmon_start(&cfg) != ESP_OK) {
+        return 1;
+    }
+    ESP_LOGI(TAG, "probing %s:%d, %u a second", linkmon_args.ip->sval[0], cfg.dport, cfg.pps);
+    return 0;
+}
+
+void register_linkmon(void)
+{
+    linkmon_args.ip = arg_str0("c", "collector", "<ip>", "start probing <ip>, which echoes the probes back (see iperf_linkmon.py)");
+    linkmon_args.port = arg_int0("p", "port", "<port>", "collector UDP port (default 5004)");
+    linkmon_args.rate = arg_int0("r", "rate", "<pps>", "probes a second (default 5)");
+    linkmon_args.abort = arg_lit0("a", "abort", "stop the monitor");
+    linkmon_args.end = arg_end(1);
+    const esp_console_cmd_t linkmon_cmd = {
+        .command = "linkmon",
+        .help = "Low-rate background link monitor: with -c, start sending small UDP probes to a collector;\n"
+                "without, print the rolling 1 and 5 minute loss, RTT and jitter",
+        .hint = NULL,
+        .func = &fn_linkmon_cmd,
+        .argtable = &linkmon_args
+    };
+    ESP_ERROR_CHECK( esp_console_cmd_register(&linkmon_cmd) );
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Register the link monitor command
+void register_linkmon(void);
+
+#ifdef __cplusplus
+}
+#endif
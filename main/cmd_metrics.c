@@ -0,0 +1,274 @@
+/* cmd_metrics.c: Prometheus metrics over HTTP (`metrics` console command)
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+/* Answers GET /metrics with iperf totals, the last run's summary, lwIP counters, the free heap and task
+   stack high-water marks, in the Prometheus text format. One connection at a time, HTTP/1.0 style (the
+   response ends when the connection closes). The page is rendered a line at a time into a small buffer
+   that is sent whenever the next line doesn't fit, so its length costs no memory; the only allocation is a
+   small array for the task stack lines, sized from the task count at each scrape. */
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_console.h"
+#include "argtable3/argtable3.h"
+#include "lwip/stats.h"
+#include "cmd_metrics.h"
+#include "iperf.h"
+
+#define METRICS_DEFAULT_PORT 9100
+#define METRICS_TASK_NAME "iperf_metrics"
+#define METRICS_TASK_PRIORITY 4
+#define METRICS_TASK_STACK 3072
+#define METRICS_BUF_LEN 256
+#define METRICS_REQ_LEN 128
+#define METRICS_RX_TIMEOUT 2
+#define METRICS_SPARE_TASKS 2
+
+typedef struct {
+    int sockfd;
+    int len;
+    bool failed;
+    char buf[METRICS_BUF_LEN];
+} metrics_out_t;
+
+static struct {
+    struct arg_int *port;
+    struct arg_end *end;
+} metrics_args;
+
+static const char *TAG = "cmd_metrics";
+static TaskHandle_t s_metrics_task;
+
+static void metrics_flush(metrics_out_t *out)
+{
+    if (out->len && !out->failed && send(out->sockfd, out->buf, out->len, 0) != out->len) {
+        out->failed = true;
+    }
+    out->len = 0;
+}
+
+static void metrics_printf(metrics_out_t *out, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(out->buf + out->len, sizeof(out->buf) - out->len, fmt, ap);
+    va_end(ap);
+    if (n >= (int)sizeof(out->buf) - out->len && out->len) {
+        /* didn't fit behind what's buffered, send that and render the line again */
+        metrics_flush(out);
+        va_start(ap, fmt);
+        n = vsnprintf(out->buf, sizeof(out->buf), fmt, ap);
+        va_end(ap);
+    }
+    /* a single line longer than the buffer is cut short, none are */
+    out->len += (n < (int)sizeof(out->buf) - out->len) ? n : (int)sizeof(out->buf) - 1 - out->len;
+}
+
+static void metrics_proto(metrics_out_t *out, const char *proto, const struct stats_proto *stats)
+{
+    metrics_printf(out, "lwip_packets_total{proto=\"%s\",counter=\"xmit\"} %u\n", proto, (unsigned)stats->xmit);
+    metrics_printf(out, "lwip_packets_total{proto=\"%s\",counter=\"recv\"} %u\n", proto, (unsigned)stats->recv);
+    metrics_printf(out, "lwip_packets_total{proto=\"%s\",counter=\"drop\"} %u\n", proto, (unsigned)stats->drop);
+    metrics_printf(out, "lwip_packets_total{proto=\"%s\",counter=\"chkerr\"} %u\n", proto, (unsigned)stats->chkerr);
+    metrics_printf(out, "lwip_packets_total{proto=\"%s\",counter=\"memerr\"} %u\n", proto, (unsigned)stats->memerr);
+    metrics_printf(out, "lwip_packets_total{proto=\"%s\",counter=\"err\"} %u\n", proto, (unsigned)stats->err);
+}
+
+static void metrics_render(metrics_out_t *out)
+{
+    iperf_totals_t totals;
+    iperf_result_t result;
+#if CONFIG_FREERTOS_USE_TRACE_FACILITY
+    TaskStatus_t *tasks;
+    UBaseType_t n;
+    UBaseType_t i;
+#endif
+
+    iperf_get_totals(&totals);
+    metrics_printf(out, "# HELP iperf_bytes_total Bytes moved by iperf runs since boot, counted as each run ends.\n"
+                        "# TYPE iperf_bytes_total counter\n");
+    metrics_printf(out, "iperf_bytes_total{mode=\"tcp_tx\"} %llu\n", (unsigned long long)totals.tcp_tx_bytes);
+    metrics_printf(out, "iperf_bytes_total{mode=\"tcp_rx\"} %llu\n", (unsigned long long)totals.tcp_rx_bytes);
+    metrics_printf(out, "iperf_bytes_total{mode=\"udp_tx\"} %llu\n", (unsigned long long)totals.udp_tx_bytes);
+    metrics_printf(out, "iperf_bytes_total{mode=\"udp_rx\"} %llu\n", (unsigned long long)totals.udp_rx_bytes);
+    metrics_printf(out, "# TYPE iperf_runs_total counter\niperf_runs_total %u\n", totals.runs);
+    metrics_printf(out, "# TYPE iperf_running gauge\niperf_running %d\n", iperf_is_running() ? 1 : 0);
+
+    if (iperf_get_result(&result) == ESP_OK) {
+        metrics_printf(out, "# HELP iperf_last_run Summary of the last finished run of the console's instance.\n"
+                            "# TYPE iperf_last_run gauge\n");
+        metrics_printf(out, "iperf_last_run{field=\"flag\"} %u\n", result.flag);
+        metrics_printf(out, "iperf_last_run{field=\"duration_ms\"} %u\n", result.duration_ms);
+        metrics_printf(out, "iperf_last_run{field=\"bytes\"} %llu\n", (unsigned long long)result.bytes);
+        metrics_printf(out, "iperf_last_run{field=\"bandwidth_kbps\"} %u\n", result.bandwidth_kbps);
+        metrics_printf(out, "iperf_last_run{field=\"packets\"} %u\n", result.packets);
+        metrics_printf(out, "iperf_last_run{field=\"lost\"} %u\n", result.lost);
+        metrics_printf(out, "iperf_last_run{field=\"reordered\"} %u\n", result.reordered);
+        metrics_printf(out, "iperf_last_run{field=\"corrupted\"} %u\n", result.corrupted);
+    }
+
+    metrics_printf(out, "# HELP lwip_packets_total lwIP protocol counters (lwip_stats), as the stats command prints them.\n"
+                        "# TYPE lwip_packets_total counter\n");
+    metrics_proto(out, "link", &lwip_stats.link);
+    metrics_proto(out, "ip", &lwip_stats.ip);
+    metrics_proto(out, "udp", &lwip_stats.udp);
+    metrics_proto(out, "tcp", &lwip_stats.tcp);
+
+    metrics_printf(out, "# TYPE heap_free_bytes gauge\nheap_free_bytes %u\n", esp_get_free_heap_size());
+    metrics_printf(out, "# TYPE heap_min_free_bytes gauge\nheap_min_free_bytes %u\n", esp_get_minimum_free_heap_size());
+
+    metrics_printf(out, "# HELP task_stack_high_water_bytes Least stack left free, per task.\n"
+                        "# TYPE task_stack_high_water_bytes gauge\n");
+#if CONFIG_FREERTOS_USE_TRACE_FACILITY
+    /* uxTaskGetSystemState() fills in nothing if the array is short, so leave room for tasks created meanwhile */
+    n = uxTaskGetNumberOfTasks() + METRICS_SPARE_TASKS;
+    tasks = malloc(n * sizeof(TaskStatus_t));
+    if (tasks) {
+        n = uxTaskGetSystemState(tasks, n, NULL);
+        for (i = 0; i < n; i++) {
+            metrics_printf(out, "task_stack_high_water_bytes{task=\"%s\"} %u\n", tasks[i].pcTaskName,
+                           (unsigned)(tasks[i].usStackHighWaterMark * sizeof(StackType_t)));
+        }
+        free(tasks);
+    }
+#else
+    /* without the trace facility only our own task can be asked */
+    metrics_printf(out, "task_stack_high_water_bytes{task=\"%s\"} %u\n", METRICS_TASK_NAME,
+                   (unsigned)(uxTaskGetStackHighWaterMark(NULL) * sizeof(StackType_t)));
+#endif
+}
+
+static void metrics_serve(int sockfd)
+{
+    metrics_out_t out = { .sockfd = sockfd };
+    char req[METRICS_REQ_LEN];
+    struct timeval t;
+    int len = 0;
+    int ret;
+
+    /* the request line is all that matters; read until it's complete, a slow client only gets a couple of seconds */
+    t.tv_sec = METRICS_RX_TIMEOUT;
+    t.tv_usec = 0;
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &t, sizeof(t));
+    while (len < sizeof(req) - 1) {
+        ret = recv(sockfd, req + len, sizeof(req) - 1 - len, 0);
+        if (ret <= 0) {
+            break;
+        }
+        len += ret;
+        req[len] = '\0';
+        if (strchr(req, '\n')) {
+            break;
+        }
+    }
+    req[len] = '\0';
+
+    if (strncmp(req, "GET /metrics ", 13) != 0 && strncmp(req, "GET /metrics\r", 13) != 0) {
+        metrics_printf(&out, "HTTP/1.0 404 Not Found\r\nContent-Type: text/plain\r\nConnection: close\r\n\r\nonly /metrics here\n");
+    } else {
+        metrics_printf(&out, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nConnection: close\r\n\r\n");
+        metrics_render(&out);
+    }
+    metrics_flush(&out);
+}
+
+static void metrics_task(void *arg)
+{
+    uint16_t port = (uint16_t)(uint32_t)arg;
+    struct sockaddr_in addr;
+    int listen_socket;
+    int sockfd;
+    int opt = 1;
+
+    listen_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (listen_socket < 0) {
+        ESP_LOGE(TAG, "socket create failed: errno=%d", errno);
+        goto exit;
+    }
+    setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(listen_socket, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(listen_socket, 1) != 0) {
+        ESP_LOGE(TAG, "bind/listen on port %d failed: errno=%d", port, errno);
+        close(listen_socket);
+        goto exit;
+    }
+    ESP_LOGI(TAG, "serving /metrics on port %d", port);
+
+    while (true) {
+        sockfd = accept(listen_socket, NULL, NULL);
+        if (sockfd < 0) {
+            continue;
+        }
+        metrics_serve(sockfd);
+        close(sockfd);
+    }
+
+exit:
+    s_metrics_task = NULL;
+    vTaskDelete(NULL);
+}
+
+static int fn_metrics_cmd(int argc, char **argv)
+{
+    int nerrors = arg_parse(argc, argv, (void **) &metrics_args);
+    uint32_t port = METRICS_DEFAULT_PORT;
+
+    if (nerrors != 0) {
+        arg_print_errors(stderr, metrics_args.end, argv[0]);
+        return 1;
+    }
+
+    if (s_metrics_task) {
+        ESP_LOGW(TAG, "metrics endpoint is already running");
+        return 1;
+    }
+
+    if (metrics_args.port->count != 0) {
+        if (metrics_args.port->ival[0] <= 0 || metrics_args.port->ival[0] > 65535) {
+            ESP_LOGE(TAG, "port should be 1-65535");
+            return 1;
+        }
+        port = metrics_args.port->ival[0];
+    }
+
+    if (xTaskCreate(metrics_task, METRICS_TASK_NAME, METRICS_TASK_STACK, (void *)port, METRICS_TASK_PRIORITY, &s_metrics_task) != pdPASS) {
+        ESP_LOGE(TAG, "create task %s failed", METRICS_TASK_NAME);
+        return 1;
+    }
+
+    return 0;
+}
+
+void register_metrics(void)
+{
+    metrics_args.port = arg_int0("p", "port", "<port>", "TCP port to serve on (default 9100)");
+    metrics_args.end = arg_end(1);
+    const esp_console_cmd_t metrics_cmd = {
+        .command = "metrics",
+        .help = "Serve iperf totals, the last result, lwIP counters, heap and task stacks at http://<device>:9100/metrics\n"
+                "in the Prometheus text format, for fleet monitoring",
+        .hint = NULL,
+        .func = &fn_metrics_cmd,
+        .argtable = &metrics_args
+    };
+    ESP_ERROR_CHECK( esp_console_cmd_register(&metrics_cmd) );
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Register the metrics endpoint command
+void register_metrics(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,377 @@
+/* cmd_remote.c: network control channel for iperf (`remote` console command)
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+/* A host connects over TCP and sends binary frames instead of typing commands on the UART.
+   Every frame, in both directions, is a 4 byte header followed by its payload, big-endian throughout:
+
+       u8 op, u8 status (0 in requests), u16 payload length
+
+   START   payload is a remote_cfg_t; answered with an empty START frame carrying the status, and then,
+           on the same connection, a RESULT frame as soon as the run finishes
+   STOP    stops the current run; answered with an empty STOP frame
+   RESULT  answered with a RESULT frame holding the remote_result_t of the last run (status NONE if
+           there isn't one, BUSY while one is running)
+
+   Only one host is served at a time. iperf_remote.py implements the host side, and a stand-in for
+   the device so scripts can be tried without hardware; keep the two in step. */
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_console.h"
+#include "argtable3/argtable3.h"
+#include "cmd_remote.h"
+#include "iperf.h"
+
+#define REMOTE_DEFAULT_PORT 5003
+#define REMOTE_TASK_NAME "iperf_remote"
+#define REMOTE_TASK_PRIORITY 5
+#define REMOTE_TASK_STACK 3072
+#define REMOTE_POLL_MS 20
+
+/* flags a START can set: the others (--self, flash, TLS, --pps-sweep, ...) need parameters remote_cfg_t doesn't carry */
+#define REMOTE_FLAGS (IPERF_FLAG_CLIENT | IPERF_FLAG_SERVER | IPERF_FLAG_TCP | IPERF_FLAG_UDP | IPERF_FLAG_AUTO | \
+                      IPERF_FLAG_ENHANCED | IPERF_FLAG_VERIFY | IPERF_FLAG_SINGLE_TASK | IPERF_FLAG_ISOCHRONOUS)
+
+#define REMOTE_OP_START 1
+#define REMOTE_OP_STOP 2
+#define REMOTE_OP_RESULT 3
+
+#define REMOTE_STATUS_OK 0
+#define REMOTE_STATUS_BUSY 1
+#define REMOTE_STATUS_INVALID 2
+#define REMOTE_STATUS_NONE 3
+#define REMOTE_STATUS_FAIL 4
+
+typedef struct {
+    uint8_t op;
+    uint8_t status;
+    uint16_t len;
+} __attribute__((packed)) remote_hdr_t;
+
+typedef struct {
+    uint32_t flag;      /* IPERF_FLAG_*; --self is not accepted */
+    uint8_t family;     /* 4 or 6 */
+    uint8_t ttl;
+    uint16_t port;      /* client: port to connect to, server: port to listen on */
+    uint8_t addr[16];   /* client: destination, server: multicast/broadcast group or all zeroes */
+    uint32_t interval;
+    uint32_t time;
+    uint32_t omit;
+    uint32_t tolerance;
+} __attribute__((packed)) remote_cfg_t;
+
+typedef struct {
+    uint32_t flag;
+    uint32_t duration_ms;
+    uint32_t bytes_hi;
+    uint32_t bytes_lo;
+    uint32_t bandwidth_kbps;
+    uint32_t packets;
+    uint32_t lost;
+    uint32_t reordered;
+    uint32_t corrupted;
+} __attribute__((packed)) remote_result_t;
+
+static struct {
+    struct arg_int *port;
+    struct arg_end *end;
+} remote_args;
+
+static const char *TAG = "cmd_remote";
+static TaskHandle_t s_remote_task;
+
+static int remote_recv_all(int sockfd, void *buf, int len)
+{
+    int got = 0;
+    int ret;
+
+    while (got < len) {
+        ret = recv(sockfd, (uint8_t *)buf + got, len - got, 0);
+        if (ret <= 0) {
+            return -1;
+        }
+        got += ret;
+    }
+
+    return got;
+}
+
+static int remote_send_frame(int sockfd, uint8_t op, uint8_t status, const void *payload, uint16_t len)
+{
+    remote_hdr_t hdr = { .op = op, .status = status, .len = htons(len) };
+
+    if (send(sockfd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+        return -1;
+    }
+    if (len && send(sockfd, payload, len, 0) != len) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static int remote_send_result(int sockfd)
+{
+    iperf_result_t result;
+    remote_result_t out;
+    esp_err_t err;
+
+    err = iperf_get_result(&result);
+    if (err == ESP_ERR_INVALID_STATE) {
+        return remote_send_frame(sockfd, REMOTE_OP_RESULT, REMOTE_STATUS_BUSY, NULL, 0);
+    } else if (err != ESP_OK) {
+        return remote_send_frame(sockfd, REMOTE_OP_RESULT, REMOTE_STATUS_NONE, NULL, 0);
+    }
+
+    out.flag = htonl(result.flag);
+    out.duration_ms = htonl(result.duration_ms);
+    out.bytes_hi = htonl((uint32_t)(result.bytes >> 32));
+    out.bytes_lo = htonl((uint32_t)result.bytes);
+    out.bandwidth_kbps = htonl(result.bandwidth_kbps);
+    out.packets = htonl(result.packets);
+    out.lost = htonl(result.lost);
+    out.reordered = htonl(result.reordered);
+    out.corrupted = htonl(result.corrupted);
+    return remote_send_frame(sockfd, REMOTE_OP_RESULT, REMOTE_STATUS_OK, &out, sizeof(out));
+}
+
+/* turn a START payload into an iperf_cfg_t, with the console's defaults for whatever is left at 0 */
+static bool remote_parse_cfg(const remote_cfg_t *in, iperf_cfg_t *cfg)
+{
+    iperf_addr_t addr;
+    uint16_t port;
+    int i;
+
+    memset(cfg, 0, sizeof(*cfg));
+    memset(&addr, 0, sizeof(addr));
+    cfg->flag = ntohl(in->flag);
+    if ((cfg->flag & ~REMOTE_FLAGS) ||
+        !(cfg->flag & IPERF_FLAG_CLIENT) == !(cfg->flag & IPERF_FLAG_SERVER) ||
+        !(cfg->flag & IPERF_FLAG_TCP) == !(cfg->flag & IPERF_FLAG_UDP)) {
+        return false;
+    }
+
+    if (in->family == 4) {
+        addr.sin.sin_family = AF_INET;
+        memcpy(&addr.sin.sin_addr, in->addr, 4);
+#if LWIP_IPV6
+    } else if (in->family == 6) {
+        addr.sin6.sin6_family = AF_INET6;
+        memcpy(&addr.sin6.sin6_addr, in->addr, 16);
+#endif
+    } else {
+        return false;
+    }
+
+    /* the server listens on any address of the family; lwIP picks the client's source address */
+    cfg->sip.sa.sa_family = addr.sa.sa_family;
+    port = ntohs(in->port) ? ntohs(in->port) : IPERF_DEFAULT_PORT;
+    cfg->sport = IPERF_DEFAULT_PORT;
+    cfg->dport = IPERF_DEFAULT_PORT;
+    if (cfg->flag & IPERF_FLAG_CLIENT) {
+        cfg->dip = addr;
+        cfg->dport = port;
+    } else {
+        cfg->sport = port;
+        for (i = 0; i < ((in->family == 4) ? 4 : 16); i++) {
+            if (in->addr[i]) {
+                cfg->group = addr;
+                break;
+            }
+        }
+    }
+
+    cfg->ttl = in->ttl;
+    cfg->interval = ntohl(in->interval) ? ntohl(in->interval) : IPERF_DEFAULT_INTERVAL;
+    cfg->omit = ntohl(in->omit);
+    cfg->tolerance = ntohl(in->tolerance) ? ntohl(in->tolerance) : IPERF_DEFAULT_AUTO_TOLERANCE;
+    cfg->time = ntohl(in->time);
+    if (cfg->time == 0) {
+        cfg->time = (cfg->flag & IPERF_FLAG_AUTO) ? IPERF_DEFAULT_AUTO_TIME : IPERF_DEFAULT_TIME;
+    } else if (cfg->time <= cfg->interval) {
+        cfg->time = cfg->interval;
+    }
+
+    return true;
+}
+
+static uint8_t remote_start(const remote_cfg_t *in)
+{
+    iperf_cfg_t cfg;
+
+    if (iperf_is_running()) {
+        return REMOTE_STATUS_BUSY;
+    }
+    if (!remote_parse_cfg(in, &cfg)) {
+        return REMOTE_STATUS_INVALID;
+    }
+
+    return (iperf_start(&cfg) == ESP_OK) ? REMOTE_STATUS_OK : REMOTE_STATUS_FAIL;
+}
+
+/* serve one host until it disconnects */
+static void remote_serve(int sockfd)
+{
+    remote_hdr_t hdr;
+    remote_cfg_t cfg;
+    bool pending = false;   /* a START from this host is still running, its result is owed */
+    struct timeval tv;
+    fd_set rfds;
+    uint8_t status;
+    uint16_t len;
+    uint8_t skip;
+    int ret;
+
+    while (1) {
+        if (pending && !iperf_is_running()) {
+            pending = false;
+            if (remote_send_result(sockfd) < 0) {
+                return;
+            }
+        }
+
+        FD_ZERO(&rfds);
+        FD_SET(sockfd, &rfds);
+        tv.tv_sec = 0;
+        tv.tv_usec = REMOTE_POLL_MS * 1000;
+        ret = select(sockfd + 1, &rfds, NULL, NULL, pending ? &tv : NULL);
+        if (ret < 0) {
+            return;
+        } else if (ret == 0) {
+            continue;
+        }
+
+        if (remote_recv_all(sockfd, &hdr, sizeof(hdr)) < 0) {
+            return;
+        }
+        len = ntohs(hdr.len);
+
+        if (hdr.op == REMOTE_OP_START && len == sizeof(cfg)) {
+            if (remote_recv_all(sockfd, &cfg, sizeof(cfg)) < 0) {
+                return;
+            }
+            status = remote_start(&cfg);
+            /* a refused START (eg BUSY) leaves the result of an earlier one still owed */
+            if (status == REMOTE_STATUS_OK) {
+                pending = true;
+            }
+            ret = remote_send_frame(sockfd, REMOTE_OP_START, status, NULL, 0);
+        } else {
+            /* none of the other requests has a payload; drop anything unexpected */
+            while (len--) {
+                if (remote_recv_all(sockfd, &skip, 1) < 0) {
+                    return;
+                }
+            }
+            if (hdr.op == REMOTE_OP_STOP) {
+                iperf_stop();
+                ret = remote_send_frame(sockfd, REMOTE_OP_STOP, REMOTE_STATUS_OK, NULL, 0);
+            } else if (hdr.op == REMOTE_OP_RESULT) {
+                ret = remote_send_result(sockfd);
+            } else {
+                ret = remote_send_frame(sockfd, hdr.op, REMOTE_STATUS_INVALID, NULL, 0);
+            }
+        }
+        if (ret < 0) {
+            return;
+        }
+    }
+}
+
+static void remote_task(void *arg)
+{
+    uint16_t port = (uint16_t)(uint32_t)arg;
+    struct sockaddr_in addr;
+    int listen_socket;
+    int sockfd;
+    int opt = 1;
+
+    listen_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (listen_socket < 0) {
+        ESP_LOGE(TAG, "create socket failed");
+        goto exit;
+    }
+    setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(listen_socket, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(listen_socket, 1) != 0) {
+        ESP_LOGE(TAG, "listen on port %d failed", port);
+        close(listen_socket);
+        goto exit;
+    }
+
+    ESP_LOGI(TAG, "control channel listening on port %d", port);
+    while (1) {
+        sockfd = accept(listen_socket, NULL, NULL);
+        if (sockfd < 0) {
+            continue;
+        }
+        opt = 1;
+        setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+        remote_serve(sockfd);
+        close(sockfd);
+    }
+
+exit:
+    s_remote_task = NULL;
+    vTaskDelete(NULL);
+}
+
+static int fn_remote_cmd(int argc, char **argv)
+{
+    int nerrors = arg_parse(argc, argv, (void **) &remote_args);
+    uint32_t port = REMOTE_DEFAULT_PORT;
+
+    if (nerrors != 0) {
+        arg_print_errors(stderr, remote_args.end, argv[0]);
+        return 1;
+    }
+
+    if (s_remote_task) {
+        ESP_LOGW(TAG, "control channel is already running");
+        return 1;
+    }
+
+    if (remote_args.port->count != 0) {
+        if (remote_args.port->ival[0] <= 0 || remote_args.port->ival[0] > 65535) {
+            ESP_LOGE(TAG, "port should be 1-65535");
+            return 1;
+        }
+        port = remote_args.port->ival[0];
+    }
+
+    if (xTaskCreate(remote_task, REMOTE_TASK_NAME, REMOTE_TASK_STACK, (void *)port, REMOTE_TASK_PRIORITY, &s_remote_task) != pdPASS) {
+        ESP_LOGE(TAG, "create task %s failed", REMOTE_TASK_NAME);
+        return 1;
+    }
+
+    return 0;
+}
+
+void register_remote(void)
+{
+    remote_args.port = arg_int0("p", "port", "<port>", "TCP port to listen on (default 5003)");
+    remote_args.end = arg_end(1);
+    const esp_console_cmd_t remote_cmd = {
+        .command = "remote",
+        .help = "Start the network control channel, so iperf_remote.py can start runs and fetch their results\n"
+                "without the console (put it in the autorun command-list for headless units)",
+        .hint = NULL,
+        .func = &fn_remote_cmd,
+        .argtable = &remote_args
+    };
+    ESP_ERROR_CHECK( esp_console_cmd_register(&remote_cmd) );
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Register the network control channel command
+void register_remote(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,96 @@
+/* cmd_trace.c: dump the iperf event trace (`trace` console command)
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_console.h"
+#include "argtable3/argtable3.h"
+#include "driver/uart.h"
+#include "cmd_trace.h"
+#include "iperf_trace.h"
+
+#define TRACE_DUMP_BATCH 32 /* events copied to the stack per UART write */
+
+static struct {
+    struct arg_str *action;
+    struct arg_end *end;
+} trace_args;
+
+static const char *TAG = "cmd_trace";
+
+#if CONFIG_IPERF_TRACE
+/* The binary goes straight to the UART driver, past the console's LF -> CRLF translation, framed by two
+   text lines so iperf_trace.py can find it in a serial log */
+static void trace_dump(void)
+{
+    iperf_trace_header_t hdr;
+    iperf_trace_event_t events[TRACE_DUMP_BATCH];
+    uint32_t i;
+    uint32_t n;
+
+    iperf_trace_get_header(&hdr);
+    printf("IPERF-TRACE-BEGIN %u\n", (unsigned)(sizeof(hdr) + hdr.count * sizeof(iperf_trace_event_t)));
+    fflush(stdout);
+    uart_write_bytes(CONFIG_CONSOLE_UART_NUM, (const char *)&hdr, sizeof(hdr));
+    for (i = 0; i < hdr.count; i += n) {
+        n = (hdr.count - i < TRACE_DUMP_BATCH) ? hdr.count - i : TRACE_DUMP_BATCH;
+        iperf_trace_read(hdr.first + i, events, n);
+        uart_write_bytes(CONFIG_CONSOLE_UART_NUM, (const char *)events, n * sizeof(iperf_trace_event_t));
+    }
+    uart_wait_tx_done(CONFIG_CONSOLE_UART_NUM, portMAX_DELAY);
+    printf("\nIPERF-TRACE-END\n");
+}
+#endif
+
+static int fn_trace_cmd(int argc, char **argv)
+{
+    int nerrors = arg_parse(argc, argv, (void **) &trace_args);
+
+    if (nerrors != 0) {
+        arg_print_errors(stderr, trace_args.end, argv[0]);
+        return 1;
+    }
+
+#if CONFIG_IPERF_TRACE
+    iperf_trace_header_t hdr;
+    const char *action = trace_args.action->count ? trace_args.action->sval[0] : "";
+
+    if (strcmp(action, "dump") == 0) {
+        trace_dump();
+    } else if (strcmp(action, "clear") == 0) {
+        iperf_trace_clear();
+    } else if (action[0] == '\0') {
+        iperf_trace_get_header(&hdr);
+        printf("trace: %u events (room for %d), %u older ones overwritten\n", hdr.count, CONFIG_IPERF_TRACE_EVENTS,
+               hdr.dropped);
+    } else {
+        ESP_LOGE(TAG, "unknown action %s, expected dump or clear", action);
+        return 1;
+    }
+    return 0;
+#else
+    ESP_LOGE(TAG, "tracing is not built in, enable CONFIG_IPERF_TRACE (menuconfig: iperf)");
+    return 1;
+#endif
+}
+
+void register_trace(void)
+{
+    trace_args.action = arg_str0(NULL, NULL, "<dump|clear>", "dump: send the events in binary, for iperf_trace.py; clear: forget them");
+    trace_args.end = arg_end(1);
+    const esp_console_cmd_t trace_cmd = {
+        .command = "trace",
+        .help = "iperf event timeline (build option CONFIG_IPERF_TRACE): without an action, show how many events are held",
+        .hint = NULL,
+        .func = &fn_trace_cmd,
+        .argtable = &trace_args
+    };
+    ESP_ERROR_CHECK( esp_console_cmd_register(&trace_cmd) );
+}
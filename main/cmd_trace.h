@@ -0,0 +1,12 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Register the trace command
+void register_trace(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -8,6 +8,7 @@
 */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "esp_log.h"
 #include "esp_console.h"
@@ -18,17 +19,44 @@
 #include "esp_wifi.h"
 #include "tcpip_adapter.h"
 #include "esp_event_loop.h"
+#include "esp_timer.h"
+#include "nvs.h"
 #include "iperf.h"
+#if CONFIG_IPERF_TLS
+#include "mbedtls/ssl.h"
+#endif
 
 #include "lwip/stats.h"
 
 typedef struct {
     struct arg_str *ip;
     struct arg_lit *server;
+    struct arg_lit *self;
     struct arg_lit *udp;
+    struct arg_lit *ipv6;
+    struct arg_str *group;
+    struct arg_int *ttl;
     struct arg_int *port;
     struct arg_int *interval;
     struct arg_int *time;
+    struct arg_int *omit;
+    struct arg_lit *auto_mode;
+    struct arg_int *tolerance;
+    struct arg_lit *enhanced;
+    struct arg_lit *verify;
+    struct arg_lit *single_task;
+    struct arg_str *isoch;
+    struct arg_str *burst;
+    struct arg_int *poisson;
+    struct arg_str *len;
+    struct arg_int *seed;
+    struct arg_str *from_part;
+    struct arg_str *to_part;
+    struct arg_lit *tls;
+    struct arg_str *tls_cipher;
+    struct arg_int *tls_record;
+    struct arg_int *batch;
+    struct arg_lit *pps_sweep;
     struct arg_lit *abort;
     struct arg_end *end;
 } wifi_iperf_t;
@@ -39,9 +67,16 @@ typedef struct {
     struct arg_str *password;
     struct arg_end *end;
 } wifi_args_t;
-static wifi_args_t sta_args;
 static wifi_args_t ap_args;
 
+typedef struct {
+    struct arg_str *ssid;
+    struct arg_str *password;
+    struct arg_str *static_ip;
+    struct arg_end *end;
+} wifi_sta_args_t;
+static wifi_sta_args_t sta_args;
+
 typedef struct {
     struct arg_str *ssid;
     struct arg_end *end;
@@ -63,6 +98,74 @@ static EventGroupHandle_t wifi_event_group;
 const int CONNECTED_BIT = BIT0;
 const int DISCONNECTED_BIT = BIT1;
 
+#define WIFI_NVS_NAMESPACE "wifi"
+#define WIFI_NVS_AP_KEY "ap_cache"
+
+/* the AP we last associated with, kept in NVS so joining it again can skip the scan */
+typedef struct {
+    uint8_t ssid[32];
+    uint8_t bssid[6];
+    uint8_t channel;
+} wifi_ap_cache_t;
+
+static bool s_fast_join; /* the join in progress uses the cached BSSID/channel */
+
+/* esp_timer_get_time() (time since boot) at each step of a join, for the time-to-first-byte breakdown */
+static int64_t s_join_us;
+static int64_t s_assoc_us;
+static int64_t s_ip_us;
+static bool s_timing_shown;
+
+static bool wifi_ap_cache_load(wifi_ap_cache_t *cache)
+{
+    size_t len = sizeof(*cache);
+    nvs_handle nvs;
+    esp_err_t err;
+
+    if (nvs_open(WIFI_NVS_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK) {
+        return false;
+    }
+    err = nvs_get_blob(nvs, WIFI_NVS_AP_KEY, cache, &len);
+    nvs_close(nvs);
+    return err == ESP_OK && len == sizeof(*cache);
+}
+
+static void wifi_ap_cache_save(const system_event_sta_connected_t *connected)
+{
+    wifi_ap_cache_t cache = { 0 };
+    wifi_ap_cache_t old;
+    nvs_handle nvs;
+
+    memcpy(cache.ssid, connected->ssid, connected->ssid_len < sizeof(cache.ssid) ? connected->ssid_len : sizeof(cache.ssid));
+    memcpy(cache.bssid, connected->bssid, sizeof(cache.bssid));
+    cache.channel = connected->channel;
+
+    /* don't wear the flash with the same AP on every boot */
+    if (wifi_ap_cache_load(&old) && memcmp(&old, &cache, sizeof(cache)) == 0) {
+        return;
+    }
+    if (nvs_open(WIFI_NVS_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK) {
+        return;
+    }
+    if (nvs_set_blob(nvs, WIFI_NVS_AP_KEY, &cache, sizeof(cache)) == ESP_OK) {
+        nvs_commit(nvs);
+    }
+    nvs_close(nvs);
+}
+
+/* the cached AP didn't answer: forget about it for this join and let the driver scan */
+static void wifi_fast_join_fallback(void)
+{
+    wifi_config_t cfg;
+
+    s_fast_join = false;
+    ESP_LOGI(TAG, "cached AP not found, falling back to a full scan");
+    esp_wifi_get_config(ESP_IF_WIFI_STA, &cfg);
+    cfg.sta.bssid_set = false;
+    cfg.sta.channel = 0;
+    esp_wifi_set_config(ESP_IF_WIFI_STA, &cfg);
+}
+
 static void scan_done_handler(void)
 {
     uint16_t sta_number = 0;
@@ -87,7 +190,17 @@ static void scan_done_handler(void)
 static esp_err_t event_handler(void *ctx, system_event_t *event)
 {
     switch(event->event_id) {
+        case SYSTEM_EVENT_STA_CONNECTED:
+            s_assoc_us = esp_timer_get_time();
+            s_fast_join = false;
+            wifi_ap_cache_save(&event->event_info.connected);
+            break;
         case SYSTEM_EVENT_STA_GOT_IP:
+            s_ip_us = esp_timer_get_time();
+            if (s_join_us) {
+                ESP_LOGI(TAG, "sta got IP %d ms after joining (associated after %d ms)",
+                         (int)((s_ip_us - s_join_us) / 1000), (int)((s_assoc_us - s_join_us) / 1000));
+            }
             xEventGroupClearBits(wifi_event_group, DISCONNECTED_BIT);
             xEventGroupSetBits(wifi_event_group, CONNECTED_BIT);
             break;
@@ -96,6 +209,9 @@ static esp_err_t event_handler(void *ctx, system_event_t *event)
             ESP_LOGI(TAG, "sta scan done");
             break;
         case SYSTEM_EVENT_STA_DISCONNECTED:
+            if (s_fast_join) {
+                wifi_fast_join_fallback();
+            }
             if (reconnect) {
                 ESP_LOGI(TAG, "sta disconnect, reconnect...");
                 esp_wifi_connect();
@@ -142,17 +258,30 @@ void initialise_wifi(void)
     ESP_LOGI(TAG, "initialise_wifi(): set default hostname to '%s'", Wifi_hostname);
 }
 
-static bool wifi_cmd_sta_join(const char* ssid, const char* pass)
+static bool wifi_cmd_sta_join(const char* ssid, const char* pass, const tcpip_adapter_ip_info_t *static_ip)
 {
     int bits = xEventGroupWaitBits(wifi_event_group, CONNECTED_BIT, 0, 1, 0);
 
     wifi_config_t wifi_config = { 0 };
+    wifi_ap_cache_t cache;
+    esp_err_t err;
 
     strlcpy((char*) wifi_config.sta.ssid, ssid, sizeof(wifi_config.sta.ssid));
     if (pass) {
         strlcpy((char*) wifi_config.sta.password, pass, sizeof(wifi_config.sta.password));
     }
 
+    /* go straight for the AP we used last time, on its channel, instead of scanning for it */
+    s_fast_join = false;
+    if (wifi_ap_cache_load(&cache) && strncmp((char *)cache.ssid, ssid, sizeof(cache.ssid)) == 0) {
+        wifi_config.sta.bssid_set = true;
+        memcpy(wifi_config.sta.bssid, cache.bssid, sizeof(wifi_config.sta.bssid));
+        wifi_config.sta.channel = cache.channel;
+        s_fast_join = true;
+        ESP_LOGI(TAG, "using cached AP %02x:%02x:%02x:%02x:%02x:%02x on channel %d", cache.bssid[0], cache.bssid[1],
+                 cache.bssid[2], cache.bssid[3], cache.bssid[4], cache.bssid[5], cache.channel);
+    }
+
     if (bits & CONNECTED_BIT) {
         reconnect = false;
         xEventGroupClearBits(wifi_event_group, CONNECTED_BIT);
@@ -160,7 +289,27 @@ static bool wifi_cmd_sta_join(const char* ssid, const char* pass)
         xEventGroupWaitBits(wifi_event_group, DISCONNECTED_BIT, 0, 1, portTICK_RATE_MS);
     }
 
+    if (static_ip) {
+        /* no DHCP: the address is up as soon as we're associated */
+        err = tcpip_adapter_dhcpc_stop(TCPIP_ADAPTER_IF_STA);
+        if (err != ESP_OK && err != ESP_ERR_TCPIP_ADAPTER_DHCP_ALREADY_STOPPED) {
+            ESP_LOGE(TAG, "stopping the DHCP client failed: %s", esp_err_to_name(err));
+            return false;
+        }
+        err = tcpip_adapter_set_ip_info(TCPIP_ADAPTER_IF_STA, static_ip);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "setting the static address failed: %s", esp_err_to_name(err));
+            return false;
+        }
+    } else {
+        tcpip_adapter_dhcpc_start(TCPIP_ADAPTER_IF_STA);
+    }
+
     reconnect = true;
+    s_join_us = esp_timer_get_time();
+    s_assoc_us = 0;
+    s_ip_us = 0;
+    s_timing_shown = false;
     ESP_ERROR_CHECK( esp_wifi_set_mode(WIFI_MODE_STA) );
     ESP_ERROR_CHECK( esp_wifi_set_config(ESP_IF_WIFI_STA, &wifi_config) );
     ESP_ERROR_CHECK( esp_wifi_connect() );
@@ -170,17 +319,48 @@ static bool wifi_cmd_sta_join(const char* ssid, const char* pass)
     return true;
 }
 
+/* parse "ip/gw/mask" */
+static bool wifi_parse_static_ip(const char *str, tcpip_adapter_ip_info_t *info)
+{
+    char buf[3 * 16];
+    char *gw;
+    char *mask;
+
+    strlcpy(buf, str, sizeof(buf));
+    gw = strchr(buf, '/');
+    mask = gw ? strchr(gw + 1, '/') : NULL;
+    if (!mask) {
+        return false;
+    }
+    *gw++ = '\0';
+    *mask++ = '\0';
+
+    info->ip.addr = ipaddr_addr(buf);
+    info->gw.addr = ipaddr_addr(gw);
+    info->netmask.addr = ipaddr_addr(mask);
+    return info->ip.addr != IPADDR_NONE && info->gw.addr != IPADDR_NONE && info->netmask.addr != IPADDR_NONE;
+}
+
 static int wifi_cmd_sta(int argc, char** argv)
 {
     int nerrors = arg_parse(argc, argv, (void**) &sta_args);
+    tcpip_adapter_ip_info_t static_ip;
 
     if (nerrors != 0) {
         arg_print_errors(stderr, sta_args.end, argv[0]);
         return 1;
     }
 
+    if (sta_args.static_ip->count != 0 && !wifi_parse_static_ip(sta_args.static_ip->sval[0], &static_ip)) {
+        ESP_LOGE(TAG, "--static should be <ip>/<gw>/<mask>, eg 192.168.1.50/192.168.1.1/255.255.255.0");
+        return 1;
+    }
+
     ESP_LOGI(TAG, "sta connecting to '%s'", sta_args.ssid->sval[0]);
-    wifi_cmd_sta_join(sta_args.ssid->sval[0], sta_args.password->sval[0]);
+    if (!wifi_cmd_sta_join(sta_args.ssid->sval[0], sta_args.password->sval[0],
+                           (sta_args.static_ip->count != 0) ? &static_ip : NULL)) {
+        return 1;
+    }
     return 0;
 }
 
@@ -307,10 +487,98 @@ static uint32_t wifi_get_local_ip(void)
      return ip_info.ip.addr;
 }
 
+/* print how long each step from boot to the first byte of the first test after a join took */
+static void wifi_iperf_timing_cb(iperf_handle_t handle, const iperf_result_t *result, void *arg)
+{
+    if (s_timing_shown || !s_ip_us || !result->start_us) {
+        return;
+    }
+    s_timing_shown = true;
+
+    printf("timing (ms since boot): sta %d, associated %d (+%d), IP %d (+%d), first byte %d (+%d)\n",
+           (int)(s_join_us / 1000), (int)(s_assoc_us / 1000), (int)((s_assoc_us - s_join_us) / 1000),
+           (int)(s_ip_us / 1000), (int)((s_ip_us - s_assoc_us) / 1000),
+           (int)(result->start_us / 1000), (int)((result->start_us - s_ip_us) / 1000));
+}
+
+/* a rate in bits/s, with an optional k, m or g suffix; returns the character after it, or NULL */
+static const char *wifi_parse_rate(const char *str, uint32_t *bps)
+{
+    char *end;
+    double rate = strtod(str, &end);
+
+    if (end == str || rate < 0) {
+        return NULL;
+    }
+    switch (*end) {
+    case 'k': case 'K': rate *= 1e3; end++; break;
+    case 'm': case 'M': rate *= 1e6; end++; break;
+    case 'g': case 'G': rate *= 1e9; end++; break;
+    default: break;
+    }
+    if (rate > UINT32_MAX) {
+        return NULL;
+    }
+    *bps = (uint32_t)rate;
+    return end;
+}
+
+/* --isochronous <fps>[:<mean>[,<stddev>]] */
+static esp_err_t wifi_parse_isoch(const char *str, iperf_cfg_t *cfg)
+{
+    char *end;
+    long fps = strtol(str, &end, 10);
+
+    if (end == str || fps <= 0 || fps > 1000) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    cfg->isoch_fps = fps;
+    cfg->isoch_mean_bps = IPERF_DEFAULT_ISOCH_MEAN_BPS;
+    cfg->isoch_stddev_bps = 0;
+    if (*end == ':') {
+        end = (char *)wifi_parse_rate(end + 1, &cfg->isoch_mean_bps);
+        if (!end || cfg->isoch_mean_bps == 0) {
+            return ESP_ERR_INVALID_ARG;
+        }
+        if (*end == ',') {
+            end = (char *)wifi_parse_rate(end + 1, &cfg->isoch_stddev_bps);
+            if (!end) {
+                return ESP_ERR_INVALID_ARG;
+            }
+        }
+    }
+    return (*end == '\0') ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+/* -l <bytes> | <min>-<max> | exp:<mean> */
+static esp_err_t wifi_parse_len(const char *str, iperf_cfg_t *cfg)
+{
+    unsigned min, max;
+    char c;
+
+    if (sscanf(str, "exp:%u%c", &min, &c) == 1 && min > 0) {
+        cfg->len_dist = IPERF_LEN_EXP;
+        cfg->len_min = min;
+    } else if (sscanf(str, "%u-%u%c", &min, &max, &c) == 2 && min > 0 && max >= min) {
+        cfg->len_dist = IPERF_LEN_UNIFORM;
+        cfg->len_min = min;
+        cfg->len_max = max;
+    } else if (sscanf(str, "%u%c", &min, &c) == 1 && min > 0) {
+        cfg->len_dist = IPERF_LEN_FIXED;
+        cfg->len_min = min;
+    } else {
+        return ESP_ERR_INVALID_ARG;
+    }
+    return ESP_OK;
+}
+
 static int wifi_cmd_iperf(int argc, char** argv)
 {
     int nerrors = arg_parse(argc, argv, (void**) &iperf_args);
     iperf_cfg_t cfg;
+    char sip_str[IPERF_ADDR_STR_LEN];
+    char dip_str[IPERF_ADDR_STR_LEN];
+    bool ipv6;
 
     if (nerrors != 0) {
         arg_print_errors(stderr, iperf_args.end, argv[0]);
@@ -324,22 +592,70 @@ static int wifi_cmd_iperf(int argc, char** argv)
         return 0;
     }
 
-    if ( ((iperf_args.ip->count == 0) && (iperf_args.server->count == 0)) ||
-         ((iperf_args.ip->count != 0) && (iperf_args.server->count != 0)) ) {
-        ESP_LOGE(TAG, "should specific client/server mode");
+    ipv6 = (iperf_args.ipv6->count != 0);
+    if (iperf_args.ip->count != 0) {
+        if (iperf_addr_from_str(iperf_args.ip->sval[0], &cfg.dip) != ESP_OK) {
+            ESP_LOGE(TAG, "invalid address %s", iperf_args.ip->sval[0]);
+            return 0;
+        }
+        ipv6 |= (cfg.dip.sa.sa_family != AF_INET);
+    }
+    if (iperf_args.group->count != 0) {
+        if (iperf_addr_from_str(iperf_args.group->sval[0], &cfg.group) != ESP_OK) {
+            ESP_LOGE(TAG, "invalid address %s", iperf_args.group->sval[0]);
+            return 0;
+        }
+        ipv6 |= (cfg.group.sa.sa_family != AF_INET);
+    }
+    if (ipv6 && ((iperf_args.ip->count != 0 && cfg.dip.sa.sa_family == AF_INET) ||
+                 (iperf_args.group->count != 0 && cfg.group.sa.sa_family == AF_INET))) {
+        ESP_LOGE(TAG, "can't mix IPv4 and IPv6 addresses");
+        return 0;
+    }
+#if !LWIP_IPV6
+    if (ipv6) {
+        ESP_LOGE(TAG, "IPv6 is disabled in lwIP");
         return 0;
     }
+#endif
 
-    if (iperf_args.ip->count == 0) {
-        cfg.flag |= IPERF_FLAG_SERVER;
+    if (iperf_args.self->count != 0) {
+        /* both ends run here over 127.0.0.1 (::1 with -V), so no client/server mode and no need for a link */
+        if ((iperf_args.ip->count != 0) || (iperf_args.server->count != 0)) {
+            ESP_LOGE(TAG, "--self can't be combined with client/server mode");
+            return 0;
+        }
+        cfg.flag |= IPERF_FLAG_SELF;
+        if (ipv6) {
+            iperf_addr_from_str("::", &cfg.sip);
+            cfg.dip = cfg.sip;
+        }
     } else {
-        cfg.dip = ipaddr_addr(iperf_args.ip->sval[0]);
-        cfg.flag |= IPERF_FLAG_CLIENT;
-    }
+        if ( ((iperf_args.ip->count == 0) && (iperf_args.server->count == 0)) ||
+             ((iperf_args.ip->count != 0) && (iperf_args.server->count != 0)) ) {
+            ESP_LOGE(TAG, "should specific client/server mode");
+            return 0;
+        }
 
-    cfg.sip = wifi_get_local_ip();
-    if (cfg.sip == 0) {
-        return 0;
+        if (iperf_args.ip->count == 0) {
+            cfg.flag |= IPERF_FLAG_SERVER;
+        } else {
+            cfg.flag |= IPERF_FLAG_CLIENT;
+        }
+
+        if (ipv6) {
+            /* listen on any address, lwIP picks the source (link-local or global) for the client */
+            iperf_addr_from_str("::", &cfg.sip);
+            if (!(cfg.flag & IPERF_FLAG_CLIENT)) {
+                cfg.dip = cfg.sip;
+            }
+        } else {
+            cfg.sip.sin.sin_family = AF_INET;
+            cfg.sip.sin.sin_addr.s_addr = wifi_get_local_ip();
+            if (cfg.sip.sin.sin_addr.s_addr == 0) {
+                return 0;
+            }
+        }
     }
 
     if (iperf_args.udp->count == 0) {
@@ -348,11 +664,26 @@ static int wifi_cmd_iperf(int argc, char** argv)
         cfg.flag |= IPERF_FLAG_UDP;
     }
 
+    if (iperf_args.group->count != 0) {
+        if ((cfg.flag & (IPERF_FLAG_SERVER | IPERF_FLAG_UDP)) != (IPERF_FLAG_SERVER | IPERF_FLAG_UDP)) {
+            ESP_LOGE(TAG, "-B is only for the UDP server; for a multicast/broadcast client use -c <group>");
+            return 0;
+        }
+    }
+
+    if (iperf_args.ttl->count != 0) {
+        if (iperf_args.ttl->ival[0] <= 0 || iperf_args.ttl->ival[0] > 255) {
+            ESP_LOGE(TAG, "ttl should be 1-255");
+            return 0;
+        }
+        cfg.ttl = iperf_args.ttl->ival[0];
+    }
+
     if (iperf_args.port->count == 0) {
         cfg.sport = IPERF_DEFAULT_PORT;
         cfg.dport = IPERF_DEFAULT_PORT;
     } else {
-        if (cfg.flag & IPERF_FLAG_SERVER) {
+        if (cfg.flag & (IPERF_FLAG_SERVER | IPERF_FLAG_SELF)) {
             cfg.sport = iperf_args.port->ival[0];
             cfg.dport = IPERF_DEFAULT_PORT;
         } else {
@@ -370,8 +701,138 @@ static int wifi_cmd_iperf(int argc, char** argv)
         }
     }
 
+    if (iperf_args.auto_mode->count != 0) {
+        cfg.flag |= IPERF_FLAG_AUTO;
+        cfg.tolerance = IPERF_DEFAULT_AUTO_TOLERANCE;
+        if (iperf_args.tolerance->count != 0 && iperf_args.tolerance->ival[0] > 0) {
+            cfg.tolerance = iperf_args.tolerance->ival[0];
+        }
+    }
+
+    if (iperf_args.enhanced->count != 0) {
+        cfg.flag |= IPERF_FLAG_ENHANCED;
+    }
+
+    if (iperf_args.verify->count != 0) {
+        cfg.flag |= IPERF_FLAG_VERIFY;
+    }
+
+    if (iperf_args.single_task->count != 0) {
+        cfg.flag |= IPERF_FLAG_SINGLE_TASK;
+    }
+
+    if (iperf_args.isoch->count != 0) {
+        if (wifi_parse_isoch(iperf_args.isoch->sval[0], &cfg) != ESP_OK) {
+            ESP_LOGE(TAG, "invalid --isochronous %s, expected <fps>[:<mean>[,<stddev>]], eg 60:20m,2m", iperf_args.isoch->sval[0]);
+            return 0;
+        }
+        if (cfg.flag & (IPERF_FLAG_VERIFY | IPERF_FLAG_SELF)) {
+            ESP_LOGE(TAG, "--isochronous can't be combined with --verify or --self");
+            return 0;
+        }
+        cfg.flag |= IPERF_FLAG_ISOCHRONOUS;
+    }
+
+    if (iperf_args.burst->count != 0) {
+        char c;
+
+        if (sscanf(iperf_args.burst->sval[0], "%u/%u%c", &cfg.burst_on_ms, &cfg.burst_off_ms, &c) != 2 || cfg.burst_on_ms == 0) {
+            ESP_LOGE(TAG, "invalid --burst %s, expected <on_ms>/<off_ms>", iperf_args.burst->sval[0]);
+            return 0;
+        }
+    }
+
+    if (iperf_args.poisson->count != 0) {
+        if (iperf_args.poisson->ival[0] <= 0 || iperf_args.poisson->ival[0] > 1000000) {
+            ESP_LOGE(TAG, "invalid --poisson rate %d", iperf_args.poisson->ival[0]);
+            return 0;
+        }
+        cfg.pps = iperf_args.poisson->ival[0];
+    }
+
+    if (iperf_args.len->count != 0 && wifi_parse_len(iperf_args.len->sval[0], &cfg) != ESP_OK) {
+        ESP_LOGE(TAG, "invalid -l %s, expected <bytes>, <min>-<max> or exp:<mean>", iperf_args.len->sval[0]);
+        return 0;
+    }
+
+    if (iperf_args.seed->count != 0) {
+        cfg.seed = iperf_args.seed->ival[0];
+    }
+
+    if ((cfg.flag & IPERF_FLAG_ISOCHRONOUS) && (cfg.burst_on_ms || cfg.pps || cfg.len_min)) {
+        ESP_LOGE(TAG, "--isochronous sets its own timing and sizes, drop --burst, --poisson and -l");
+        return 0;
+    }
+
+    if (iperf_args.from_part->count != 0 || iperf_args.to_part->count != 0) {
+        const char *label = iperf_args.from_part->count ? iperf_args.from_part->sval[0] : iperf_args.to_part->sval[0];
+
+        if ((iperf_args.from_part->count != 0) != ((cfg.flag & IPERF_FLAG_CLIENT) != 0) || iperf_args.from_part->count + iperf_args.to_part->count > 1) {
+            ESP_LOGE(TAG, "--from-partition is for the client, --to-partition for the server");
+            return 0;
+        }
+        if (strlen(label) >= sizeof(cfg.partition)) {
+            ESP_LOGE(TAG, "partition label %s too long", label);
+            return 0;
+        }
+        if (cfg.flag & (IPERF_FLAG_UDP | IPERF_FLAG_SELF | IPERF_FLAG_VERIFY | IPERF_FLAG_ISOCHRONOUS) ||
+            cfg.burst_on_ms || cfg.pps || cfg.len_min) {
+            ESP_LOGE(TAG, "flash streaming is TCP only, without -u, --self, --verify, --isochronous, --burst, --poisson or -l");
+            return 0;
+        }
+        strlcpy(cfg.partition, label, sizeof(cfg.partition));
+        cfg.flag |= IPERF_FLAG_FLASH;
+    }
+
+    if (iperf_args.tls->count != 0) {
+        if (cfg.flag & (IPERF_FLAG_UDP | IPERF_FLAG_ISOCHRONOUS | IPERF_FLAG_FLASH)) {
+            ESP_LOGE(TAG, "--tls is TCP only, without --isochronous or a partition");
+            return 0;
+        }
+        cfg.flag |= IPERF_FLAG_TLS;
+#if CONFIG_IPERF_TLS
+        if (iperf_args.tls_cipher->count != 0) {
+            cfg.tls_ciphersuite = mbedtls_ssl_get_ciphersuite_id(iperf_args.tls_cipher->sval[0]);
+            if (cfg.tls_ciphersuite == 0) {
+                ESP_LOGE(TAG, "unknown or disabled ciphersuite %s", iperf_args.tls_cipher->sval[0]);
+                return 0;
+            }
+        }
+#endif
+        if (iperf_args.tls_record->count != 0) {
+            if (iperf_args.tls_record->ival[0] <= 0) {
+                ESP_LOGE(TAG, "invalid --tls-record %d", iperf_args.tls_record->ival[0]);
+                return 0;
+            }
+            cfg.tls_record = iperf_args.tls_record->ival[0];
+        }
+    }
+
+    if (iperf_args.batch->count != 0 || iperf_args.pps_sweep->count != 0) {
+        if (!(cfg.flag & IPERF_FLAG_UDP) || !(cfg.flag & IPERF_FLAG_CLIENT) || ipv6 ||
+            (cfg.flag & (IPERF_FLAG_VERIFY | IPERF_FLAG_ISOCHRONOUS)) || cfg.pps) {
+            ESP_LOGE(TAG, "--batch and --pps-sweep are for the IPv4 UDP client, without --verify, --isochronous or --poisson");
+            return 0;
+        }
+        if (iperf_args.batch->count != 0) {
+            if (iperf_args.batch->ival[0] <= 0 || iperf_args.batch->ival[0] > IPERF_MAX_BATCH) {
+                ESP_LOGE(TAG, "invalid --batch %d, 1-%d datagrams", iperf_args.batch->ival[0], IPERF_MAX_BATCH);
+                return 0;
+            }
+            cfg.batch = iperf_args.batch->ival[0];
+        }
+        if (iperf_args.pps_sweep->count != 0) {
+            cfg.flag |= IPERF_FLAG_PPS_SWEEP;
+        }
+    }
+
+    if (iperf_args.omit->count != 0 && iperf_args.omit->ival[0] > 0) {
+        cfg.omit = iperf_args.omit->ival[0];
+    }
+
     if (iperf_args.time->count == 0) {
-        cfg.time = IPERF_DEFAULT_TIME;
+        /* in --auto mode -t is only the upper bound, so allow more room by default */
+        cfg.time = (cfg.flag & IPERF_FLAG_AUTO) ? IPERF_DEFAULT_AUTO_TIME : IPERF_DEFAULT_TIME;
     } else {
         cfg.time = iperf_args.time->ival[0];
         if (cfg.time <= cfg.interval) {
@@ -379,13 +840,19 @@ static int wifi_cmd_iperf(int argc, char** argv)
         }
     }
 
-    ESP_LOGI(TAG, "mode=%s-%s sip=%d.%d.%d.%d:%d, dip=%d.%d.%d.%d:%d, interval=%d, time=%d",
+    /* IPv6 addresses go in brackets so the port stays readable */
+    ESP_LOGI(TAG, ipv6 ? "mode=%s-%s sip=[%s]:%d, dip=[%s]:%d, interval=%d, time=%d" :
+                         "mode=%s-%s sip=%s:%d, dip=%s:%d, interval=%d, time=%d",
             cfg.flag&IPERF_FLAG_TCP?"tcp":"udp",
             cfg.flag&IPERF_FLAG_SERVER?"server":"client",
-            cfg.sip&0xFF, (cfg.sip>>8)&0xFF, (cfg.sip>>16)&0xFF, (cfg.sip>>24)&0xFF, cfg.sport,
-            cfg.dip&0xFF, (cfg.dip>>8)&0xFF, (cfg.dip>>16)&0xFF, (cfg.dip>>24)&0xFF, cfg.dport,
+            iperf_addr_to_str(&cfg.sip, sip_str, sizeof(sip_str)), cfg.sport,
+            iperf_addr_to_str(&cfg.dip, dip_str, sizeof(dip_str)), cfg.dport,
             cfg.interval, cfg.time);
+    if (cfg.omit || (cfg.flag & IPERF_FLAG_AUTO)) {
+        ESP_LOGI(TAG, "omit=%d, auto=%s, tolerance=%d%%", cfg.omit, (cfg.flag & IPERF_FLAG_AUTO) ? "yes" : "no", cfg.tolerance);
+    }
 
+    cfg.result_cb = wifi_iperf_timing_cb;
     iperf_start(&cfg);
 
     return 0;
@@ -466,6 +933,7 @@ void register_wifi()
     //Command: sta
     sta_args.ssid = arg_str1(NULL, NULL, "<ssid>", "SSID of AP");
     sta_args.password = arg_str0(NULL, NULL, "<pass>", "password of AP");
+    sta_args.static_ip = arg_str0(NULL, "static", "<ip>/<gw>/<mask>", "use this address instead of DHCP");
     sta_args.end = arg_end(2);
     const esp_console_cmd_t sta_cmd = {
         .command = "sta",
@@ -498,12 +966,34 @@ void register_wifi()
     ESP_ERROR_CHECK( esp_console_cmd_register(&query_cmd) );
 
     //Command: iperf
-    iperf_args.ip = arg_str0("c", "client", "<ip>", "run in client mode, connecting to <host>");
+    iperf_args.ip = arg_str0("c", "client", "<ip>", "run in client mode, connecting to <host> (IPv4 or IPv6 literal)");
     iperf_args.server = arg_lit0("s", "server", "run in server mode");
+    iperf_args.self = arg_lit0(NULL, "self", "run server and client here over 127.0.0.1 (TCP, then UDP) to measure the stack alone, without the radio");
     iperf_args.udp = arg_lit0("u", "udp", "use UDP rather than TCP");
+    iperf_args.ipv6 = arg_lit0("V", "ipv6", "use IPv6 (implied by an IPv6 -c/-B address); server and --self listen on ::");
+    iperf_args.group = arg_str0("B", "bind", "<group>", "UDP server: join multicast <group> (or receive broadcasts, for a broadcast address) and receive on it");
+    iperf_args.ttl = arg_int0("T", "ttl", "<ttl>", "UDP client: time-to-live for multicast (default 1)");
     iperf_args.port = arg_int0("p", "port", "<port>", "server port to listen on/connect to");
     iperf_args.interval = arg_int0("i", "interval", "<interval>", "seconds between periodic bandwidth reports");
     iperf_args.time = arg_int0("t", "time", "<time>", "time in seconds to transmit for (default 10 secs)");
+    iperf_args.omit = arg_int0("O", "omit", "<omit>", "omit the first <omit> seconds of the test from the results, rounded up to whole intervals");
+    iperf_args.auto_mode = arg_lit0(NULL, "auto", "stop as soon as throughput has converged, using -t as the upper bound (default 60 secs)");
+    iperf_args.tolerance = arg_int0(NULL, "tolerance", "<pct>", "--auto: target 95% confidence interval, in percent of the mean (default 5)");
+    iperf_args.enhanced = arg_lit0("e", "enhanced", "TCP: add cwnd, RTT, retransmit and buffer state of the connection to each report");
+    iperf_args.verify = arg_lit0(NULL, "verify", "client: send a checkable pattern; server: check it and report corrupted bytes and reordered datagrams (both ends must use it)");
+    iperf_args.single_task = arg_lit0(NULL, "single-task", "report from the traffic task instead of a separate report task, saving its stack");
+    iperf_args.isoch = arg_str0(NULL, "isochronous", "<fps:mean,stddev>", "client: send video-like frames, <fps> a second, of a normally distributed size for <mean>/<stddev> bits/sec (k/m/g suffixes, default 20m,0); server: report frame loss and latency (only the flag matters)");
+    iperf_args.burst = arg_str0(NULL, "burst", "<on_ms/off_ms>", "client: send in bursts of <on_ms>, pausing <off_ms> between them");
+    iperf_args.poisson = arg_int0(NULL, "poisson", "<pps>", "client: Poisson arrivals, <pps> sends a second on average (exponential gaps)");
+    iperf_args.len = arg_str0("l", "len", "<len>", "client: bytes per send, <bytes>, uniform <min>-<max> or exponential exp:<mean> (UDP: datagram size)");
+    iperf_args.seed = arg_int0(NULL, "seed", "<seed>", "client: seed for --poisson and random -l, to repeat a run exactly (default: random, printed)");
+    iperf_args.from_part = arg_str0(NULL, "from-partition", "<label>", "TCP client: send the contents of this flash partition, read while sending");
+    iperf_args.to_part = arg_str0(NULL, "to-partition", "<label>", "TCP server: write what is received to this flash partition (erased as it goes!)");
+    iperf_args.tls = arg_lit0(NULL, "tls", "TCP: run the data through TLS (build option CONFIG_IPERF_TLS; the server uses a test certificate)");
+    iperf_args.tls_cipher = arg_str0(NULL, "tls-cipher", "<suite>", "--tls: offer/accept only this mbedTLS ciphersuite, eg TLS-ECDHE-ECDSA-WITH-AES-128-GCM-SHA256");
+    iperf_args.tls_record = arg_int0(NULL, "tls-record", "<bytes>", "--tls client: plaintext bytes per record (default: the largest the build allows)");
+    iperf_args.batch = arg_int0(NULL, "batch", "<n>", "UDP client: hand lwIP <n> datagrams per call into its thread (raw API, IPv4 only, default 1: one sendto each)");
+    iperf_args.pps_sweep = arg_lit0(NULL, "pps-sweep", "UDP client: packets/sec at 64-1472 byte datagrams, sendto against --batch (default 8); -t is the whole sweep");
     iperf_args.abort = arg_lit0("a", "abort", "abort running iperf");
     iperf_args.end = arg_end(1);
     const esp_console_cmd_t iperf_cmd = {
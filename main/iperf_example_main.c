@@ -24,6 +24,11 @@
 #include "cmd_decl.h"
 
 #include "cmd_autorun.h"
+#include "cmd_remote.h"
+#include "cmd_linkmon.h"
+#include "cmd_metrics.h"
+#include "cmd_trace.h"
+#include "cmd_capture.h"
 #include "rom/uart.h"
 
 #define WIFI_CONNECTED_BIT BIT0
@@ -86,7 +91,7 @@ void app_main(void)
     int err;
     if ((autorun_cmdlist = fn_autorun_get()) != NULL) {
         printf("ATTENTION: Autorun command-list is [%s]\n", autorun_cmdlist);
-        for (int ix=5; ix>0; --ix) {
+        for (int ix=fn_autorun_get_countdown(); ix>0; --ix) {
             printf("\rPress ^C to abort, or <Enter> to execute immediatelly before count reaches zero: %d", ix);
             static uint8_t ch;
             if ((err = uart_rx_one_char(&ch)) == OK) {
@@ -112,6 +117,11 @@ void app_main(void)
     register_system();
     register_wifi();
     register_autorun();
+    register_remote();
+    register_linkmon();
+    register_metrics();
+    register_trace();
+    register_capture();
 
     /* Prompt to be printed before each line.
      * This can be customized, made dynamic, etc.